@@ -0,0 +1,80 @@
+#ifndef CRYPTO_BACKEND_H
+#define CRYPTO_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The AES-256 implementation CryptoManager runs on, chosen at build time.
+// On the ESP32-S3 it is the AES peripheral driver, called directly rather
+// than through whatever mbedtls happens to be configured with; CBC and CTR
+// runs go through its DMA engine. Host builds use software mbedtls.
+#if defined(ESP_PLATFORM)
+#include <sdkconfig.h>
+#include <aes/esp_aes.h>
+#define CRYPTO_BACKEND_HARDWARE 1
+#define CRYPTO_BACKEND_NAME "AES peripheral (DMA)"
+typedef esp_aes_context CryptoAesContext;
+#else
+#include <mbedtls/aes.h>
+#define CRYPTO_BACKEND_HARDWARE 0
+#define CRYPTO_BACKEND_NAME "mbedtls software AES"
+typedef mbedtls_aes_context CryptoAesContext;
+#endif
+
+// SHA-256 and HMAC go through mbedtls, which the Arduino core builds to
+// use the SHA peripheral
+#if defined(CONFIG_MBEDTLS_HARDWARE_SHA)
+#define CRYPTO_SHA_NAME "SHA peripheral"
+#else
+#define CRYPTO_SHA_NAME "mbedtls software SHA-256"
+#endif
+
+inline void cryptoAesInit(CryptoAesContext* ctx) {
+#if CRYPTO_BACKEND_HARDWARE
+    esp_aes_init(ctx);
+#else
+    mbedtls_aes_init(ctx);
+#endif
+}
+
+// Also clears the key
+inline void cryptoAesFree(CryptoAesContext* ctx) {
+#if CRYPTO_BACKEND_HARDWARE
+    esp_aes_free(ctx);
+#else
+    mbedtls_aes_free(ctx);
+#endif
+}
+
+// The peripheral takes the same key both ways; software needs a schedule
+// per direction
+inline bool cryptoAesSetKey(CryptoAesContext* ctx, const uint8_t* key, bool encrypt) {
+#if CRYPTO_BACKEND_HARDWARE
+    (void)encrypt;
+    return esp_aes_setkey(ctx, key, 256) == 0;
+#else
+    return (encrypt ? mbedtls_aes_setkey_enc(ctx, key, 256) : mbedtls_aes_setkey_dec(ctx, key, 256)) == 0;
+#endif
+}
+
+// len must be whole blocks; iv is updated for the next call
+inline bool cryptoAesCbc(CryptoAesContext* ctx, bool encrypt, size_t len, uint8_t* iv,
+                         const uint8_t* in, uint8_t* out) {
+#if CRYPTO_BACKEND_HARDWARE
+    return esp_aes_crypt_cbc(ctx, encrypt ? ESP_AES_ENCRYPT : ESP_AES_DECRYPT, len, iv, in, out) == 0;
+#else
+    return mbedtls_aes_crypt_cbc(ctx, encrypt ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT, len, iv, in, out) == 0;
+#endif
+}
+
+// Works in place; counter, stream and streamPos carry over between calls
+inline bool cryptoAesCtr(CryptoAesContext* ctx, size_t len, size_t* streamPos, uint8_t* counter,
+                         uint8_t* stream, const uint8_t* in, uint8_t* out) {
+#if CRYPTO_BACKEND_HARDWARE
+    return esp_aes_crypt_ctr(ctx, len, streamPos, counter, stream, in, out) == 0;
+#else
+    return mbedtls_aes_crypt_ctr(ctx, len, streamPos, counter, stream, in, out) == 0;
+#endif
+}
+
+#endif // CRYPTO_BACKEND_H
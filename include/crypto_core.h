@@ -0,0 +1,69 @@
+#ifndef CRYPTO_CORE_H
+#define CRYPTO_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "crypto_backend.h"
+
+// The part of CryptoManager that needs only a keyed AES context: PKCS7
+// padding, CBC into caller buffers, the scratch buffer and the benchmark
+// sweep. It has no FS, NVS or FreeRTOS in it, so the native env builds it
+// against host mbedtls (see test/test_native_crypto).
+
+#define CRYPTO_BLOCK_SIZE 16
+
+// Throughput benchmark: buffer sizes from 16 B to 1 MB, each op timed for
+// at least this long
+#define CRYPTO_BENCH_MAX_BYTES (1024 * 1024)
+#define CRYPTO_BENCH_MIN_US    50000
+
+// A buffer kept by a caller that encrypts or decrypts over and over. It
+// grows to the largest size asked for and is then reused, so calls after
+// the first do not allocate. Wiped whenever it is freed.
+class CryptoScratch {
+public:
+    CryptoScratch() = default;
+    ~CryptoScratch();
+
+    // At least len bytes; earlier contents are not kept
+    uint8_t* get(size_t len);
+    // Free it if it grew past keep bytes
+    void trim(size_t keep);
+    void release();
+
+private:
+    CryptoScratch(const CryptoScratch&) = delete;
+    CryptoScratch& operator=(const CryptoScratch&) = delete;
+
+    std::vector<uint8_t> buffer;
+};
+
+// Ciphertext size for len bytes of plaintext (PKCS7 adds 1 to 16)
+inline size_t cryptoPaddedSize(size_t len) {
+    return (len / CRYPTO_BLOCK_SIZE + 1) * CRYPTO_BLOCK_SIZE;
+}
+
+// Length of data without its PKCS7 padding; false if the padding is bad,
+// which is what a wrong key or damaged ciphertext usually looks like
+bool cryptoUnpaddedLength(const uint8_t* data, size_t len, size_t& outLen);
+
+// AES-CBC with PKCS7 padding under a context keyed for that direction,
+// without allocating. Encryption needs cryptoPaddedSize(inputLen) bytes of
+// output and writes the padding into its tail; decryption needs inputLen
+// bytes and leaves the padding in place, past outputLen. output may be
+// input itself; iv is not changed.
+bool cryptoCbcEncrypt(CryptoAesContext* ctx, const uint8_t* iv, const uint8_t* input, size_t inputLen,
+                      uint8_t* output, size_t outputSize, size_t& outputLen);
+bool cryptoCbcDecrypt(CryptoAesContext* ctx, const uint8_t* iv, const uint8_t* input, size_t inputLen,
+                      uint8_t* output, size_t outputSize, size_t& outputLen);
+
+// The benchmark: MB/s for CBC, CTR and HMAC over buffers from 16 B up to
+// capacity, growing 4x, through contexts the caller has keyed each way.
+// The report is handed out a line at a time; clock returns microseconds.
+typedef unsigned long (*CryptoBenchClock)();
+typedef void (*CryptoBenchLine)(const char* line, void* arg);
+bool cryptoBenchmark(CryptoAesContext* enc, CryptoAesContext* dec, uint8_t* buffer, size_t capacity,
+                     CryptoBenchClock clock, CryptoBenchLine out, void* arg);
+
+#endif // CRYPTO_CORE_H
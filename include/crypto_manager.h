@@ -2,13 +2,104 @@
 #define CRYPTO_MANAGER_H
 
 #include <Arduino.h>
-#include <mbedtls/aes.h>
+#include <FS.h>
 #include <mbedtls/md.h>
 #include <Preferences.h>
 #include <vector>
+#include "crypto_backend.h"
+#include "crypto_core.h"
+
+// File encryption is streamed in chunks of this size. A helper task reads
+// a few chunks ahead while earlier ones are encrypted and written.
+#define CRYPTO_FILE_CHUNK  4096
+#define CRYPTO_FILE_CHUNKS 3
+#define CRYPTO_READER_STACK    3072
+#define CRYPTO_READER_PRIORITY 1
+
+// Keyed AES contexts kept between calls, one per task using them at once
+#define CRYPTO_AES_CONTEXTS 3
+
+// Keys are versioned: rotateKey() makes a new key current and keeps this
+// many earlier ones, so what is still encrypted under them stays readable
+// (the macro log is re-encrypted while idle, see MacroStore). Beyond that
+// the oldest is dropped. Files and logs written before keys had versions
+// record 0, which stands for version 1.
+#define CRYPTO_OLD_KEYS 3
+
+// The keys can be kept in NVS wrapped under a key derived from a user
+// secret, an unlock pattern or a passphrase, by PBKDF2-HMAC-SHA256. Then
+// nothing can be decrypted from boot until unlock(), and lock() wipes the
+// keys from RAM again. The iteration count is calibrated at first boot so
+// that deriving takes about CRYPTO_UNLOCK_BUDGET_MS.
+#define CRYPTO_UNLOCK_BUDGET_MS   400
+#define CRYPTO_KDF_MIN_ITERATIONS 10000
+#define CRYPTO_KDF_MAX_ITERATIONS 1000000
+#define CRYPTO_SECRET_MAX         64     // Bytes
+
+// Files written by encryptFile(): AES-256-CBC under a random IV per file,
+// then a MAC over the header and ciphertext:
+//
+//   CryptoFileHeader
+//   ciphertext (paddedSize(plainLen) bytes)
+//   tag (truncated HMAC-SHA256)
+//
+// The header has a MAC of its own, so a file for another key, a damaged
+// header or a file of the wrong length is turned away before anything is
+// decrypted. The key ID tells keys apart without revealing them, and picks
+// which of the kept keys a file is under. Older firmware wrote raw CBC
+// under the stored IV and the first key, with no header and no MAC; such
+// files are read only when the caller asks for it, to migrate them.
+#define CRYPTO_FILE_MAGIC    0x434E4555   // "UENC"
+#define CRYPTO_FILE_VERSION  1
+#define CRYPTO_FILE_TAG_SIZE 16
+
+struct CryptoFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t keyId;
+    uint32_t plainLen;
+    uint8_t iv[16];
+    uint8_t mac[CRYPTO_FILE_TAG_SIZE];   // Over the fields above
+};
+
+// Sealed files: AES-256-CTR under a random nonce per file, with an
+// HMAC-SHA256 tag per chunk, so any range can be decrypted and checked on
+// its own, and chunks can be processed in parallel:
+//
+//   SealedHeader
+//   chunk 0 ciphertext (chunkSize bytes) + tag
+//   chunk 1 ciphertext + tag
+//   ...
+//   last chunk ciphertext (the rest) + tag
+//
+// A chunk's tag covers the nonce, the chunk's index and its ciphertext, so
+// chunks cannot be moved within or between files; the header's tag covers
+// the plaintext length, so truncation shows from the file size. Counter
+// blocks are the nonce and the block's 32-bit big-endian number in the file.
+// The MAC key is derived from the data key of the header's key version.
+#define SEALED_MAGIC        0x41455355   // "USEA"
+#define SEALED_VERSION      1
+#define SEALED_CHUNK        4096
+#define SEALED_NONCE_SIZE   12
+#define SEALED_TAG_SIZE     16           // Truncated HMAC-SHA256
+#define SEALED_BATCH_CHUNKS 8            // Read at once, split across both cores
+#define SEALED_WORKER_STACK 4096
+
+struct SealedHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t keyVersion;
+    uint32_t chunkSize;
+    uint32_t plainLen;
+    uint8_t nonce[SEALED_NONCE_SIZE];
+    uint8_t tag[SEALED_TAG_SIZE];   // Over the fields above
+};
 
 class CryptoManager {
 public:
+    static const size_t IV_SIZE = 16;
+    
     // Singleton pattern for secure key management
     static CryptoManager& getInstance();
     
@@ -19,42 +110,309 @@ public:
     bool encryptData(const uint8_t* input, size_t inputLen, std::vector<uint8_t>& output);
     bool decryptData(const uint8_t* input, size_t inputLen, std::vector<uint8_t>& output);
     
-    // File operations
+    // Same with a caller-supplied IV, for data that stores its own IV
+    bool encryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn, std::vector<uint8_t>& output);
+    bool decryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn, std::vector<uint8_t>& output);
+    void generateIV(uint8_t* out);  // IV_SIZE random bytes
+    
+    // Ciphertext size for len bytes of plaintext (PKCS7 adds 1 to 16)
+    static size_t paddedSize(size_t len) { return cryptoPaddedSize(len); }
+    
+    // Into a caller's buffer, without allocating. Encryption needs
+    // paddedSize(inputLen) bytes of output and writes the padding into its
+    // tail; decryption needs inputLen bytes. output may be input itself.
+    // keyVersion picks an earlier key; 0 is the current one.
+    bool encryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                     uint8_t* output, size_t outputSize, size_t& outputLen, uint16_t keyVersion = 0);
+    bool decryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                     uint8_t* output, size_t outputSize, size_t& outputLen, uint16_t keyVersion = 0);
+    // The same into a scratch buffer; output is valid until it is next used
+    bool encryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                     CryptoScratch& scratch, const uint8_t*& output, size_t& outputLen,
+                     uint16_t keyVersion = 0);
+    bool decryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                     CryptoScratch& scratch, const uint8_t*& output, size_t& outputLen,
+                     uint16_t keyVersion = 0);
+    
+    // File operations, in constant memory whatever the file size. On
+    // failure the output file is removed. Output has a CryptoFileHeader;
+    // input without one is turned away, unless allowLegacy takes it as
+    // unauthenticated raw CBC from older firmware. The tag is checked at
+    // the end, so the File versions may have written out plaintext before
+    // failing; it must be thrown away.
     bool encryptFile(const String& inputPath, const String& outputPath);
-    bool decryptFile(const String& inputPath, const String& outputPath);
+    bool decryptFile(const String& inputPath, const String& outputPath, bool allowLegacy = false);
+    // The same from the input's current position to its end
+    bool encryptFile(fs::File& input, fs::File& output);
+    bool decryptFile(fs::File& input, fs::File& output, bool allowLegacy = false);
+    
+    // Check the header of an encrypted file, read by the caller, in O(1):
+    // format, key, header MAC, and that the file (fileBytes from the
+    // header on) is exactly as long as the header says. keyVersion is the
+    // version of the key it is under.
+    bool checkFileHeader(const CryptoFileHeader& header, size_t fileBytes, uint16_t& keyVersion);
+    // Identifies the current key in file headers
+    uint32_t keyId() const { return currentKeyId; }
+    // The same for a kept key by version (0: the current one), and back
+    bool keyIdFor(uint16_t version, uint32_t& id);
+    bool keyVersionForId(uint32_t id, uint16_t& version);
     
     // In-memory operations for web UI
     String encryptString(const String& plainText);
     String decryptString(const String& cipherText);
     
+    // Sealed files (see SealedHeader). Decryption checks every chunk before
+    // writing it out; on failure the output file is removed.
+    bool sealFile(const String& inputPath, const String& outputPath);
+    bool unsealFile(const String& inputPath, const String& outputPath);
+    bool sealFile(fs::File& input, fs::File& output);
+    bool unsealFile(fs::File& input, fs::File& output);
+    // Random access: check a sealed file's header, then decrypt plaintext
+    // bytes [offset, offset + len), reading and checking only their chunks
+    bool openSealed(fs::File& file, SealedHeader& header);
+    bool readSealed(fs::File& file, const SealedHeader& header, uint32_t offset,
+                    uint8_t* out, size_t len);
+    
+    // MB/s of the backend (see crypto_backend.h) for CBC, CTR and HMAC over
+    // each buffer size, to pick chunk sizes by. Blocks for a few seconds.
+    String benchmark();
+    
     // Key management
-    bool rotateKey();  // Generate new key (will make old data unreadable)
+    bool rotateKey();  // New current key; the old one is kept (see CRYPTO_OLD_KEYS)
     bool hasValidKey();
+    uint16_t keyVersion() const { return currentKeyVersion; }
+    // A key version as recorded in a header, where 0 means version 1
+    static uint16_t storedKeyVersion(uint16_t stored) { return stored ? stored : 1; }
+    // The key of that version is still kept (0: the current one)
+    bool hasKey(uint16_t version);
+    
+    // Keys wrapped under a secret (see CRYPTO_UNLOCK_BUDGET_MS)
+    bool hasSecret();
+    bool isLocked() { return !initialized && hasSecret(); }
+    // Derive the wrapping key from the secret and load the keys with it;
+    // false if the secret is wrong. Takes about the unlock budget.
+    bool unlock(const uint8_t* secret, size_t len);
+    // Wipe the keys and the derived key; no-op for keys not under a secret
+    void lock();
+    // Wrap the keys under a new secret, or keep them plain again if len is
+    // 0. Needs the keys, so only while unlocked.
+    bool setSecret(const uint8_t* secret, size_t len);
+    // PBKDF2 iterations for new secrets, calibrated on first use
+    uint32_t kdfIterationCount();
     
 private:
-    CryptoManager() = default;
+    CryptoManager();
     ~CryptoManager() = default;
     CryptoManager(const CryptoManager&) = delete;
     CryptoManager& operator=(const CryptoManager&) = delete;
     
     // AES-256 requires 32-byte key and 16-byte IV
     static const size_t KEY_SIZE = 32;
-    static const size_t IV_SIZE = 16;
     static const size_t BLOCK_SIZE = 16;
     
     uint8_t encryptionKey[KEY_SIZE];
     uint8_t iv[IV_SIZE];
     bool initialized = false;
+    uint16_t currentKeyVersion = 1;
+
+    // Keys that were current before, kept in NVS as one blob
+    struct OldKey {
+        uint16_t version;          // 0: unused
+        uint32_t id;
+        uint8_t key[KEY_SIZE];
+    };
+    OldKey oldKeys[CRYPTO_OLD_KEYS] = {};
+
+    // All keys and their version in one NVS blob, so they change together,
+    // encrypted with AES-256-CTR and authenticated with HMAC-SHA256 under
+    // keys derived from the secret
+    struct WrappedKeys {
+        uint32_t iterations;
+        uint8_t salt[16];
+        uint8_t nonce[16];         // First counter block
+        uint16_t keyVersion;
+        uint8_t keys[KEY_SIZE + sizeof(OldKey) * CRYPTO_OLD_KEYS];
+        uint8_t tag[16];           // Over everything above
+    };
+    // Derived from the secret (AES key, then MAC key); kept only while
+    // unlocked, to wrap the keys again when they change
+    uint8_t wrapKey[2 * KEY_SIZE];
+    uint8_t wrapSalt[16];
+    uint32_t wrapIterations = 0;
+    bool wrapKeyCached = false;
+    uint32_t kdfIterations = 0;
+
+    // Key schedules are computed once per key and kept, rather than on every
+    // call. A slot is used by one task at a time (see AesLease).
+    struct AesSlot {
+        CryptoAesContext enc;
+        CryptoAesContext dec;
+        uint32_t encKey;           // keyGeneration each schedule is for; 0: none
+        uint32_t decKey;
+        TaskHandle_t owner;        // Task that used it last
+        bool busy;
+    };
+    AesSlot slots[CRYPTO_AES_CONTEXTS];
+    uint32_t keyGeneration = 0;    // Bumped whenever the key changes
+    uint32_t currentKeyId = 0;     // Derived from encryptionKey
+    portMUX_TYPE slotMux = portMUX_INITIALIZER_UNLOCKED;
+
+    AesSlot* acquireSlot();
+    void releaseSlot(AesSlot* slot);
+    void clearSlots();
     
     // Generate or load encryption key from NVS
     bool loadOrGenerateKey();
     bool saveKeyToNVS();
     bool loadKeyFromNVS();
+    bool deriveWrapKey(const uint8_t* secret, size_t len, const uint8_t* salt, uint32_t iterations,
+                       uint8_t* out);
+    bool wrapKeys(WrappedKeys& wrapped);
+    bool unwrapKeys(WrappedKeys& wrapped);
+    uint32_t calibrateKdf();
+
+    void deriveKeys();
+    const uint8_t* keyFor(uint16_t version);   // nullptr if not kept
+    // A MAC key derived from the key of that version; the caller wipes it
+    bool macKeyFor(uint16_t version, const char* label, uint8_t* out);
+    bool cryptFile(fs::File& input, fs::File& output, bool encrypt, bool allowLegacy = false);
+    bool cryptFile(const String& inputPath, const String& outputPath, bool encrypt, bool allowLegacy = false);
+    bool fileHeaderMac(const CryptoFileHeader& header, uint16_t keyVersion, uint8_t* mac);
+    bool sealedTag(const SealedHeader& header, const uint8_t* macKey, uint8_t* tag);
+    bool sealedChunks(fs::File& file, const SealedHeader& header, const uint8_t* macKey,
+                      uint32_t first, size_t count, std::vector<uint8_t>& batch);
+    bool sealPath(const String& inputPath, const String& outputPath, bool seal);
     
     // Helper functions
     void generateRandomBytes(uint8_t* buffer, size_t length);
-    std::vector<uint8_t> addPKCS7Padding(const std::vector<uint8_t>& data);
-    std::vector<uint8_t> removePKCS7Padding(const std::vector<uint8_t>& data);
+
+    friend class AesLease;
+    friend class CryptoFileMac;
+    friend class CryptoMac;
+    friend class CbcEncryptStream;
+    friend class CbcDecryptStream;
+};
+
+// An AES context keyed with the manager's key, borrowed from its pool until
+// released. The calling task gets back the slot it used last if it is free.
+// When every slot is in use, a private context is keyed instead.
+class AesLease {
+public:
+    AesLease() = default;
+    ~AesLease() { release(); }
+
+    // With an earlier key if keyVersion is not 0 or the current one; those
+    // are not pooled
+    bool acquire(bool encrypt, uint16_t keyVersion = 0);
+    void release();
+    CryptoAesContext* context() { return ctx; }
+
+private:
+    AesLease(const AesLease&) = delete;
+    AesLease& operator=(const AesLease&) = delete;
+
+    CryptoManager::AesSlot* slot = nullptr;
+    CryptoAesContext own;
+    bool ownUsed = false;
+    CryptoAesContext* ctx = nullptr;
+};
+
+// The tag at the end of an encrypted file, computed as the header and then
+// the ciphertext go past
+class CryptoFileMac {
+public:
+    CryptoFileMac();
+    ~CryptoFileMac();
+
+    bool begin(const CryptoFileHeader& header);
+    bool update(const uint8_t* data, size_t len);
+    bool finish(uint8_t* tag);            // CRYPTO_FILE_TAG_SIZE bytes
+    bool verify(const uint8_t* tag);      // In constant time
+
+private:
+    CryptoFileMac(const CryptoFileMac&) = delete;
+    CryptoFileMac& operator=(const CryptoFileMac&) = delete;
+
+    mbedtls_md_context_t md;
+};
+
+// A tag for another module's format (see MacroStore): HMAC-SHA256 under a
+// MAC key derived from the key of that version and the format's label,
+// truncated to len bytes. Set up once, so tags after the first do not
+// allocate.
+class CryptoMac {
+public:
+    CryptoMac();
+    ~CryptoMac();
+
+    bool begin(uint16_t keyVersion, const char* label);
+    bool update(const void* data, size_t len);
+    bool finish(uint8_t* tag, size_t len);
+    bool verify(const uint8_t* tag, size_t len);   // In constant time
+
+private:
+    CryptoMac(const CryptoMac&) = delete;
+    CryptoMac& operator=(const CryptoMac&) = delete;
+
+    mbedtls_md_context_t md;
+    bool ready = false;
+};
+
+// AES-256-CBC encryption of data that arrives in pieces of any size. Whole
+// blocks are encrypted as they come in; finish() pads the last one.
+class CbcEncryptStream {
+public:
+    static const size_t BLOCK_SIZE = 16;
+
+    CbcEncryptStream() = default;
+    ~CbcEncryptStream();
+
+    // With the manager's key, and its IV unless one is given
+    bool begin(const uint8_t* ivIn = nullptr);
+    // out needs room for len + BLOCK_SIZE bytes; returns the bytes written
+    size_t update(const uint8_t* in, size_t len, uint8_t* out);
+    // The padded last block (BLOCK_SIZE bytes)
+    bool finish(uint8_t* out, size_t& outLen);
+
+private:
+    CbcEncryptStream(const CbcEncryptStream&) = delete;
+    CbcEncryptStream& operator=(const CbcEncryptStream&) = delete;
+
+    AesLease lease;
+    uint8_t iv[BLOCK_SIZE];
+    uint8_t pending[BLOCK_SIZE];
+    size_t pendingLen = 0;
+    bool ready = false;
+};
+
+// AES-256-CBC decryption of data that arrives in pieces of any size, so a
+// large file is never held whole. The IV is chained from one piece to the
+// next, and the last block is held back until finish() strips the padding.
+class CbcDecryptStream {
+public:
+    static const size_t BLOCK_SIZE = 16;
+
+    CbcDecryptStream() = default;
+    ~CbcDecryptStream();
+
+    // With the manager's key (or an earlier one), and its IV unless one is
+    // given
+    bool begin(const uint8_t* ivIn = nullptr, uint16_t keyVersion = 0);
+    // out needs room for len + BLOCK_SIZE bytes; returns the bytes written
+    size_t update(const uint8_t* in, size_t len, uint8_t* out);
+    // The rest of the plaintext (less than a block); false if the input was
+    // not whole blocks or the padding is bad
+    bool finish(uint8_t* out, size_t& outLen);
+
+private:
+    CbcDecryptStream(const CbcDecryptStream&) = delete;
+    CbcDecryptStream& operator=(const CbcDecryptStream&) = delete;
+
+    AesLease lease;
+    uint8_t iv[BLOCK_SIZE];
+    uint8_t pending[BLOCK_SIZE];
+    size_t pendingLen = 0;
+    bool ready = false;
 };
 
 #endif // CRYPTO_MANAGER_H
@@ -0,0 +1,86 @@
+#ifndef HID_CALIBRATION_H
+#define HID_CALIBRATION_H
+
+#include <Arduino.h>
+#include "USBHIDKeyboard.h"
+#include "hid_injector.h"
+
+// Host names are part of NVS keys (15 chars max with the "p_" prefix)
+#define PACING_HOST_NAME_MAX 12
+
+// How fast a given host can be typed at
+struct PacingProfile {
+    uint32_t reportIntervalUs;
+    uint8_t maxKeysPerReport;
+    uint8_t reserved[3];
+};
+
+// Result of the last calibration run. Plain data, so the web task can take
+// a copy while the injection task replaces it.
+struct CalibrationResult {
+    bool valid;
+    uint32_t echoLatencyUs;    // Caps Lock press to LED output report
+    PacingProfile profile;
+    char host[PACING_HOST_NAME_MAX + 1];
+    const char* error;         // Static text; "" if none
+};
+
+// Measures how fast the host accepts reports by toggling lock keys and
+// timing the LED output reports it sends back, then stores the result as a
+// named per-host profile in NVS. The active profile is applied at boot.
+class HidCalibrator {
+public:
+    static HidCalibrator& getInstance();
+
+    // Hook the keyboard's LED events and apply the active profile
+    void begin(USBHIDKeyboard* keyboard);
+
+    // Runs for a few seconds and types lock keys only; call from the task
+    // that owns the HidInjector (see InjectionTask::enqueueCalibration)
+    bool calibrate(const String& host);
+
+    // Switch to a stored profile; changes the injector's pacing, so call
+    // from the task that owns it (see InjectionTask::enqueueHostSelect)
+    bool selectHost(const String& host);
+    String activeHost();
+    String knownHosts();       // Comma separated
+    bool loadProfile(const String& host, PacingProfile& out);
+
+    // A copy; safe from any task
+    CalibrationResult lastResult();
+
+private:
+    HidCalibrator() = default;
+    HidCalibrator(const HidCalibrator&) = delete;
+    HidCalibrator& operator=(const HidCalibrator&) = delete;
+
+    // Safe pacing used while probing, and the search resolution
+    static const uint32_t SLOW_INTERVAL_US = 20000;
+    static const uint32_t SEARCH_STEP_US = 250;
+    static const uint8_t TRIAL_TOGGLES = 8;
+    static const uint32_t ECHO_TIMEOUT_MS = 500;
+
+    CalibrationResult result = {false, 0, {}, "", ""};    // Under resultMux
+    portMUX_TYPE resultMux = portMUX_INITIALIZER_UNLOCKED;
+    bool publish(const CalibrationResult& run);
+
+    // Written from the USB event task
+    static volatile uint8_t ledState;
+    static volatile uint32_t ledEvents;
+    static volatile uint32_t capsToggles;
+    static volatile unsigned long lastLedEventUs;
+    static void onLedEvent(void* arg, esp_event_base_t base, int32_t id, void* data);
+
+    bool measureEcho(uint32_t& latencyUs);
+    bool trial(uint32_t intervalUs, uint32_t settleMs);
+    bool probeMultiKey(uint32_t intervalUs, uint32_t settleMs);
+    void restoreLeds(uint8_t wanted);
+    void tapKeys(const uint8_t* keycodes, uint8_t count);
+    bool waitForEvents(uint32_t target, uint32_t timeoutMs);
+
+    bool saveProfile(const String& host, const PacingProfile& profile);
+    void applyProfile(const PacingProfile& profile);
+    static bool validHostName(const String& host);
+};
+
+#endif // HID_CALIBRATION_H
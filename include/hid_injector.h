@@ -0,0 +1,90 @@
+#ifndef HID_INJECTOR_H
+#define HID_INJECTOR_H
+
+#include <Arduino.h>
+#include "USBHIDKeyboard.h"
+#include "keyboard_layouts.h"
+#include <vector>
+
+// HID modifier bits as they appear in byte 0 of a boot keyboard report
+#define HID_MOD_LCTRL   0x01
+#define HID_MOD_LSHIFT  0x02
+#define HID_MOD_LALT    0x04
+#define HID_MOD_LGUI    0x08
+#define HID_MOD_RCTRL   0x10
+#define HID_MOD_RSHIFT  0x20
+#define HID_MOD_RALT    0x40
+#define HID_MOD_RGUI    0x80
+
+// Full-speed HID endpoints are polled at most once per millisecond
+#define HID_POLL_INTERVAL_US 1000
+
+// One keystroke: HID usage code plus the modifiers held while it is pressed
+struct KeyStroke {
+    uint8_t modifiers;
+    uint8_t keycode;
+};
+
+// Called after each character while typing; return false to stop early
+typedef bool (*InjectProgressFn)(size_t done, size_t total, void* ctx);
+
+class HidInjector {
+public:
+    static HidInjector& getInstance();
+
+    // Attach to an already started keyboard device
+    void begin(USBHIDKeyboard* keyboard);
+
+    // Type text for the given host layout, packing keystrokes into as few
+    // reports as possible. Returns the number of characters that were typed.
+    size_t typeText(const char* text, size_t len, KeyboardLayoutId layout,
+                    InjectProgressFn progress = nullptr, void* ctx = nullptr);
+
+    // Type a precompiled keystroke stream (see compileText).
+    // Returns the number of keystrokes that were sent.
+    size_t typeKeyStrokes(const KeyStroke* strokes, size_t count,
+                          InjectProgressFn progress = nullptr, void* ctx = nullptr);
+
+    // Compile text into keystrokes once, ahead of injection.
+    // Returns the number of characters that cannot be typed (skipped).
+    static size_t compileText(const char* text, size_t len, KeyboardLayoutId layout,
+                              std::vector<KeyStroke>& out);
+
+    // Streaming interface: queue keystrokes, then flush() to release all keys
+    void pushKeyStroke(const KeyStroke& stroke);
+    void flush();
+
+    // Keystrokes that type one character: a dead-key prefix plus the key,
+    // so up to two. Returns 0 if the character is untypeable on the layout.
+    static uint8_t charToKeyStrokes(char c, KeyboardLayoutId layout, KeyStroke out[2]);
+
+    // Pacing: minimum gap between two reports, and keys packed per report (1-6)
+    void setReportInterval(uint32_t intervalUs);
+    void setMaxKeysPerReport(uint8_t maxKeys);
+    uint32_t getReportInterval() const { return reportIntervalUs; }
+    uint8_t getMaxKeysPerReport() const { return maxKeysPerReport; }
+
+private:
+    HidInjector() = default;
+    HidInjector(const HidInjector&) = delete;
+    HidInjector& operator=(const HidInjector&) = delete;
+
+    static const uint8_t REPORT_KEYS = 6;
+
+    USBHIDKeyboard* keyboard = nullptr;
+    uint32_t reportIntervalUs = HID_POLL_INTERVAL_US;
+    uint8_t maxKeysPerReport = REPORT_KEYS;
+
+    // Report being assembled and the last one the host has seen
+    KeyReport pending = {};
+    uint8_t pendingCount = 0;
+    KeyReport lastSent = {};
+    uint8_t lastSentCount = 0;
+    unsigned long lastReportUs = 0;
+
+    void sendPending();
+    void sendReport(const KeyReport& report, uint8_t keyCount);
+    static bool reportHasKey(const KeyReport& report, uint8_t count, uint8_t keycode);
+};
+
+#endif // HID_INJECTOR_H
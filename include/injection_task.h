@@ -0,0 +1,137 @@
+#ifndef INJECTION_TASK_H
+#define INJECTION_TASK_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "hid_injector.h"
+
+// Core and priority of the HID typing task (Arduino loop runs on core 1)
+#ifndef HID_TASK_CORE
+#define HID_TASK_CORE 0
+#endif
+#define HID_TASK_PRIORITY 3
+#define HID_TASK_STACK 4096
+
+// Jobs waiting behind the one being typed
+#define INJECTION_QUEUE_DEPTH 8
+
+// Ring between a streaming request and the typing task. The writer never
+// waits for room: it holds back the TCP acks for what it wrote and the
+// task acks what it has typed (see InjectionAckFn), so the sender is held
+// to one receive window, which must fit here (lwIP's default is 5744).
+#define INJECTION_RING_SIZE 8192
+
+// Called from the typing task with the number of bytes it took out of the
+// ring, so the writer can let as many more in
+typedef void (*InjectionAckFn)(size_t bytes, void* ctx);
+
+// Snapshot of what the injection task is doing
+struct InjectionStatus {
+    bool busy;             // A job is being typed
+    uint32_t jobId;        // Current (or last) job
+    size_t done;           // Characters/keystrokes typed so far
+    size_t total;
+    uint8_t queued;        // Jobs waiting in the queue
+    uint32_t finished;     // Jobs completed or cancelled since boot
+    bool lastCancelled;    // How the last finished job ended
+};
+
+class InjectionTask {
+public:
+    static InjectionTask& getInstance();
+
+    // Start the task on its core; the HidInjector must already be attached
+    bool begin();
+
+    // Queue a job and return at once. Data is copied, so callers may free
+    // their buffers. Returns the job id, or 0 if the queue is full.
+    uint32_t enqueueText(const char* text, size_t len, KeyboardLayoutId layout);
+    uint32_t enqueueKeyStrokes(const KeyStroke* strokes, size_t count);
+
+    // Run HidCalibrator::calibrate(host) in the task that owns the keyboard
+    uint32_t enqueueCalibration(const String& host);
+    // Switch pacing profile (HidCalibrator::selectHost) between jobs, never
+    // in the middle of one
+    uint32_t enqueueHostSelect(const String& host);
+
+    // Streaming job: typing starts with the first bytes written, while the
+    // rest is still arriving. Only one stream can be open at a time, of any
+    // length; expectedLen is for progress. ack is called as the ring
+    // drains, until the stream is closed. Returns the job id, or 0 if busy.
+    uint32_t openStream(KeyboardLayoutId layout, size_t expectedLen,
+                        InjectionAckFn ack = nullptr, void* ctx = nullptr);
+    // Copies into the ring and returns at once. Returns false if the stream
+    // was cancelled or the data does not fit (more than was acked).
+    bool writeStream(uint32_t jobId, const uint8_t* data, size_t len);
+    // No more data will follow; the task finishes typing what is in the
+    // ring. No ack is called once this returns. Every opened stream must be
+    // closed, also when its writes failed.
+    void closeStream(uint32_t jobId);
+
+    // Abort the job being typed and drop everything queued
+    void cancelAll();
+
+    bool isBusy();
+    InjectionStatus getStatus();
+
+private:
+    InjectionTask() = default;
+    InjectionTask(const InjectionTask&) = delete;
+    InjectionTask& operator=(const InjectionTask&) = delete;
+
+    enum JobType : uint8_t {
+        JOB_TEXT,
+        JOB_KEYSTROKES,
+        JOB_STREAM,
+        JOB_CALIBRATE,
+        JOB_SELECT_HOST
+    };
+
+    struct Job {
+        uint32_t id;
+        uint32_t generation;   // cancelAll() bumps the generation
+        JobType type;
+        KeyboardLayoutId layout;
+        void* data;            // Heap copy, freed by the task
+        size_t length;
+    };
+
+    QueueHandle_t queue = nullptr;
+    TaskHandle_t task = nullptr;
+
+    // The open stream. One writer and the task as reader; the ring is free
+    // for the next stream once both sides have let go of it.
+    portMUX_TYPE streamMux = portMUX_INITIALIZER_UNLOCKED;
+    uint8_t ring[INJECTION_RING_SIZE];
+    volatile size_t written = 0;           // Bytes written so far
+    volatile size_t consumed = 0;          // Bytes the task has taken
+    volatile uint32_t streamJobId = 0;     // Open stream, 0 if none
+    volatile bool streamClosed = false;    // Writer has sent everything
+    volatile bool streamAborted = false;   // Task stopped reading
+    InjectionAckFn ackFn = nullptr;        // Cleared by closeStream()
+    void* ackCtx = nullptr;
+    volatile bool acking = false;          // Task is inside ackFn
+    bool writerOpen = false;
+    bool readerOpen = false;
+    uint32_t nextJobId = 1;
+    std::atomic<uint32_t> generation{0};   // Bumped by cancelAll() from any task
+
+    // Progress, written by the task and read by anyone
+    volatile bool running = false;
+    volatile uint32_t currentJobId = 0;
+    volatile size_t progressDone = 0;
+    volatile size_t progressTotal = 0;
+    volatile uint32_t finishedJobs = 0;
+    volatile bool lastCancelled = false;
+
+    uint32_t enqueue(JobType type, KeyboardLayoutId layout, const void* data, size_t bytes, size_t length);
+    void runJob(const Job& job);
+    void runStream(const Job& job);
+    void ackStream(size_t bytes);
+    void stopReading(size_t done);
+    void releaseStream(bool writer);
+    static void taskMain(void* arg);
+    static bool onProgress(size_t done, size_t total, void* ctx);
+};
+
+#endif // INJECTION_TASK_H
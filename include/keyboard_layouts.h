@@ -0,0 +1,45 @@
+#ifndef KEYBOARD_LAYOUTS_H
+#define KEYBOARD_LAYOUTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Host keyboard layouts the injector can type for
+enum KeyboardLayoutId : uint8_t {
+    LAYOUT_US = 0,
+    LAYOUT_PL,
+    LAYOUT_DE,
+    LAYOUT_FR,
+    LAYOUT_UK,
+    LAYOUT_COUNT
+};
+
+// PL matches what the firmware always typed ('@' on AltGr+2)
+#define LAYOUT_DEFAULT LAYOUT_PL
+
+// How to type one ASCII character: an optional dead-key press, then the key.
+// keycode 0 means the character cannot be typed on this layout.
+struct LayoutKey {
+    uint8_t keycode;
+    uint8_t modifiers;
+    uint8_t deadKeycode;
+    uint8_t deadModifiers;
+};
+
+struct KeyboardLayout {
+    LayoutKey keys[128];
+};
+
+// Built at compile time in keyboard_layouts.cpp, indexed by KeyboardLayoutId
+extern const KeyboardLayout keyboardLayouts[LAYOUT_COUNT];
+
+// c must be 7-bit ASCII
+inline const LayoutKey& layoutLookup(KeyboardLayoutId layout, char c) {
+    return keyboardLayouts[layout].keys[(uint8_t)c];
+}
+
+// "US", "PL", ... (case-insensitive) <-> layout id
+bool keyboardLayoutFromName(const char* name, KeyboardLayoutId& out);
+const char* keyboardLayoutName(KeyboardLayoutId layout);
+
+#endif // KEYBOARD_LAYOUTS_H
@@ -0,0 +1,92 @@
+#ifndef MACRO_IMAGE_H
+#define MACRO_IMAGE_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <vector>
+#include "keyboard_layouts.h"
+#include "macro_store.h"
+#include "macro_table.h"
+
+// Raw data partition holding the image (see default_16MB.csv)
+#define MACRO_IMAGE_PARTITION "macros"
+#define MACRO_IMAGE_SUBTYPE   0x40
+
+#define MACRO_IMAGE_MAGIC   0x474D4955   // "UIMG"
+#define MACRO_IMAGE_VERSION 2
+
+#define MACRO_IMAGE_STEP_MACROS 32       // Written per updateStep()
+
+// A MacroTable laid out in flash, behind this header:
+//
+//   MacroImageHeader
+//   [MacroEntry x count][names, previews and keystrokes]
+//
+// Keystrokes are compiled in for stored macros that are not sensitive, so
+// they are typed straight from flash. Sensitive contents never leave the
+// encrypted log. Names, previews and keystrokes are plaintext, which is no
+// worse than the plain key in NVS on the same chip. Keys under a secret
+// are not on the chip, so then there is no image: none is written or
+// mapped, and what is left of one is erased.
+//
+// The image is only used if the log is still in the state it was written
+// from; the header is written last, so a torn update leaves no valid image.
+struct MacroImageHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t layout;
+    uint8_t reserved;
+    uint32_t count;
+    uint32_t tableBytes;
+    uint32_t crc;              // CRC32 of the table
+    MacroLogState log;
+};
+
+class MacroImage {
+public:
+    static MacroImage& getInstance();
+
+    // Find and map the partition
+    bool begin();
+
+    // Point the table at the image, with no copy in RAM, if the store's log
+    // has not changed since it was written. After a software reset or deep
+    // sleep the image's CRC pass is skipped if it was checked before.
+    bool load(MacroTable& table, KeyboardLayoutId& layout);
+
+    // Rewrite the image from a table loaded into RAM, a few macros per call
+    // while the device is idle. Returns true while more is to come; any
+    // change to the store in between makes it start over. When done the
+    // table is attached to the new image.
+    bool updateStep(MacroTable& table, KeyboardLayoutId layout);
+
+    // Erase the partition if anything was ever written to it. The table
+    // must not be attached to the image.
+    bool erase();
+
+private:
+    MacroImage() = default;
+    MacroImage(const MacroImage&) = delete;
+    MacroImage& operator=(const MacroImage&) = delete;
+
+    const esp_partition_t* partition = nullptr;
+    const uint8_t* mapped = nullptr;
+    spi_flash_mmap_handle_t mapHandle = 0;
+
+    // Update in progress
+    bool writing = false;
+    uint32_t writeGeneration = 0;
+    uint32_t skipGeneration = UINT32_MAX;  // Does not fit; wait for a change
+    size_t next = 0;
+    size_t dataStart = 0;
+    size_t dataSize = 0;
+    size_t erasedTo = 0;
+    std::vector<MacroEntry> entries;
+
+    bool writeAt(size_t offset, const void* data, size_t len);
+    bool writeMacro(MacroTable& table, size_t i);
+    bool finish(MacroTable& table, KeyboardLayoutId layout);
+    void abort();
+};
+
+#endif // MACRO_IMAGE_H
@@ -0,0 +1,68 @@
+#ifndef MACRO_PARSER_H
+#define MACRO_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "keyboard_layouts.h"
+
+// One macro line, as views into the parsed buffer (not NUL terminated)
+struct MacroRecord {
+    const char* name;
+    size_t nameLen;
+    const char* content;       // Escapes already decoded
+    size_t contentLen;
+    bool sensitive;
+    KeyboardLayoutId layout;   // From the last #!LAYOUT: line before it
+};
+
+struct MacroParseStats {
+    size_t lines;
+    size_t macros;
+    size_t sensitive;
+    size_t badLayouts;         // #!LAYOUT: lines with an unknown name
+    KeyboardLayoutId layout;   // Layout in effect at the end of the file
+};
+
+typedef void (*MacroRecordFn)(const MacroRecord& record, void* ctx);
+
+// Parse a macro file in one pass without allocating:
+//
+//   # comment
+//   #!LAYOUT:DE
+//   NAME:CONTENT
+//   SENSITIVE:NAME:CONTENT
+//
+// Lines are trimmed, and \n, \t and \\ in CONTENT are decoded in place, so
+// buf is modified. Records point into buf and are only valid while it is.
+MacroParseStats parseMacroBuffer(char* buf, size_t len, MacroRecordFn onRecord, void* ctx,
+                                 KeyboardLayoutId layout = LAYOUT_DEFAULT);
+
+// The same parser for text that arrives in pieces (read from a file a block
+// at a time). Whole lines are parsed in place in the piece they are in; only
+// a line split across pieces is copied, so memory is bounded by the longest
+// line rather than the file. Records are valid during the callback only.
+class MacroStreamParser {
+public:
+    MacroStreamParser(MacroRecordFn onRecord, void* ctx, KeyboardLayoutId layout = LAYOUT_DEFAULT);
+    ~MacroStreamParser();
+
+    // Modifies data, like parseMacroBuffer()
+    void feed(char* data, size_t len);
+    // Parse what is left of the last line
+    MacroParseStats finish();
+
+private:
+    MacroStreamParser(const MacroStreamParser&) = delete;
+    MacroStreamParser& operator=(const MacroStreamParser&) = delete;
+
+    MacroRecordFn onRecord;
+    void* ctx;
+    MacroParseStats stats;
+    std::vector<char> line;    // Start of a line split across pieces
+
+    void parse(char* data, size_t len);
+    void clearLine();
+};
+
+#endif // MACRO_PARSER_H
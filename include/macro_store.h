@@ -0,0 +1,382 @@
+#ifndef MACRO_STORE_H
+#define MACRO_STORE_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <vector>
+#include "crypto_manager.h"
+#include "keyboard_layouts.h"
+#include "macro_parser.h"
+#include "macro_table.h"
+
+#define MACRO_DB_PATH     "/macros.db"
+#define MACRO_DB_TMP_PATH "/macros.db.tmp"   // Compaction output
+#define MACRO_DB_BAD_PATH "/macros.db.bad"   // Unreadable log, kept aside
+
+#define MACRO_DB_MAGIC      0x42444D55   // "UMDB"
+#define MACRO_DB_VERSION    4
+#define MACRO_DB_TAG_SIZE   16           // Truncated HMAC-SHA256
+#define MACRO_RECORD_MAGIC  0x43455244   // "DREC"
+#define MACRO_TRAILER_MAGIC 0x444E4544   // "DEND"
+
+// On-SD log, all integers little endian:
+//
+//   MacroDbHeader
+//   MacroRecordHeader + ciphertext      a macro's content, own random IV
+//   ...
+//   encrypted index + MacroDbTrailer
+//   MacroRecordHeader + ciphertext
+//   ...
+//   encrypted index + MacroDbTrailer
+//
+// The file is only ever appended to. A save or a change appends the records
+// it needs, then an index: either a full one (MacroIndexHeader, then per
+// macro a MacroIndexEntry + name + preview), or a delta holding just the
+// entries that changed, whose trailer points back at the trailer it applies
+// to. Loading takes the last trailer whose index passes its tag, follows the
+// deltas back to a full index and replays them in order, so an append cut
+// short by power loss is simply not there. Contents are decrypted one record
+// at a time when a macro is typed or exported.
+//
+// The header names the log's key by its ID and has a MAC; every record and
+// index has an HMAC tag, under MAC keys derived from the log's key. A
+// record's tag covers its offset, and an index's tag its trailer, so
+// nothing can be moved or spliced in. Tags are checked before anything is
+// decrypted.
+//
+// Superseded records and indexes are garbage until compaction copies the
+// live records, still encrypted but tagged for where they land, to a new
+// file. It runs in small steps while the device is idle.
+//
+// Everything in a log is under the key version its header names. After the
+// key is rotated, appends stay under that version and the next compaction
+// re-encrypts each record under the current key as it copies it. A pass
+// records how far it got in NVS after every step, so one cut short by a
+// reboot picks up where it left off rather than starting over.
+//
+// The same path on internal flash (FFat) holds a byte-for-byte mirror of
+// the SD log. After every write the mirror is brought up to date, by
+// appending what it is missing, or copying the log whole if it is not a
+// prefix of it (after compaction). Reads are served from the mirror while it
+// matches the SD log, and from it alone when there is no card, which makes
+// the library read-only.
+#define MACRO_DB_MAX_DELTAS 32       // Then a full index is written instead
+
+#define MACRO_COMPACT_MIN_GARBAGE 16384
+#define MACRO_COMPACT_RATIO       4      // ...and at least 1/4 of the file
+#define MACRO_COMPACT_STEP_BYTES  8192   // Copied per compactStep()
+#define MACRO_COMPACT_NVS         "macrodb"   // Preferences namespace of the checkpoint
+
+#define MACRO_MIRROR_CHUNK 4096
+
+#define MACRO_STREAM_BLOCK 1024  // Macro file text read per step when saving
+
+#define MACRO_SCRATCH_KEEP 4096  // Ciphertext buffer kept between writes
+
+// Files written by older firmware, converted into the log on first boot
+#define MACRO_OLD_ENC_PATH "/macros.enc"     // Macro file text, AES-CBC (see CryptoFileHeader)
+#define MACRO_OLD_TXT_PATH "/macros.txt"
+
+struct MacroDbHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t keyId;            // Of every record and index (see CryptoManager::keyId())
+    uint8_t mac[MACRO_DB_TAG_SIZE];   // Over the fields above
+};
+
+struct MacroRecordHeader {
+    uint32_t magic;
+    uint32_t cipherLen;
+    uint8_t iv[16];
+    uint8_t tag[MACRO_DB_TAG_SIZE];   // Over the record's offset, the fields above and the ciphertext
+};
+
+struct MacroIndexHeader {
+    uint32_t count;
+    uint32_t nextId;
+    uint32_t nextVersion;      // Versions are never reused
+    uint8_t layout;            // Layout in effect at the end of the file
+    uint8_t reserved[3];
+};
+
+struct MacroIndexEntry {
+    uint32_t id;               // Stable across edits
+    uint32_t version;          // Changes with every edit (the HTTP ETag)
+    uint32_t recordOffset;
+    uint32_t recordLen;        // Header plus ciphertext
+    uint32_t contentLen;
+    uint32_t crc;              // CRC32 of the content, to spot unchanged macros
+    uint8_t flags;             // MACRO_FLAG_SENSITIVE, MACRO_FLAG_UNTYPEABLE
+    uint8_t layout;
+    uint8_t nameLen;
+    uint8_t previewLen;        // 0 for sensitive macros
+};
+
+// In a delta: the macro with this id was removed
+#define MACRO_INDEX_REMOVED 0x80
+
+struct MacroDbTrailer {
+    uint32_t indexOffset;
+    uint32_t indexLen;         // Ciphertext bytes
+    uint32_t prevTrailer;      // Delta: trailer it applies to; 0 for a full index
+    uint8_t iv[16];
+    uint8_t tag[MACRO_DB_TAG_SIZE];   // Over the fields above and the index ciphertext
+    uint32_t magic;
+};
+
+// Where a table built from the log stands: the log's length and current
+// trailer, which identify it, and the store's state that goes with them.
+// A table kept from earlier (see MacroImage) is only valid for this state.
+struct MacroLogState {
+    uint32_t size;
+    uint32_t lastTrailer;
+    uint32_t deltaCount;
+    uint32_t macroCount;
+    uint32_t nextId;
+    uint32_t nextVersion;
+    MacroDbTrailer trailer;
+};
+
+// How far a compaction pass got, for the log it was compacting
+struct MacroCompactCheckpoint {
+    uint32_t logSize;
+    uint32_t lastTrailer;
+    uint32_t next;             // Next table entry to copy
+    uint32_t offset;           // Bytes of the new log covered by entries before it
+    uint16_t keyVersion;       // The new log's
+    uint16_t reserved;
+};
+
+// Fills buffer with up to maxLen bytes of macro file text; len is 0 at the
+// end. Returns false if the text could not be read.
+typedef bool (*MacroTextFn)(char* buffer, size_t maxLen, size_t& len, void* ctx);
+
+enum MacroChangeResult : uint8_t {
+    MACRO_CHANGE_OK,
+    MACRO_CHANGE_NOT_FOUND,
+    MACRO_CHANGE_CONFLICT,     // Version did not match
+    MACRO_CHANGE_FAILED
+};
+
+class MacroStore {
+public:
+    static MacroStore& getInstance();
+
+    // Which file systems are mounted; call before anything else
+    void begin(bool sdAvailable, bool flashAvailable);
+    // Reads currently come from internal flash
+    bool readsFromFlash() const { return mirrorCurrent || !sdPresent; }
+
+    // A log (or one left behind by an interrupted compaction) is present
+    bool exists();
+
+    // Make the library match macro file text (see macro_parser.h). Macros
+    // that did not change keep their records, ids and versions; only new
+    // and changed ones are appended.
+    bool save(const char* text, size_t len);
+    // The same for text read a block at a time, so it is never held whole.
+    // Nothing is saved if reading fails part way.
+    bool save(MacroTextFn read, void* ctx);
+
+    // Add every macro to a table being built; contents stay on SD.
+    // layout receives the layout in effect at the end of the file.
+    bool load(MacroTable& table, KeyboardLayoutId& layout);
+
+    // Create (id 0) or replace one macro, or remove one. The table must hold
+    // what load() last put in it; it is where ids and versions are looked up,
+    // and it is updated in place of reloading. A non-zero ifVersion must
+    // match the macro's current version; versionOut is the new version.
+    // After MACRO_CHANGE_FAILED the table may be stale: load() it again.
+    MacroChangeResult put(uint32_t id, const MacroRecord& macro, uint32_t ifVersion,
+                          MacroTable& table, KeyboardLayoutId& layout,
+                          uint32_t& idOut, uint32_t& versionOut);
+    MacroChangeResult remove(uint32_t id, uint32_t ifVersion,
+                             MacroTable& table, KeyboardLayoutId& layout);
+
+    // State of the log the table was last loaded from or updated with;
+    // false if there is none
+    bool getState(MacroLogState& state);
+    // Take up a table kept from earlier instead of load(), if the log is
+    // still in the given state
+    bool resume(const MacroLogState& state);
+    // Changes whenever the log, or where its records are, changes
+    uint32_t generation() const { return appends; }
+
+    // Decrypt one macro's content
+    bool readContent(uint32_t recordOffset, uint32_t recordLen, std::vector<uint8_t>& out);
+
+    // Decrypted index with all deltas applied, for walking all macros
+    // (see MacroExporter)
+    bool readIndex(std::vector<uint8_t>& out);
+    // Next entry of a decrypted index starting at pos; returns its name
+    // (the preview follows it), or nullptr at the end or if damaged
+    static const char* nextEntry(const std::vector<uint8_t>& index, size_t& pos,
+                                 MacroIndexEntry& entry);
+
+    // Idle-time compaction, driven from the main loop. Each call does a
+    // bounded amount of work and returns true while more is to come; any
+    // change in between makes it start over. When it is done the table is
+    // rebuilt with the new record locations.
+    bool needsCompaction(const MacroTable& table);
+    // The log is under an earlier key and compaction will re-encrypt it
+    bool needsRekey();
+    bool compactStep(MacroTable& table, KeyboardLayoutId& layout);
+
+    // Readers holding record locations across calls (see MacroExporter);
+    // compaction does not swap files under them
+    void addReader();
+    void removeReader();
+
+    // Recursive; see MacroStoreLock
+    SemaphoreHandle_t mutex() const { return lock; }
+
+    // A name that survives formatLine() and parsing back unchanged
+    static bool validName(const char* name, size_t nameLen);
+
+    // One line of macro file text, with \n, \t and \ escaped
+    static void formatLine(String& out, const char* name, size_t nameLen,
+                           const char* content, size_t contentLen, bool sensitive);
+
+private:
+    MacroStore();
+    MacroStore(const MacroStore&) = delete;
+    MacroStore& operator=(const MacroStore&) = delete;
+
+    // Web handlers and the main loop both use the store
+    SemaphoreHandle_t lock = nullptr;
+    volatile int readers = 0;
+
+    bool sdPresent = false;
+    bool flashPresent = false;
+    bool mirrorCurrent = false;    // The flash mirror equals the SD log
+
+    // Where the next append goes, known once the index has been read
+    bool indexKnown = false;
+    uint32_t lastTrailer = 0;      // Offset of the current trailer
+    uint32_t deltaCount = 0;       // Deltas since the last full index
+    uint32_t macroCount = 0;
+    uint32_t nextId = 1;
+    uint32_t nextVersion = 1;
+    size_t dbSize = 0;
+    uint32_t appends = 0;          // Bumped by every save, change and compaction
+    uint16_t logKeyVersion = 1;    // Key version of the log
+
+    // Compaction in progress
+    bool compacting = false;
+    uint32_t compactAppends = 0;
+    size_t compactNext = 0;        // Next table entry to copy
+    uint32_t compactOffset = 0;
+    uint16_t compactKeyVersion = 0;  // Of the new log
+    fs::File compactFile;
+    std::vector<uint8_t> compactIndex;
+
+    // Records and indexes are encrypted into this, and tagged with that,
+    // under the lock
+    CryptoScratch scratch;
+    CryptoMac mac;
+
+    bool recover();
+    fs::FS& source();
+    bool writeHeader(fs::File& file, uint16_t keyVersion);
+    bool checkHeader(const MacroDbHeader& header, uint16_t& keyVersion);
+    bool syncMirror();
+    void dropMirror();
+    bool writeIndex(fs::File& file, uint32_t offset, const std::vector<uint8_t>& index,
+                    uint32_t prevTrailer, uint16_t keyVersion, uint32_t& trailerPos);
+    bool findTrailer(fs::File& file, size_t end, uint32_t& pos, MacroDbTrailer& trailer);
+    bool readIndexAt(fs::File& file, const MacroDbTrailer& trailer, std::vector<uint8_t>& out);
+    bool readLog(fs::FS& fs, std::vector<uint8_t>& out);
+    bool readChain(fs::File& file, const MacroDbTrailer& last, std::vector<uint8_t>& out,
+                   uint32_t& deltas);
+    bool buildTable(const std::vector<uint8_t>& index, MacroTable& table, KeyboardLayoutId& layout);
+    bool updateTable(MacroTable& table, int slot, const MacroRecord* macro, const MacroIndexEntry& entry);
+    MacroChangeResult change(uint32_t id, const MacroRecord* macro, uint32_t ifVersion,
+                             MacroTable& table, KeyboardLayoutId& layout,
+                             uint32_t& idOut, uint32_t& versionOut);
+    bool startCompaction();
+    bool resumeCompaction(const MacroTable& table);
+    bool copyRecord(fs::File& db, const MacroTable& table, size_t i, std::vector<uint8_t>& record);
+    bool finishCompaction(MacroTable& table, KeyboardLayoutId& layout);
+    void abortCompaction();
+};
+
+// Holds the store's lock for a scope. Everything that changes the table
+// (loading, edits, compaction, the flash image) does so under this lock,
+// so a holder may also read the table without a MacroTableLock; that one
+// is only taken for the moment a table is swapped or patched. Take this
+// lock first: never while holding a MacroTableLock alone.
+class MacroStoreLock {
+public:
+    MacroStoreLock() : mutex(MacroStore::getInstance().mutex()) { xSemaphoreTakeRecursive(mutex, portMAX_DELAY); }
+    ~MacroStoreLock() { xSemaphoreGiveRecursive(mutex); }
+
+private:
+    MacroStoreLock(const MacroStoreLock&) = delete;
+    MacroStoreLock& operator=(const MacroStoreLock&) = delete;
+
+    SemaphoreHandle_t mutex;
+};
+
+// Rebuilds the macro file text from the log one record at a time, so the
+// whole library is never in RAM (for chunked HTTP responses)
+class MacroExporter {
+public:
+    ~MacroExporter();
+    bool begin();
+    // Fill up to maxLen bytes; returns 0 at the end
+    size_t read(uint8_t* buffer, size_t maxLen);
+
+private:
+    std::vector<uint8_t> index;
+    std::vector<uint8_t> content;
+    size_t indexPos = 0;
+    uint32_t remaining = 0;
+    int lastLayout = -1;
+    String pending;
+    size_t pendingPos = 0;
+    bool failed = false;
+    bool reading = false;
+
+    bool nextLine();
+};
+
+// Macro file text from older firmware, read and decrypted a block at a time
+// (for migration and chunked HTTP responses)
+class MacroFileReader {
+public:
+    ~MacroFileReader();
+    // Opens MACRO_OLD_ENC_PATH, or MACRO_OLD_TXT_PATH; false if neither.
+    // An encrypted file without a CryptoFileHeader is unauthenticated raw
+    // CBC, read only with allowLegacy (see CryptoManager::decryptFile)
+    bool begin(bool allowLegacy = false);
+    // Fill up to maxLen bytes; returns 0 at the end or on failure
+    size_t read(uint8_t* buffer, size_t maxLen);
+    bool failed() const { return error; }
+    // Length of the text, if the file's header gives it
+    bool length(size_t& len) const;
+
+    // MacroTextFn for MacroStore::save(), ctx being the reader
+    static bool readText(char* buffer, size_t maxLen, size_t& len, void* ctx);
+
+private:
+    fs::File file;
+    CbcDecryptStream cbc;
+    CryptoFileHeader header = {};
+    CryptoFileMac mac;
+    size_t cipherLeft = 0;
+    bool encrypted = false;
+    bool authenticated = false;    // Has a CryptoFileHeader
+    bool done = false;
+    bool error = false;
+    std::vector<uint8_t> cipher;
+    std::vector<uint8_t> plain;
+    size_t plainLen = 0;
+    size_t plainPos = 0;
+
+    bool fill();
+};
+
+#endif // MACRO_STORE_H
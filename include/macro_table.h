@@ -0,0 +1,178 @@
+#ifndef MACRO_TABLE_H
+#define MACRO_TABLE_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "hid_injector.h"
+#include "keyboard_layouts.h"
+
+#define MACRO_FLAG_SENSITIVE 0x01
+#define MACRO_FLAG_STORED    0x02   // Content stays on SD, see MacroStore
+#define MACRO_FLAG_UNTYPEABLE 0x04  // Has characters its layout cannot type
+
+// Content kept in RAM for a stored macro (the display shows 15 chars)
+#define MACRO_PREVIEW_LEN 16
+
+// Room left after a committed table for in-place edits (see replaceStored)
+#define MACRO_TABLE_SLACK_MIN 2048
+
+// Where a stored macro's record is on SD, and which version it is
+struct MacroStoredRef {
+    uint32_t recordOffset;
+    uint32_t recordLen;
+    uint32_t id;
+    uint32_t version;
+    uint32_t crc;              // CRC32 of the content
+};
+
+// Index record; offsets are into the data area that follows the index
+struct MacroEntry {
+    uint32_t nameOffset;
+    uint32_t contentOffset;
+    uint32_t strokesOffset;    // Compiled KeyStroke array
+    uint32_t contentLen;
+    uint32_t strokeCount;
+    MacroStoredRef stored;     // Stored macros only
+    uint16_t nameLen;
+    uint8_t flags;
+    uint8_t layout;
+};
+
+// All loaded macros in one allocation (PSRAM when present):
+//
+//   [MacroEntry x count][names, contents and keystrokes]
+//
+// Names and contents are NUL terminated. Stored macros only keep a short
+// preview of their content and no keystrokes. A new table is built next to the
+// current one, which stays readable until commit() swaps them, and the old
+// table is freed in one go.
+//
+// The web handlers and the main loop both read and replace the table, so
+// readers hold a MacroTableLock while they use it (indexes and pointers are
+// only good that long). commit(), attach(), clear() and the in-place edits
+// take the same lock, so the old table is never freed under a reader.
+// Whoever builds or edits the table holds the store's lock for the whole
+// job (see MacroStoreLock); this one is only held for the swap.
+//
+// The layout has no pointers, so a table can also be used where it lies,
+// e.g. in mapped flash (see MacroImage). Stored macros there may carry
+// keystrokes too.
+class MacroTable {
+public:
+    static MacroTable& getInstance();
+
+    // Recursive; see MacroTableLock
+    SemaphoreHandle_t mutex() const { return lock; }
+
+    size_t count() const { return entryCount; }
+    const char* name(size_t i) const { return text(entries()[i].nameOffset); }
+    size_t nameLength(size_t i) const { return entries()[i].nameLen; }
+    // Full content, or a preview of at least MACRO_PREVIEW_LEN chars for
+    // stored macros; contentLength() is always the full length
+    const char* content(size_t i) const { return text(entries()[i].contentOffset); }
+    size_t contentLength(size_t i) const { return entries()[i].contentLen; }
+    bool isSensitive(size_t i) const { return entries()[i].flags & MACRO_FLAG_SENSITIVE; }
+    bool isStored(size_t i) const { return entries()[i].flags & MACRO_FLAG_STORED; }
+    bool hasUntypeable(size_t i) const { return entries()[i].flags & MACRO_FLAG_UNTYPEABLE; }
+    const MacroStoredRef& stored(size_t i) const { return entries()[i].stored; }
+    uint32_t recordOffset(size_t i) const { return entries()[i].stored.recordOffset; }
+    uint32_t recordLength(size_t i) const { return entries()[i].stored.recordLen; }
+    uint32_t id(size_t i) const { return entries()[i].stored.id; }
+    uint32_t version(size_t i) const { return entries()[i].stored.version; }
+    KeyboardLayoutId layout(size_t i) const { return (KeyboardLayoutId)entries()[i].layout; }
+    const KeyStroke* strokes(size_t i) const {
+        return (const KeyStroke*)(arena + dataStart() + entries()[i].strokesOffset);
+    }
+    size_t strokeCount(size_t i) const { return entries()[i].strokeCount; }
+    const MacroEntry& entry(size_t i) const { return entries()[i]; }
+
+    // Position of the stored macro with this id, or -1
+    int find(uint32_t id) const;
+
+    // Bytes used by the current table
+    size_t arenaSize() const { return arenaBytes; }
+
+    // Use count entries and their data at table instead of a copy in RAM.
+    // The memory must stay valid until the next commit() or clear(); it is
+    // never written or freed.
+    void attach(const uint8_t* table, size_t count, size_t bytes);
+    bool isAttached() const { return attached; }
+
+    // Build a replacement table: beginBuild(), add() each macro, commit().
+    // add() compiles the keystrokes and reports characters it had to skip.
+    void beginBuild();
+    bool add(const char* name, size_t nameLen, const char* content, size_t contentLen,
+             bool sensitive, KeyboardLayoutId layout, size_t* untypeable = nullptr);
+    // A macro whose content is loaded on demand from a record on SD. flags
+    // are MACRO_FLAG_SENSITIVE and MACRO_FLAG_UNTYPEABLE, worked out when
+    // the record was written.
+    bool addStored(const char* name, size_t nameLen, const char* preview, size_t previewLen,
+                   size_t contentLen, uint8_t flags, KeyboardLayoutId layout,
+                   const MacroStoredRef& ref);
+    bool commit();
+    void discardBuild();
+
+    // Edit one stored macro of a committed RAM table without a rebuild.
+    // New text goes into the room kept after the data; text it replaces is
+    // left unused until the next commit. Adding or removing an entry moves
+    // the data area by one MacroEntry. These return false when the table is
+    // attached or out of room, and the caller rebuilds it instead.
+    bool replaceStored(size_t i, const char* name, size_t nameLen, const char* preview,
+                       size_t previewLen, size_t contentLen, uint8_t flags,
+                       KeyboardLayoutId layout, const MacroStoredRef& ref);
+    bool appendStored(const char* name, size_t nameLen, const char* preview, size_t previewLen,
+                      size_t contentLen, uint8_t flags, KeyboardLayoutId layout,
+                      const MacroStoredRef& ref);
+    bool removeAt(size_t i);
+
+    void clear();
+
+private:
+    MacroTable();
+    MacroTable(const MacroTable&) = delete;
+    MacroTable& operator=(const MacroTable&) = delete;
+
+    SemaphoreHandle_t lock = nullptr;
+    const uint8_t* arena = nullptr;
+    size_t arenaBytes = 0;
+    size_t arenaCapacity = 0;      // Allocated, for a table of ours
+    size_t entryCount = 0;
+    bool attached = false;         // arena is not ours to free
+
+    // Table under construction: index and data grow separately
+    MacroEntry* buildEntries = nullptr;
+    size_t buildCount = 0;
+    size_t buildEntryCap = 0;
+    uint8_t* buildData = nullptr;
+    size_t buildDataSize = 0;
+    size_t buildDataCap = 0;
+
+    const MacroEntry* entries() const { return (const MacroEntry*)arena; }
+    size_t dataStart() const { return entryCount * sizeof(MacroEntry); }
+    const char* text(uint32_t offset) const { return (const char*)(arena + dataStart() + offset); }
+
+    bool reserveData(size_t extra);
+    bool setStored(MacroEntry& entry, const char* name, size_t nameLen, const char* preview,
+                   size_t previewLen, size_t contentLen, uint8_t flags, KeyboardLayoutId layout,
+                   const MacroStoredRef& ref);
+    MacroEntry* appendEntry(const char* name, size_t nameLen, const char* text, size_t textLen,
+                            size_t extra);
+    static void* allocate(size_t bytes);
+    static void* reallocate(void* ptr, size_t bytes);
+};
+
+// Holds the table's lock for a scope
+class MacroTableLock {
+public:
+    MacroTableLock() : mutex(MacroTable::getInstance().mutex()) { xSemaphoreTakeRecursive(mutex, portMAX_DELAY); }
+    ~MacroTableLock() { xSemaphoreGiveRecursive(mutex); }
+
+private:
+    MacroTableLock(const MacroTableLock&) = delete;
+    MacroTableLock& operator=(const MacroTableLock&) = delete;
+
+    SemaphoreHandle_t mutex;
+};
+
+#endif // MACRO_TABLE_H
@@ -0,0 +1,27 @@
+#ifndef TEXT_CODEC_H
+#define TEXT_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Binary <-> hex and base64 text through lookup tables, written into
+// buffers the caller sizes with the *Length helpers; nothing is allocated
+// and no terminating NUL is written. Decoders reject anything malformed
+// rather than guessing.
+
+// Uppercase hex, as encryptString has always produced
+inline size_t hexEncodedLength(size_t len) { return len * 2; }
+size_t hexEncode(const uint8_t* in, size_t len, char* out);
+// Either case; false on an odd length or a non-hex character. out needs
+// len / 2 bytes and may be in itself.
+bool hexDecode(const char* in, size_t len, uint8_t* out, size_t& outLen);
+
+// Standard alphabet (RFC 4648) with = padding
+inline size_t base64EncodedLength(size_t len) { return (len + 2) / 3 * 4; }
+size_t base64Encode(const uint8_t* in, size_t len, char* out);
+// len must be a multiple of 4; false on anything outside the alphabet or
+// misplaced padding. out needs base64DecodedMaxLength(len) bytes.
+inline size_t base64DecodedMaxLength(size_t len) { return len / 4 * 3; }
+bool base64Decode(const char* in, size_t len, uint8_t* out, size_t& outLen);
+
+#endif // TEXT_CODEC_H
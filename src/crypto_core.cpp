@@ -0,0 +1,173 @@
+#include "../include/crypto_core.h"
+#include <stdio.h>
+#include <string.h>
+#include <mbedtls/md.h>
+#include <mbedtls/platform_util.h>
+
+CryptoScratch::~CryptoScratch() {
+    release();
+}
+
+uint8_t* CryptoScratch::get(size_t len) {
+    if (len > buffer.size() || buffer.empty()) {
+        // Wipe before the old buffer goes back to the heap
+        release();
+        buffer.resize(len > 0 ? len : 1);
+    }
+    return buffer.data();
+}
+
+void CryptoScratch::trim(size_t keep) {
+    if (buffer.size() > keep) {
+        release();
+    }
+}
+
+void CryptoScratch::release() {
+    if (!buffer.empty()) {
+        mbedtls_platform_zeroize(buffer.data(), buffer.size());
+    }
+    std::vector<uint8_t>().swap(buffer);
+}
+
+bool cryptoUnpaddedLength(const uint8_t* data, size_t len, size_t& outLen) {
+    if (len == 0 || len % CRYPTO_BLOCK_SIZE != 0) {
+        return false;  // Invalid data
+    }
+
+    uint8_t padding_length = data[len - 1];
+    if (padding_length == 0 || padding_length > CRYPTO_BLOCK_SIZE) {
+        return false;  // Invalid padding
+    }
+
+    // Verify padding
+    for (size_t i = len - padding_length; i < len; i++) {
+        if (data[i] != padding_length) {
+            return false;  // Invalid padding
+        }
+    }
+
+    outLen = len - padding_length;
+    return true;
+}
+
+bool cryptoCbcEncrypt(CryptoAesContext* ctx, const uint8_t* iv, const uint8_t* input, size_t inputLen,
+                      uint8_t* output, size_t outputSize, size_t& outputLen) {
+    size_t whole = inputLen - inputLen % CRYPTO_BLOCK_SIZE;
+    outputLen = cryptoPaddedSize(inputLen);
+    if (outputSize < outputLen) {
+        return false;
+    }
+
+    // Create a copy of IV (CBC mode modifies it)
+    uint8_t ivCopy[CRYPTO_BLOCK_SIZE];
+    memcpy(ivCopy, iv, CRYPTO_BLOCK_SIZE);
+
+    // Whole blocks straight from the input, then the padded last block
+    uint8_t block[CRYPTO_BLOCK_SIZE];
+    size_t rest = inputLen - whole;
+    if (rest > 0) {
+        memcpy(block, input + whole, rest);
+    }
+    memset(block + rest, CRYPTO_BLOCK_SIZE - rest, CRYPTO_BLOCK_SIZE - rest);
+
+    bool ok = (whole == 0 || cryptoAesCbc(ctx, true, whole, ivCopy, input, output)) &&
+              cryptoAesCbc(ctx, true, CRYPTO_BLOCK_SIZE, ivCopy, block, output + whole);
+    mbedtls_platform_zeroize(block, sizeof(block));
+    return ok;
+}
+
+bool cryptoCbcDecrypt(CryptoAesContext* ctx, const uint8_t* iv, const uint8_t* input, size_t inputLen,
+                      uint8_t* output, size_t outputSize, size_t& outputLen) {
+    if (inputLen == 0 || inputLen % CRYPTO_BLOCK_SIZE != 0 || outputSize < inputLen) {
+        return false;
+    }
+
+    // Create a copy of IV
+    uint8_t ivCopy[CRYPTO_BLOCK_SIZE];
+    memcpy(ivCopy, iv, CRYPTO_BLOCK_SIZE);
+
+    // Decrypt data
+    if (!cryptoAesCbc(ctx, false, inputLen, ivCopy, input, output)) {
+        return false;
+    }
+
+    // Padding is left in place, past outputLen
+    return cryptoUnpaddedLength(output, inputLen, outputLen);
+}
+
+enum BenchOp : uint8_t {
+    BENCH_CBC_ENCRYPT,
+    BENCH_CBC_DECRYPT,
+    BENCH_CTR,
+    BENCH_HMAC,
+    BENCH_CBC_KEYED,           // With a key schedule per call, as before the pool
+    BENCH_OP_COUNT
+};
+
+static bool benchOnce(BenchOp op, CryptoAesContext* enc, CryptoAesContext* dec, mbedtls_md_context_t& md,
+                      const uint8_t* key, uint8_t* buffer, size_t len) {
+    uint8_t iv[16] = {};
+    uint8_t stream[16];
+    size_t streamPos = 0;
+    uint8_t mac[32];
+
+    switch (op) {
+        case BENCH_CBC_ENCRYPT:
+            return cryptoAesCbc(enc, true, len, iv, buffer, buffer);
+        case BENCH_CBC_DECRYPT:
+            return cryptoAesCbc(dec, false, len, iv, buffer, buffer);
+        case BENCH_CTR:
+            return cryptoAesCtr(enc, len, &streamPos, iv, stream, buffer, buffer);
+        case BENCH_HMAC:
+            return mbedtls_md_hmac_starts(&md, key, 32) == 0 &&
+                   mbedtls_md_hmac_update(&md, buffer, len) == 0 &&
+                   mbedtls_md_hmac_finish(&md, mac) == 0;
+        case BENCH_CBC_KEYED: {
+            CryptoAesContext aes;
+            cryptoAesInit(&aes);
+            bool ok = cryptoAesSetKey(&aes, key, true) && cryptoAesCbc(&aes, true, len, iv, buffer, buffer);
+            cryptoAesFree(&aes);
+            return ok;
+        }
+        default:
+            return false;
+    }
+}
+
+bool cryptoBenchmark(CryptoAesContext* enc, CryptoAesContext* dec, uint8_t* buffer, size_t capacity,
+                     CryptoBenchClock clock, CryptoBenchLine out, void* arg) {
+    static const char* const names[BENCH_OP_COUNT] = {"cbc-enc", "cbc-dec", "ctr", "hmac", "cbc+key"};
+    memset(buffer, 0xA5, capacity);
+
+    // Contents do not matter; keep the real keys out of it
+    static const uint8_t key[32] = {};
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    bool ok = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) == 0;
+
+    char line[96];
+    snprintf(line, sizeof(line), "%8s %9s %9s %9s %9s %9s  (MB/s)",
+             "size", names[0], names[1], names[2], names[3], names[4]);
+    out(line, arg);
+
+    for (size_t len = 16; ok && len <= capacity; len *= 4) {
+        int pos = snprintf(line, sizeof(line), "%8lu", (unsigned long)len);
+        for (int op = 0; ok && op < BENCH_OP_COUNT; op++) {
+            unsigned long start = clock();
+            unsigned long elapsed = 0;
+            size_t bytes = 0;
+            do {
+                ok = benchOnce((BenchOp)op, enc, dec, md, key, buffer, len);
+                bytes += len;
+                elapsed = clock() - start;
+            } while (ok && elapsed < CRYPTO_BENCH_MIN_US);
+            // Bytes per microsecond is MB/s
+            pos += snprintf(line + pos, sizeof(line) - pos, " %9.2f", elapsed ? (double)bytes / elapsed : 0.0);
+        }
+        out(line, arg);
+    }
+
+    mbedtls_md_free(&md);
+    return ok;
+}
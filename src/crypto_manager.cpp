@@ -1,28 +1,164 @@
 #include "../include/crypto_manager.h"
+#include "../include/text_codec.h"
 #include <SD_MMC.h>
 #include <esp_random.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/platform_util.h>
+#include <mbedtls/pkcs5.h>
+
+// Labels the keys derived from a data key are made under
+static const char SEAL_MAC_LABEL[] = "USBone sealed file MAC";
+static const char FILE_MAC_LABEL[] = "USBone encrypted file MAC";
+static const char KEY_ID_LABEL[] = "USBone key ID";
+static const char KEY_WRAP_LABEL[] = "USBone key wrap";
 
 CryptoManager& CryptoManager::getInstance() {
     static CryptoManager instance;
     return instance;
 }
 
+CryptoManager::CryptoManager() {
+    for (AesSlot& slot : slots) {
+        cryptoAesInit(&slot.enc);
+        cryptoAesInit(&slot.dec);
+        slot.encKey = 0;
+        slot.decKey = 0;
+        slot.owner = nullptr;
+        slot.busy = false;
+    }
+}
+
+CryptoManager::AesSlot* CryptoManager::acquireSlot() {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    AesSlot* found = nullptr;
+
+    portENTER_CRITICAL(&slotMux);
+    for (AesSlot& slot : slots) {
+        if (!slot.busy && (!found || slot.owner == self)) {
+            found = &slot;
+        }
+    }
+    if (found) {
+        found->busy = true;
+        found->owner = self;
+    }
+    portEXIT_CRITICAL(&slotMux);
+    return found;
+}
+
+// A schedule for a key that has since changed or been locked away is
+// wiped here, so none outlives its key for longer than the lease
+static void wipeStale(CryptoAesContext* ctx, uint32_t& keyed, uint32_t generation) {
+    if (keyed != 0 && keyed != generation) {
+        cryptoAesFree(ctx);
+        cryptoAesInit(ctx);
+        keyed = 0;
+    }
+}
+
+void CryptoManager::releaseSlot(AesSlot* slot) {
+    portENTER_CRITICAL(&slotMux);
+    wipeStale(&slot->enc, slot->encKey, keyGeneration);
+    wipeStale(&slot->dec, slot->decKey, keyGeneration);
+    slot->busy = false;
+    portEXIT_CRITICAL(&slotMux);
+}
+
+// Drop the schedules of the old key; slots in use are wiped when their
+// lease is released, as their generation no longer matches
+void CryptoManager::clearSlots() {
+    portENTER_CRITICAL(&slotMux);
+    for (AesSlot& slot : slots) {
+        if (!slot.busy) {
+            wipeStale(&slot.enc, slot.encKey, keyGeneration);
+            wipeStale(&slot.dec, slot.decKey, keyGeneration);
+        }
+    }
+    portEXIT_CRITICAL(&slotMux);
+}
+
+bool AesLease::acquire(bool encrypt, uint16_t keyVersion) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    release();
+    if (!crypto.initialize()) {
+        return false;
+    }
+
+    // Earlier keys are only used until their data is re-encrypted
+    const uint8_t* key = crypto.encryptionKey;
+    if (keyVersion != 0 && keyVersion != crypto.currentKeyVersion) {
+        key = crypto.keyFor(keyVersion);
+        if (!key) {
+            return false;
+        }
+    }
+
+    uint32_t generation = crypto.keyGeneration;
+    slot = key == crypto.encryptionKey ? crypto.acquireSlot() : nullptr;
+    if (slot) {
+        CryptoAesContext* pooled = encrypt ? &slot->enc : &slot->dec;
+        uint32_t& keyed = encrypt ? slot->encKey : slot->decKey;
+        if (keyed != generation) {
+            if (!cryptoAesSetKey(pooled, crypto.encryptionKey, encrypt)) {
+                keyed = 0;
+                release();
+                return false;
+            }
+            keyed = generation;
+        }
+        ctx = pooled;
+        return true;
+    }
+
+    cryptoAesInit(&own);
+    ownUsed = true;
+    if (!cryptoAesSetKey(&own, key, encrypt)) {
+        release();
+        return false;
+    }
+    ctx = &own;
+    return true;
+}
+
+void AesLease::release() {
+    if (slot) {
+        CryptoManager::getInstance().releaseSlot(slot);
+        slot = nullptr;
+    }
+    if (ownUsed) {
+        // Clears the key schedule
+        cryptoAesFree(&own);
+        ownUsed = false;
+    }
+    ctx = nullptr;
+}
+
 bool CryptoManager::initialize() {
     if (initialized) {
         return true;
     }
     
+    // First boot: time the KDF on this chip before a secret can be set
+    kdfIterationCount();
+    
+    // Wrapped keys wait for unlock(), and are never replaced
+    if (hasSecret()) {
+        if (!wrapKeyCached || !loadKeyFromNVS()) {
+            return false;
+        }
+        deriveKeys();
+        initialized = true;
+        Serial.println("Crypto system unlocked");
+        return true;
+    }
+    
     // Load or generate encryption key
     if (!loadOrGenerateKey()) {
         Serial.println("Failed to initialize encryption key");
         return false;
     }
     
-    // Generate IV (can be static or dynamic per file)
-    // For simplicity, using a static IV stored with the key
-    // In production, consider using a unique IV per encryption
-    generateRandomBytes(iv, IV_SIZE);
-    
+    deriveKeys();
     initialized = true;
     Serial.println("Crypto system initialized successfully");
     return true;
@@ -38,6 +174,8 @@ bool CryptoManager::loadOrGenerateKey() {
     // Generate new key if none exists
     Serial.println("Generating new encryption key...");
     generateRandomBytes(encryptionKey, KEY_SIZE);
+    // The static IV is stored with the key and kept with it
+    generateRandomBytes(iv, IV_SIZE);
     
     // Save to NVS for persistence
     if (!saveKeyToNVS()) {
@@ -54,16 +192,39 @@ bool CryptoManager::saveKeyToNVS() {
         return false;
     }
     
-    // Save encryption key
-    size_t written = prefs.putBytes("aes_key", encryptionKey, KEY_SIZE);
-    if (written != KEY_SIZE) {
+    // Save IV
+    size_t written = prefs.putBytes("aes_iv", iv, IV_SIZE);
+    if (written != IV_SIZE) {
         prefs.end();
         return false;
     }
     
-    // Save IV
-    written = prefs.putBytes("aes_iv", iv, IV_SIZE);
-    if (written != IV_SIZE) {
+    // Under a secret the keys and their version are one blob; the plain
+    // ones go only once it is written
+    if (wrapKeyCached) {
+        WrappedKeys wrapped;
+        bool ok = wrapKeys(wrapped) && prefs.putBytes("wrapped", &wrapped, sizeof(wrapped)) == sizeof(wrapped);
+        mbedtls_platform_zeroize(&wrapped, sizeof(wrapped));
+        if (ok) {
+            prefs.remove("aes_key");
+            prefs.remove("old_keys");
+            prefs.putUInt("magic", 0xDEADBEEF);
+        }
+        prefs.end();
+        return ok;
+    }
+    
+    // Old keys, then the version, then the key: cut short anywhere, each
+    // stored key still goes with the version its data was written under
+    written = prefs.putBytes("old_keys", oldKeys, sizeof(oldKeys));
+    if (written != sizeof(oldKeys) || prefs.putUShort("key_ver", currentKeyVersion) == 0) {
+        prefs.end();
+        return false;
+    }
+    
+    // Save encryption key
+    written = prefs.putBytes("aes_key", encryptionKey, KEY_SIZE);
+    if (written != KEY_SIZE) {
         prefs.end();
         return false;
     }
@@ -71,6 +232,8 @@ bool CryptoManager::saveKeyToNVS() {
     // Save a magic number to verify key validity
     prefs.putUInt("magic", 0xDEADBEEF);
     
+    // No longer under a secret
+    prefs.remove("wrapped");
     prefs.end();
     return true;
 }
@@ -87,6 +250,22 @@ bool CryptoManager::loadKeyFromNVS() {
         return false;
     }
     
+    // Load IV
+    size_t ivLen = prefs.getBytes("aes_iv", iv, IV_SIZE);
+    if (ivLen != IV_SIZE) {
+        prefs.end();
+        return false;
+    }
+    
+    // Wrapped keys, with the key derived by unlock()
+    WrappedKeys wrapped;
+    if (prefs.getBytes("wrapped", &wrapped, sizeof(wrapped)) == sizeof(wrapped)) {
+        prefs.end();
+        bool ok = wrapKeyCached && unwrapKeys(wrapped);
+        mbedtls_platform_zeroize(&wrapped, sizeof(wrapped));
+        return ok;
+    }
+    
     // Load encryption key
     size_t keyLen = prefs.getBytes("aes_key", encryptionKey, KEY_SIZE);
     if (keyLen != KEY_SIZE) {
@@ -94,11 +273,10 @@ bool CryptoManager::loadKeyFromNVS() {
         return false;
     }
     
-    // Load IV
-    size_t ivLen = prefs.getBytes("aes_iv", iv, IV_SIZE);
-    if (ivLen != IV_SIZE) {
-        prefs.end();
-        return false;
+    // Keys from before versioning are version 1, with no old keys
+    currentKeyVersion = prefs.getUShort("key_ver", 1);
+    if (prefs.getBytes("old_keys", oldKeys, sizeof(oldKeys)) != sizeof(oldKeys)) {
+        memset(oldKeys, 0, sizeof(oldKeys));
     }
     
     prefs.end();
@@ -112,111 +290,80 @@ void CryptoManager::generateRandomBytes(uint8_t* buffer, size_t length) {
     }
 }
 
-std::vector<uint8_t> CryptoManager::addPKCS7Padding(const std::vector<uint8_t>& data) {
-    size_t padding_length = BLOCK_SIZE - (data.size() % BLOCK_SIZE);
-    std::vector<uint8_t> padded = data;
-    
-    for (size_t i = 0; i < padding_length; i++) {
-        padded.push_back(padding_length);
-    }
-    
-    return padded;
+bool CryptoManager::encryptData(const uint8_t* input, size_t inputLen, std::vector<uint8_t>& output) {
+    return encryptData(input, inputLen, iv, output);
 }
 
-std::vector<uint8_t> CryptoManager::removePKCS7Padding(const std::vector<uint8_t>& data) {
-    if (data.empty() || data.size() % BLOCK_SIZE != 0) {
-        return data;  // Invalid data
-    }
-    
-    uint8_t padding_length = data.back();
-    if (padding_length > BLOCK_SIZE || padding_length > data.size()) {
-        return data;  // Invalid padding
-    }
-    
-    // Verify padding
-    for (size_t i = data.size() - padding_length; i < data.size(); i++) {
-        if (data[i] != padding_length) {
-            return data;  // Invalid padding
-        }
-    }
-    
-    std::vector<uint8_t> unpadded(data.begin(), data.end() - padding_length);
-    return unpadded;
+bool CryptoManager::decryptData(const uint8_t* input, size_t inputLen, std::vector<uint8_t>& output) {
+    return decryptData(input, inputLen, iv, output);
 }
 
-bool CryptoManager::encryptData(const uint8_t* input, size_t inputLen, std::vector<uint8_t>& output) {
-    if (!initialized) {
-        return false;
-    }
-    
-    // Convert input to vector and add padding
-    std::vector<uint8_t> inputVec(input, input + inputLen);
-    std::vector<uint8_t> padded = addPKCS7Padding(inputVec);
-    
-    // Prepare output buffer
-    output.resize(padded.size());
-    
-    // Setup AES context
-    mbedtls_aes_context aes;
-    mbedtls_aes_init(&aes);
-    
-    // Set encryption key
-    int ret = mbedtls_aes_setkey_enc(&aes, encryptionKey, 256);
-    if (ret != 0) {
-        mbedtls_aes_free(&aes);
-        return false;
-    }
-    
-    // Create a copy of IV (CBC mode modifies it)
-    uint8_t ivCopy[IV_SIZE];
-    memcpy(ivCopy, iv, IV_SIZE);
-    
-    // Encrypt data
-    ret = mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT,
-                                 padded.size(), ivCopy,
-                                 padded.data(), output.data());
-    
-    mbedtls_aes_free(&aes);
-    return (ret == 0);
+void CryptoManager::generateIV(uint8_t* out) {
+    generateRandomBytes(out, IV_SIZE);
 }
 
-bool CryptoManager::decryptData(const uint8_t* input, size_t inputLen, std::vector<uint8_t>& output) {
-    if (!initialized || inputLen % BLOCK_SIZE != 0) {
+bool CryptoManager::encryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                                std::vector<uint8_t>& output) {
+    size_t outputLen;
+    output.resize(paddedSize(inputLen));
+    return encryptData(input, inputLen, ivIn, output.data(), output.size(), outputLen);
+}
+
+bool CryptoManager::decryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                                std::vector<uint8_t>& output) {
+    size_t outputLen;
+    output.resize(inputLen);
+    if (!decryptData(input, inputLen, ivIn, output.data(), output.size(), outputLen)) {
+        mbedtls_platform_zeroize(output.data(), output.size());
+        output.clear();
         return false;
     }
-    
-    // Prepare output buffer
-    std::vector<uint8_t> decrypted(inputLen);
-    
-    // Setup AES context
-    mbedtls_aes_context aes;
-    mbedtls_aes_init(&aes);
-    
-    // Set decryption key
-    int ret = mbedtls_aes_setkey_dec(&aes, encryptionKey, 256);
-    if (ret != 0) {
-        mbedtls_aes_free(&aes);
+    output.resize(outputLen);
+    return true;
+}
+
+bool CryptoManager::encryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                                uint8_t* output, size_t outputSize, size_t& outputLen,
+                                uint16_t keyVersion) {
+    outputLen = paddedSize(inputLen);
+    if (!initialized || outputSize < outputLen) {
         return false;
     }
     
-    // Create a copy of IV
-    uint8_t ivCopy[IV_SIZE];
-    memcpy(ivCopy, iv, IV_SIZE);
-    
-    // Decrypt data
-    ret = mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_DECRYPT,
-                                 inputLen, ivCopy,
-                                 input, decrypted.data());
-    
-    mbedtls_aes_free(&aes);
-    
-    if (ret != 0) {
+    // Keyed context from the pool
+    AesLease lease;
+    return lease.acquire(true, keyVersion) &&
+           cryptoCbcEncrypt(lease.context(), ivIn, input, inputLen, output, outputSize, outputLen);
+}
+
+bool CryptoManager::decryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                                uint8_t* output, size_t outputSize, size_t& outputLen,
+                                uint16_t keyVersion) {
+    if (!initialized || inputLen == 0 || inputLen % BLOCK_SIZE != 0 || outputSize < inputLen) {
         return false;
     }
     
-    // Remove padding
-    output = removePKCS7Padding(decrypted);
-    return true;
+    // Keyed context from the pool
+    AesLease lease;
+    return lease.acquire(false, keyVersion) &&
+           cryptoCbcDecrypt(lease.context(), ivIn, input, inputLen, output, outputSize, outputLen);
+}
+
+bool CryptoManager::encryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                                CryptoScratch& scratch, const uint8_t*& output, size_t& outputLen,
+                                uint16_t keyVersion) {
+    size_t size = paddedSize(inputLen);
+    uint8_t* buffer = scratch.get(size);
+    output = buffer;
+    return buffer && encryptData(input, inputLen, ivIn, buffer, size, outputLen, keyVersion);
+}
+
+bool CryptoManager::decryptData(const uint8_t* input, size_t inputLen, const uint8_t* ivIn,
+                                CryptoScratch& scratch, const uint8_t*& output, size_t& outputLen,
+                                uint16_t keyVersion) {
+    uint8_t* buffer = scratch.get(inputLen);
+    output = buffer;
+    return buffer && decryptData(input, inputLen, ivIn, buffer, inputLen, outputLen, keyVersion);
 }
 
 String CryptoManager::encryptString(const String& plainText) {
@@ -224,19 +371,23 @@ String CryptoManager::encryptString(const String& plainText) {
         return "";
     }
     
-    std::vector<uint8_t> encrypted;
-    if (!encryptData((const uint8_t*)plainText.c_str(), plainText.length(), encrypted)) {
+    std::vector<uint8_t> encrypted(paddedSize(plainText.length()));
+    size_t encryptedLen;
+    if (!encryptData((const uint8_t*)plainText.c_str(), plainText.length(), iv,
+                     encrypted.data(), encrypted.size(), encryptedLen)) {
         return "";
     }
     
-    // Convert to hex string for easy storage
+    // Convert to hex string for easy storage, a piece at a time into the
+    // reserved string
     String result;
-    result.reserve(encrypted.size() * 2);
-    
-    for (uint8_t byte : encrypted) {
-        char hex[3];
-        sprintf(hex, "%02X", byte);
-        result += hex;
+    if (!result.reserve(hexEncodedLength(encryptedLen))) {
+        return "";
+    }
+    char hex[128];
+    for (size_t pos = 0; pos < encryptedLen; pos += sizeof(hex) / 2) {
+        size_t len = encryptedLen - pos < sizeof(hex) / 2 ? encryptedLen - pos : sizeof(hex) / 2;
+        result.concat(hex, hexEncode(encrypted.data() + pos, len, hex));
     }
     
     return result;
@@ -247,122 +398,1258 @@ String CryptoManager::decryptString(const String& cipherText) {
         return "";
     }
     
-    // Convert hex string back to bytes
-    std::vector<uint8_t> encrypted;
-    encrypted.reserve(cipherText.length() / 2);
-    
-    for (size_t i = 0; i < cipherText.length(); i += 2) {
-        String byteStr = cipherText.substring(i, i + 2);
-        uint8_t byte = strtol(byteStr.c_str(), nullptr, 16);
-        encrypted.push_back(byte);
-    }
-    
-    std::vector<uint8_t> decrypted;
-    if (!decryptData(encrypted.data(), encrypted.size(), decrypted)) {
+    // Convert hex string back to bytes, then decrypt them in place
+    std::vector<uint8_t> buffer(cipherText.length() / 2);
+    size_t len;
+    if (!hexDecode(cipherText.c_str(), cipherText.length(), buffer.data(), len) ||
+        !decryptData(buffer.data(), len, iv, buffer.data(), buffer.size(), len)) {
         return "";
     }
     
     // Convert decrypted bytes to string
-    return String((char*)decrypted.data(), decrypted.size());
+    String result((const char*)buffer.data(), len);
+    mbedtls_platform_zeroize(buffer.data(), buffer.size());
+    return result;
 }
 
-bool CryptoManager::encryptFile(const String& inputPath, const String& outputPath) {
+// Reads a file ahead on a helper task into a few reusable chunks, so SD
+// reads overlap with AES and with writing out earlier chunks. If the task
+// cannot be started the chunks are read in line.
+class ReadAhead {
+public:
+    explicit ReadAhead(fs::File& file) : file(file) {}
+    ~ReadAhead();
+
+    bool begin();
+    // Next chunk, valid until the next call; len is 0 at the end
+    const uint8_t* next(size_t& len);
+
+private:
+    struct Chunk {
+        uint8_t* data;
+        size_t len;
+    };
+
+    fs::File& file;
+    uint8_t* chunks[CRYPTO_FILE_CHUNKS] = {};
+    uint8_t* current = nullptr;
+    QueueHandle_t empty = nullptr;
+    QueueHandle_t full = nullptr;
+    TaskHandle_t task = nullptr;
+    volatile bool stopping = false;
+    bool ended = false;
+
+    static void taskMain(void* arg);
+};
+
+bool ReadAhead::begin() {
+    for (size_t i = 0; i < CRYPTO_FILE_CHUNKS; i++) {
+        chunks[i] = (uint8_t*)malloc(CRYPTO_FILE_CHUNK);
+        if (!chunks[i]) {
+            return false;
+        }
+    }
+
+    empty = xQueueCreate(CRYPTO_FILE_CHUNKS, sizeof(uint8_t*));
+    full = xQueueCreate(CRYPTO_FILE_CHUNKS, sizeof(Chunk));
+    if (empty && full) {
+        for (size_t i = 0; i < CRYPTO_FILE_CHUNKS; i++) {
+            xQueueSend(empty, &chunks[i], 0);
+        }
+        if (xTaskCreatePinnedToCore(taskMain, "crypto_read", CRYPTO_READER_STACK, this,
+                                    CRYPTO_READER_PRIORITY, &task, tskNO_AFFINITY) != pdPASS) {
+            task = nullptr;
+        }
+    }
+    return true;
+}
+
+void ReadAhead::taskMain(void* arg) {
+    ReadAhead* self = (ReadAhead*)arg;
+    Chunk chunk;
+
+    // An empty chunk marks the end, and that the task is done with the file
+    do {
+        xQueueReceive(self->empty, &chunk.data, portMAX_DELAY);
+        chunk.len = self->stopping ? 0 : self->file.read(chunk.data, CRYPTO_FILE_CHUNK);
+        xQueueSend(self->full, &chunk, portMAX_DELAY);
+    } while (chunk.len > 0);
+    vTaskDelete(nullptr);
+}
+
+const uint8_t* ReadAhead::next(size_t& len) {
+    len = 0;
+    if (ended) {
+        return nullptr;
+    }
+    if (!task) {
+        current = chunks[0];
+        len = file.read(current, CRYPTO_FILE_CHUNK);
+        ended = len == 0;
+        return current;
+    }
+
+    if (current) {
+        xQueueSend(empty, &current, portMAX_DELAY);
+    }
+    Chunk chunk;
+    xQueueReceive(full, &chunk, portMAX_DELAY);
+    current = chunk.data;
+    len = chunk.len;
+    ended = len == 0;
+    return current;
+}
+
+ReadAhead::~ReadAhead() {
+    // Hand chunks back until the task has stopped
+    stopping = true;
+    while (task && !ended) {
+        size_t len;
+        next(len);
+    }
+
+    // Plaintext, when encrypting
+    for (size_t i = 0; i < CRYPTO_FILE_CHUNKS; i++) {
+        if (chunks[i]) {
+            memset(chunks[i], 0, CRYPTO_FILE_CHUNK);
+            free(chunks[i]);
+        }
+    }
+    if (empty) {
+        vQueueDelete(empty);
+    }
+    if (full) {
+        vQueueDelete(full);
+    }
+}
+
+bool CryptoManager::cryptFile(fs::File& input, fs::File& output, bool encrypt, bool allowLegacy) {
     if (!initialized) {
         return false;
     }
-    
-    File inputFile = SD_MMC.open(inputPath, FILE_READ);
-    if (!inputFile) {
-        Serial.println("Failed to open input file: " + inputPath);
+
+    size_t expected = input.size() - input.position();
+    CryptoFileHeader header = {};
+    uint16_t keyVersion = currentKeyVersion;
+    bool legacy = false;
+    if (encrypt) {
+        if (expected > UINT32_MAX - BLOCK_SIZE) {
+            Serial.println("File too large to encrypt");
+            return false;
+        }
+        header.magic = CRYPTO_FILE_MAGIC;
+        header.version = CRYPTO_FILE_VERSION;
+        header.keyId = currentKeyId;
+        header.plainLen = expected;
+        generateIV(header.iv);
+        if (!fileHeaderMac(header, currentKeyVersion, header.mac) ||
+            output.write((const uint8_t*)&header, sizeof(header)) != sizeof(header)) {
+            return false;
+        }
+    } else {
+        size_t start = input.position();
+        if (expected < sizeof(header) ||
+            input.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+            header.magic != CRYPTO_FILE_MAGIC) {
+            // Raw CBC from older firmware, under the first key; it has no
+            // MAC, so any file would decrypt to something
+            if (!allowLegacy) {
+                Serial.println("Encrypted file has no header");
+                return false;
+            }
+            legacy = true;
+            keyVersion = 1;
+            if (!input.seek(start)) {
+                return false;
+            }
+        } else if (!checkFileHeader(header, expected, keyVersion)) {
+            return false;
+        } else {
+            expected -= sizeof(header);
+        }
+    }
+
+    CbcEncryptStream encryptor;
+    CbcDecryptStream decryptor;
+    const uint8_t* ivIn = legacy ? nullptr : header.iv;
+    if (!(encrypt ? encryptor.begin(ivIn) : decryptor.begin(ivIn, keyVersion))) {
         return false;
     }
-    
-    // Read entire file into memory (consider chunking for large files)
-    size_t fileSize = inputFile.size();
-    std::vector<uint8_t> fileData(fileSize);
-    inputFile.read(fileData.data(), fileSize);
-    inputFile.close();
-    
-    // Encrypt data
-    std::vector<uint8_t> encrypted;
-    if (!encryptData(fileData.data(), fileSize, encrypted)) {
-        Serial.println("Encryption failed");
+    CryptoFileMac mac;
+    if (!legacy && !mac.begin(header)) {
         return false;
     }
-    
-    // Write encrypted data to output file
-    File outputFile = SD_MMC.open(outputPath, FILE_WRITE);
-    if (!outputFile) {
-        Serial.println("Failed to open output file: " + outputPath);
+
+    ReadAhead reader(input);
+    if (!reader.begin()) {
+        Serial.println("Out of memory for file buffers");
         return false;
     }
-    
-    size_t written = outputFile.write(encrypted.data(), encrypted.size());
-    outputFile.close();
-    
-    return (written == encrypted.size());
+
+    // AES writes up to a block more than it reads
+    std::vector<uint8_t> out(CRYPTO_FILE_CHUNK + BLOCK_SIZE);
+    uint8_t tag[CRYPTO_FILE_TAG_SIZE];
+    size_t cipherLeft = (encrypt || legacy) ? expected : expected - CRYPTO_FILE_TAG_SIZE;
+    size_t tagLen = 0;
+    size_t total = 0;
+    size_t plainTotal = 0;
+    size_t len;
+    size_t outLen;
+    bool ok = true;
+    for (const uint8_t* chunk = reader.next(len); ok && len > 0; chunk = reader.next(len)) {
+        total += len;
+        if (encrypt) {
+            outLen = encryptor.update(chunk, len, out.data());
+            ok = mac.update(out.data(), outLen);
+        } else {
+            // The tag follows the ciphertext, possibly split across chunks
+            size_t cipherLen = len < cipherLeft ? len : cipherLeft;
+            size_t rest = len - cipherLen;
+            cipherLeft -= cipherLen;
+            if (rest > sizeof(tag) - tagLen) {
+                ok = false;
+                break;
+            }
+            memcpy(tag + tagLen, chunk + cipherLen, rest);
+            tagLen += rest;
+            ok = legacy || mac.update(chunk, cipherLen);
+            outLen = decryptor.update(chunk, cipherLen, out.data());
+            plainTotal += outLen;
+        }
+        ok = ok && output.write(out.data(), outLen) == outLen;
+    }
+
+    // A short read would otherwise look like the end of the file
+    if (ok && total != expected) {
+        Serial.println("Failed to read input file");
+        ok = false;
+    }
+    if (ok && encrypt) {
+        ok = encryptor.finish(out.data(), outLen) && mac.update(out.data(), outLen) &&
+             output.write(out.data(), outLen) == outLen &&
+             mac.finish(tag) && output.write(tag, sizeof(tag)) == sizeof(tag);
+    } else if (ok) {
+        if (!legacy && (tagLen != sizeof(tag) || !mac.verify(tag))) {
+            Serial.println("Encrypted file failed authentication");
+            ok = false;
+        }
+        ok = ok && decryptor.finish(out.data(), outLen);
+        plainTotal += outLen;
+        ok = ok && (legacy || plainTotal == header.plainLen) &&
+             output.write(out.data(), outLen) == outLen;
+    }
+
+    memset(out.data(), 0, out.size());
+    return ok;
 }
 
-bool CryptoManager::decryptFile(const String& inputPath, const String& outputPath) {
+bool CryptoManager::cryptFile(const String& inputPath, const String& outputPath, bool encrypt, bool allowLegacy) {
     if (!initialized) {
         return false;
     }
-    
+
     File inputFile = SD_MMC.open(inputPath, FILE_READ);
     if (!inputFile) {
-        Serial.println("Failed to open encrypted file: " + inputPath);
-        return false;
-    }
-    
-    // Read encrypted file
-    size_t fileSize = inputFile.size();
-    std::vector<uint8_t> encrypted(fileSize);
-    inputFile.read(encrypted.data(), fileSize);
-    inputFile.close();
-    
-    // Decrypt data
-    std::vector<uint8_t> decrypted;
-    if (!decryptData(encrypted.data(), fileSize, decrypted)) {
-        Serial.println("Decryption failed");
+        Serial.println("Failed to open input file: " + inputPath);
         return false;
     }
-    
-    // Write decrypted data to output file
     File outputFile = SD_MMC.open(outputPath, FILE_WRITE);
     if (!outputFile) {
         Serial.println("Failed to open output file: " + outputPath);
+        inputFile.close();
         return false;
     }
-    
-    size_t written = outputFile.write(decrypted.data(), decrypted.size());
+
+    bool ok = cryptFile(inputFile, outputFile, encrypt, allowLegacy);
+    inputFile.close();
     outputFile.close();
-    
-    return (written == decrypted.size());
+    if (!ok) {
+        // Do not leave partial output behind
+        SD_MMC.remove(outputPath);
+        Serial.println(encrypt ? "Encryption failed" : "Decryption failed");
+    }
+    return ok;
 }
 
-bool CryptoManager::rotateKey() {
-    // Generate new key
-    generateRandomBytes(encryptionKey, KEY_SIZE);
-    generateRandomBytes(iv, IV_SIZE);
-    
-    // Save to NVS
-    if (!saveKeyToNVS()) {
-        return false;
+bool CryptoManager::encryptFile(const String& inputPath, const String& outputPath) {
+    return cryptFile(inputPath, outputPath, true);
+}
+
+bool CryptoManager::decryptFile(const String& inputPath, const String& outputPath, bool allowLegacy) {
+    return cryptFile(inputPath, outputPath, false, allowLegacy);
+}
+
+bool CryptoManager::encryptFile(fs::File& input, fs::File& output) {
+    return cryptFile(input, output, true);
+}
+
+bool CryptoManager::decryptFile(fs::File& input, fs::File& output, bool allowLegacy) {
+    return cryptFile(input, output, false, allowLegacy);
+}
+
+static bool deriveKey(const uint8_t* key, const char* label, uint8_t* out) {
+    return mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, 32,
+                           (const uint8_t*)label, strlen(label), out) == 0;
+}
+
+static uint32_t keyIdOf(const uint8_t* key) {
+    uint8_t id[32];
+    uint32_t keyId = 0;
+    if (deriveKey(key, KEY_ID_LABEL, id)) {
+        memcpy(&keyId, id, sizeof(keyId));
     }
-    
-    Serial.println("Encryption key rotated successfully");
-    Serial.println("WARNING: Previous encrypted files will no longer be readable!");
-    return true;
+    return keyId;
 }
 
-bool CryptoManager::hasValidKey() {
-    Preferences prefs;
-    if (!prefs.begin("crypto", true)) {
+// Everything keyed from encryptionKey, after it changes
+void CryptoManager::deriveKeys() {
+    currentKeyId = keyIdOf(encryptionKey);
+    keyGeneration++;
+}
+
+const uint8_t* CryptoManager::keyFor(uint16_t version) {
+    if (version == 0 || version == currentKeyVersion) {
+        return encryptionKey;
+    }
+    for (const OldKey& old : oldKeys) {
+        if (old.version != 0 && old.version == version) {
+            return old.key;
+        }
+    }
+    return nullptr;
+}
+
+bool CryptoManager::keyIdFor(uint16_t version, uint32_t& id) {
+    if (version == 0 || version == currentKeyVersion) {
+        id = currentKeyId;
+        return true;
+    }
+    for (const OldKey& old : oldKeys) {
+        if (old.version != 0 && old.version == version) {
+            id = old.id;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CryptoManager::keyVersionForId(uint32_t id, uint16_t& version) {
+    if (id == currentKeyId) {
+        version = currentKeyVersion;
+        return true;
+    }
+    for (const OldKey& old : oldKeys) {
+        if (old.version != 0 && old.id == id) {
+            version = old.version;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CryptoManager::macKeyFor(uint16_t version, const char* label, uint8_t* out) {
+    const uint8_t* key = keyFor(version);
+    return key && deriveKey(key, label, out);
+}
+
+bool CryptoManager::hasKey(uint16_t version) {
+    return initialize() && keyFor(version) != nullptr;
+}
+
+static bool sameTag(const uint8_t* a, const uint8_t* b, size_t len) {
+    uint8_t diff = 0;
+    for (size_t n = 0; n < len; n++) {
+        diff |= a[n] ^ b[n];
+    }
+    return diff == 0;
+}
+
+bool CryptoManager::fileHeaderMac(const CryptoFileHeader& header, uint16_t keyVersion, uint8_t* mac) {
+    uint8_t macKey[KEY_SIZE];
+    uint8_t full[32];
+    bool ok = macKeyFor(keyVersion, FILE_MAC_LABEL, macKey) &&
+              mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), macKey, KEY_SIZE,
+                              (const uint8_t*)&header, offsetof(CryptoFileHeader, mac), full) == 0;
+    mbedtls_platform_zeroize(macKey, sizeof(macKey));
+    if (ok) {
+        memcpy(mac, full, CRYPTO_FILE_TAG_SIZE);
+    }
+    return ok;
+}
+
+bool CryptoManager::checkFileHeader(const CryptoFileHeader& header, size_t fileBytes,
+                                    uint16_t& keyVersion) {
+    uint8_t mac[CRYPTO_FILE_TAG_SIZE];
+    if (!initialized || header.magic != CRYPTO_FILE_MAGIC) {
         return false;
     }
-    
+    if (header.version != CRYPTO_FILE_VERSION) {
+        Serial.println("Unsupported encrypted file version " + String(header.version));
+        return false;
+    }
+    if (!keyVersionForId(header.keyId, keyVersion)) {
+        Serial.println("File was encrypted with a key that is no longer kept");
+        return false;
+    }
+    if (!fileHeaderMac(header, keyVersion, mac) || !sameTag(mac, header.mac, sizeof(mac))) {
+        Serial.println("Encrypted file header is damaged");
+        return false;
+    }
+    if (fileBytes != sizeof(header) + paddedSize(header.plainLen) + CRYPTO_FILE_TAG_SIZE) {
+        Serial.println("Encrypted file is truncated or has trailing data");
+        return false;
+    }
+    return true;
+}
+
+CryptoFileMac::CryptoFileMac() {
+    mbedtls_md_init(&md);
+}
+
+CryptoFileMac::~CryptoFileMac() {
+    mbedtls_md_free(&md);
+}
+
+bool CryptoFileMac::begin(const CryptoFileHeader& header) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    uint8_t macKey[CryptoManager::KEY_SIZE];
+    uint16_t keyVersion;
+    mbedtls_md_free(&md);
+    mbedtls_md_init(&md);
+    bool ok = crypto.initialize() && crypto.keyVersionForId(header.keyId, keyVersion) &&
+              crypto.macKeyFor(keyVersion, FILE_MAC_LABEL, macKey) &&
+              mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) == 0 &&
+              mbedtls_md_hmac_starts(&md, macKey, CryptoManager::KEY_SIZE) == 0 &&
+              mbedtls_md_hmac_update(&md, (const uint8_t*)&header, sizeof(header)) == 0;
+    mbedtls_platform_zeroize(macKey, sizeof(macKey));
+    return ok;
+}
+
+bool CryptoFileMac::update(const uint8_t* data, size_t len) {
+    return len == 0 || mbedtls_md_hmac_update(&md, data, len) == 0;
+}
+
+bool CryptoFileMac::finish(uint8_t* tag) {
+    uint8_t full[32];
+    if (mbedtls_md_hmac_finish(&md, full) != 0) {
+        return false;
+    }
+    memcpy(tag, full, CRYPTO_FILE_TAG_SIZE);
+    return true;
+}
+
+bool CryptoFileMac::verify(const uint8_t* tag) {
+    uint8_t expected[CRYPTO_FILE_TAG_SIZE];
+    return finish(expected) && sameTag(expected, tag, sizeof(expected));
+}
+
+CryptoMac::CryptoMac() {
+    mbedtls_md_init(&md);
+}
+
+CryptoMac::~CryptoMac() {
+    mbedtls_md_free(&md);
+}
+
+bool CryptoMac::begin(uint16_t keyVersion, const char* label) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    uint8_t macKey[CryptoManager::KEY_SIZE];
+    if (!ready) {
+        ready = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) == 0;
+    }
+    bool ok = ready && crypto.initialize() && crypto.macKeyFor(keyVersion, label, macKey) &&
+              mbedtls_md_hmac_starts(&md, macKey, CryptoManager::KEY_SIZE) == 0;
+    mbedtls_platform_zeroize(macKey, sizeof(macKey));
+    return ok;
+}
+
+bool CryptoMac::update(const void* data, size_t len) {
+    return len == 0 || mbedtls_md_hmac_update(&md, (const uint8_t*)data, len) == 0;
+}
+
+bool CryptoMac::finish(uint8_t* tag, size_t len) {
+    uint8_t full[32];
+    if (len > sizeof(full) || mbedtls_md_hmac_finish(&md, full) != 0) {
+        return false;
+    }
+    memcpy(tag, full, len);
+    return true;
+}
+
+bool CryptoMac::verify(const uint8_t* tag, size_t len) {
+    uint8_t expected[32];
+    return finish(expected, len) && sameTag(expected, tag, len);
+}
+
+static size_t sealedChunkCount(const SealedHeader& header) {
+    return (header.plainLen + header.chunkSize - 1) / header.chunkSize;
+}
+
+static size_t sealedSize(const SealedHeader& header) {
+    return sizeof(header) + header.plainLen + sealedChunkCount(header) * SEALED_TAG_SIZE;
+}
+
+bool CryptoManager::sealedTag(const SealedHeader& header, const uint8_t* macKey, uint8_t* tag) {
+    uint8_t mac[32];
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), macKey, KEY_SIZE,
+                        (const uint8_t*)&header, offsetof(SealedHeader, tag), mac) != 0) {
+        return false;
+    }
+    memcpy(tag, mac, SEALED_TAG_SIZE);
+    return true;
+}
+
+// Chunks of a sealed file held in RAM as they are laid out in the file,
+// each ciphertext followed by its tag, and sealed or opened in place
+struct SealBatch {
+    const SealedHeader* header;
+    const uint8_t* macKey;
+    uint8_t* data;
+    uint32_t first;            // File index of the first chunk
+    size_t count;
+    size_t lastLen;            // Bytes in the last chunk
+    bool seal;
+};
+
+struct SealWork {
+    const SealBatch* batch;
+    size_t from;
+    size_t to;
+    bool ok;
+    SemaphoreHandle_t done;
+};
+
+static bool chunkTag(mbedtls_md_context_t& md, const SealBatch& batch, uint32_t index,
+                     const uint8_t* data, size_t len, uint8_t* tag) {
+    uint8_t mac[32];
+    uint8_t indexBytes[4] = {(uint8_t)index, (uint8_t)(index >> 8), (uint8_t)(index >> 16),
+                             (uint8_t)(index >> 24)};
+    bool ok = mbedtls_md_hmac_starts(&md, batch.macKey, 32) == 0 &&
+              mbedtls_md_hmac_update(&md, batch.header->nonce, SEALED_NONCE_SIZE) == 0 &&
+              mbedtls_md_hmac_update(&md, indexBytes, sizeof(indexBytes)) == 0 &&
+              mbedtls_md_hmac_update(&md, data, len) == 0 &&
+              mbedtls_md_hmac_finish(&md, mac) == 0;
+    memcpy(tag, mac, SEALED_TAG_SIZE);
+    return ok;
+}
+
+// Chunks [from, to) of a batch, with this task's own AES and HMAC contexts
+static bool sealChunks(const SealBatch& batch, size_t from, size_t to) {
+    AesLease lease;
+    if (!lease.acquire(true, CryptoManager::storedKeyVersion(batch.header->keyVersion))) {
+        return false;
+    }
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    bool ok = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) == 0;
+
+    uint32_t chunkSize = batch.header->chunkSize;
+    for (size_t i = from; ok && i < to; i++) {
+        uint8_t* chunk = batch.data + i * (chunkSize + SEALED_TAG_SIZE);
+        size_t len = (i + 1 == batch.count) ? batch.lastLen : chunkSize;
+        uint32_t index = batch.first + i;
+        uint8_t tag[SEALED_TAG_SIZE];
+
+        // Check before decrypting; compare in constant time
+        if (!batch.seal) {
+            ok = chunkTag(md, batch, index, chunk, len, tag);
+            uint8_t diff = 0;
+            for (size_t n = 0; n < SEALED_TAG_SIZE; n++) {
+                diff |= tag[n] ^ chunk[len + n];
+            }
+            ok = ok && diff == 0;
+            if (!ok) {
+                break;
+            }
+        }
+
+        // CTR is the same both ways, and works in place
+        uint8_t counter[16];
+        uint8_t stream[16];
+        size_t streamPos = 0;
+        uint32_t block = index * (chunkSize / 16);
+        memcpy(counter, batch.header->nonce, SEALED_NONCE_SIZE);
+        counter[12] = block >> 24;
+        counter[13] = block >> 16;
+        counter[14] = block >> 8;
+        counter[15] = block;
+        ok = cryptoAesCtr(lease.context(), len, &streamPos, counter, stream, chunk, chunk);
+        mbedtls_platform_zeroize(stream, sizeof(stream));
+
+        if (ok && batch.seal) {
+            ok = chunkTag(md, batch, index, chunk, len, chunk + len);
+        }
+    }
+
+    mbedtls_md_free(&md);
+    return ok;
+}
+
+static void sealWorker(void* arg) {
+    SealWork* work = (SealWork*)arg;
+    work->ok = sealChunks(*work->batch, work->from, work->to);
+    xSemaphoreGive(work->done);
+    vTaskDelete(nullptr);
+}
+
+// Split a batch between this core and a helper task on the other one
+static bool runBatch(const SealBatch& batch) {
+    if (batch.count < 2) {
+        return sealChunks(batch, 0, batch.count);
+    }
+
+    SealWork work = {&batch, batch.count / 2, batch.count, false, xSemaphoreCreateBinary()};
+    if (!work.done) {
+        return sealChunks(batch, 0, batch.count);
+    }
+    if (xTaskCreatePinnedToCore(sealWorker, "seal", SEALED_WORKER_STACK, &work,
+                                uxTaskPriorityGet(nullptr), nullptr, 1 - xPortGetCoreID()) != pdPASS) {
+        vSemaphoreDelete(work.done);
+        return sealChunks(batch, 0, batch.count);
+    }
+
+    bool ok = sealChunks(batch, 0, work.from);
+    xSemaphoreTake(work.done, portMAX_DELAY);
+    vSemaphoreDelete(work.done);
+    return ok && work.ok;
+}
+
+bool CryptoManager::openSealed(fs::File& file, SealedHeader& header) {
+    uint8_t macKey[KEY_SIZE];
+    uint8_t tag[SEALED_TAG_SIZE];
+    if (!initialized || !file.seek(0) ||
+        file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+        header.magic != SEALED_MAGIC || header.version != SEALED_VERSION ||
+        header.chunkSize == 0 || header.chunkSize > SEALED_CHUNK || header.chunkSize % 16 != 0) {
+        return false;
+    }
+    if (!macKeyFor(storedKeyVersion(header.keyVersion), SEAL_MAC_LABEL, macKey)) {
+        Serial.println("Sealed file is under a key that is no longer kept");
+        return false;
+    }
+    bool ok = sealedTag(header, macKey, tag);
+    mbedtls_platform_zeroize(macKey, sizeof(macKey));
+    return ok && sameTag(tag, header.tag, SEALED_TAG_SIZE) && file.size() == sealedSize(header);
+}
+
+// Read chunks [first, first + count) and open them in place
+bool CryptoManager::sealedChunks(fs::File& file, const SealedHeader& header, const uint8_t* macKey,
+                                 uint32_t first, size_t count, std::vector<uint8_t>& batch) {
+    size_t stride = header.chunkSize + SEALED_TAG_SIZE;
+    size_t end = (size_t)first * header.chunkSize + count * header.chunkSize;
+    size_t lastLen = header.chunkSize;
+    if (end > header.plainLen) {
+        lastLen -= end - header.plainLen;
+    }
+    size_t bytes = (count - 1) * stride + lastLen + SEALED_TAG_SIZE;
+
+    batch.resize(count * stride);
+    if (!file.seek(sizeof(header) + (size_t)first * stride) ||
+        file.read(batch.data(), bytes) != bytes) {
+        return false;
+    }
+    SealBatch sealBatch = {&header, macKey, batch.data(), first, count, lastLen, false};
+    return runBatch(sealBatch);
+}
+
+bool CryptoManager::readSealed(fs::File& file, const SealedHeader& header, uint32_t offset,
+                               uint8_t* out, size_t len) {
+    if (!initialized || offset > header.plainLen || len > header.plainLen - offset) {
+        return false;
+    }
+
+    uint8_t macKey[KEY_SIZE];
+    std::vector<uint8_t> batch;
+    size_t stride = header.chunkSize + SEALED_TAG_SIZE;
+    bool ok = macKeyFor(storedKeyVersion(header.keyVersion), SEAL_MAC_LABEL, macKey);
+    while (ok && len > 0) {
+        uint32_t first = offset / header.chunkSize;
+        uint32_t last = (offset + len - 1) / header.chunkSize;
+        size_t count = last - first + 1;
+        if (count > SEALED_BATCH_CHUNKS) {
+            count = SEALED_BATCH_CHUNKS;
+        }
+        ok = sealedChunks(file, header, macKey, first, count, batch);
+
+        // Copy out of the opened chunks, skipping their tags
+        for (size_t i = 0; ok && i < count && len > 0; i++) {
+            size_t skip = offset - (size_t)(first + i) * header.chunkSize;
+            size_t take = header.chunkSize - skip;
+            if (take > len) {
+                take = len;
+            }
+            memcpy(out, batch.data() + i * stride + skip, take);
+            out += take;
+            offset += take;
+            len -= take;
+        }
+    }
+
+    mbedtls_platform_zeroize(macKey, sizeof(macKey));
+    mbedtls_platform_zeroize(batch.data(), batch.size());
+    return ok;
+}
+
+bool CryptoManager::sealFile(fs::File& input, fs::File& output) {
+    if (!initialized) {
+        return false;
+    }
+    size_t plainLen = input.size() - input.position();
+    if (plainLen > UINT32_MAX) {
+        return false;
+    }
+
+    uint8_t macKey[KEY_SIZE];
+    SealedHeader header = {};
+    header.magic = SEALED_MAGIC;
+    header.version = SEALED_VERSION;
+    header.keyVersion = currentKeyVersion;
+    header.chunkSize = SEALED_CHUNK;
+    header.plainLen = plainLen;
+    generateRandomBytes(header.nonce, SEALED_NONCE_SIZE);
+    if (!macKeyFor(currentKeyVersion, SEAL_MAC_LABEL, macKey) || !sealedTag(header, macKey, header.tag) ||
+        output.write((const uint8_t*)&header, sizeof(header)) != sizeof(header)) {
+        mbedtls_platform_zeroize(macKey, sizeof(macKey));
+        return false;
+    }
+
+    // Plaintext is read into place between the tags
+    size_t stride = SEALED_CHUNK + SEALED_TAG_SIZE;
+    std::vector<uint8_t> batch(SEALED_BATCH_CHUNKS * stride);
+    size_t chunks = sealedChunkCount(header);
+    bool ok = true;
+    for (uint32_t first = 0; ok && first < chunks; first += SEALED_BATCH_CHUNKS) {
+        size_t count = chunks - first < SEALED_BATCH_CHUNKS ? chunks - first : SEALED_BATCH_CHUNKS;
+        size_t lastLen = SEALED_CHUNK;
+        for (size_t i = 0; ok && i < count; i++) {
+            size_t len = plainLen - (size_t)(first + i) * SEALED_CHUNK;
+            lastLen = len < SEALED_CHUNK ? len : SEALED_CHUNK;
+            ok = input.read(batch.data() + i * stride, lastLen) == lastLen;
+        }
+        SealBatch sealBatch = {&header, macKey, batch.data(), first, count, lastLen, true};
+        size_t bytes = (count - 1) * stride + lastLen + SEALED_TAG_SIZE;
+        ok = ok && runBatch(sealBatch) && output.write(batch.data(), bytes) == bytes;
+    }
+
+    mbedtls_platform_zeroize(macKey, sizeof(macKey));
+    mbedtls_platform_zeroize(batch.data(), batch.size());
+    return ok;
+}
+
+bool CryptoManager::unsealFile(fs::File& input, fs::File& output) {
+    SealedHeader header;
+    if (!openSealed(input, header)) {
+        Serial.println("Not a sealed file, or damaged");
+        return false;
+    }
+
+    uint8_t macKey[KEY_SIZE];
+    std::vector<uint8_t> batch;
+    size_t stride = header.chunkSize + SEALED_TAG_SIZE;
+    size_t chunks = sealedChunkCount(header);
+    bool ok = macKeyFor(storedKeyVersion(header.keyVersion), SEAL_MAC_LABEL, macKey);
+    for (uint32_t first = 0; ok && first < chunks; first += SEALED_BATCH_CHUNKS) {
+        size_t count = chunks - first < SEALED_BATCH_CHUNKS ? chunks - first : SEALED_BATCH_CHUNKS;
+        ok = sealedChunks(input, header, macKey, first, count, batch);
+        for (size_t i = 0; ok && i < count; i++) {
+            size_t len = header.plainLen - (size_t)(first + i) * header.chunkSize;
+            if (len > header.chunkSize) {
+                len = header.chunkSize;
+            }
+            ok = output.write(batch.data() + i * stride, len) == len;
+        }
+    }
+
+    mbedtls_platform_zeroize(macKey, sizeof(macKey));
+    mbedtls_platform_zeroize(batch.data(), batch.size());
+    return ok;
+}
+
+bool CryptoManager::sealPath(const String& inputPath, const String& outputPath, bool seal) {
+    if (!initialized) {
+        return false;
+    }
+
+    File inputFile = SD_MMC.open(inputPath, FILE_READ);
+    if (!inputFile) {
+        Serial.println("Failed to open input file: " + inputPath);
+        return false;
+    }
+    File outputFile = SD_MMC.open(outputPath, FILE_WRITE);
+    if (!outputFile) {
+        Serial.println("Failed to open output file: " + outputPath);
+        inputFile.close();
+        return false;
+    }
+
+    bool ok = seal ? sealFile(inputFile, outputFile) : unsealFile(inputFile, outputFile);
+    inputFile.close();
+    outputFile.close();
+    if (!ok) {
+        SD_MMC.remove(outputPath);
+        Serial.println(seal ? "Sealing failed" : "Unsealing failed");
+    }
+    return ok;
+}
+
+bool CryptoManager::sealFile(const String& inputPath, const String& outputPath) {
+    return sealPath(inputPath, outputPath, true);
+}
+
+bool CryptoManager::unsealFile(const String& inputPath, const String& outputPath) {
+    return sealPath(inputPath, outputPath, false);
+}
+
+// Appends a line of the report and lets the idle task run
+static void benchLine(const char* line, void* arg) {
+    String& report = *(String*)arg;
+    report += line;
+    report += "\n";
+    yield();
+}
+
+static unsigned long benchClock() {
+    return micros();
+}
+
+String CryptoManager::benchmark() {
+    String report = "AES: " CRYPTO_BACKEND_NAME ", SHA: " CRYPTO_SHA_NAME "\n";
+    if (!initialize()) {
+        return report + "Crypto not initialized\n";
+    }
+
+    // Large sizes need PSRAM; ones that do not fit are skipped
+    size_t capacity = CRYPTO_BENCH_MAX_BYTES;
+    uint8_t* buffer = nullptr;
+    while (!buffer && capacity >= 16) {
+        if (psramFound()) {
+            buffer = (uint8_t*)heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        }
+        if (!buffer) {
+            buffer = (uint8_t*)malloc(capacity);
+        }
+        if (!buffer) {
+            capacity /= 4;
+        }
+    }
+    if (!buffer) {
+        return report + "Out of memory\n";
+    }
+
+    AesLease leases[2];
+    bool ok = leases[0].acquire(true) && leases[1].acquire(false) &&
+              cryptoBenchmark(leases[0].context(), leases[1].context(), buffer, capacity,
+                              benchClock, benchLine, &report);
+
+    memset(buffer, 0, capacity);
+    free(buffer);
+    if (!ok) {
+        report += "Benchmark failed\n";
+    }
+    return report;
+}
+
+bool CryptoManager::rotateKey() {
+    if (!initialize()) {
+        return false;
+    }
+    
+    // Keep the current key in a free slot, or in place of the oldest
+    OldKey* keep = &oldKeys[0];
+    for (OldKey& old : oldKeys) {
+        if (old.version == 0) {
+            keep = &old;
+            break;
+        }
+        if (old.version < keep->version) {
+            keep = &old;
+        }
+    }
+    if (keep->version != 0) {
+        Serial.println("Dropping key version " + String(keep->version) +
+                       "; anything still under it is no longer readable");
+    }
+    keep->version = currentKeyVersion;
+    keep->id = currentKeyId;
+    memcpy(keep->key, encryptionKey, KEY_SIZE);
+    
+    // Generate new key; the static IV stays, as data under it is kept
+    generateRandomBytes(encryptionKey, KEY_SIZE);
+    currentKeyVersion++;
+    deriveKeys();
+    clearSlots();
+    
+    // Save to NVS
+    if (!saveKeyToNVS()) {
+        return false;
+    }
+    
+    Serial.println("Encryption key rotated to version " + String(currentKeyVersion));
+    Serial.println("Stored macros are re-encrypted under it while the device is idle");
+    return true;
+}
+
+bool CryptoManager::hasValidKey() {
+    Preferences prefs;
+    if (!prefs.begin("crypto", true)) {
+        return false;
+    }
+    
     bool valid = (prefs.getUInt("magic", 0) == 0xDEADBEEF);
     prefs.end();
     
     return valid;
 }
+
+bool CryptoManager::hasSecret() {
+    Preferences prefs;
+    if (!prefs.begin("crypto", true)) {
+        return false;
+    }
+    bool wrapped = prefs.getBytesLength("wrapped") == sizeof(WrappedKeys);
+    prefs.end();
+    return wrapped;
+}
+
+// 64 bytes: the wrapping AES key, then its MAC key
+bool CryptoManager::deriveWrapKey(const uint8_t* secret, size_t len, const uint8_t* salt,
+                                  uint32_t iterations, uint8_t* out) {
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    bool ok = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) == 0 &&
+              mbedtls_pkcs5_pbkdf2_hmac(&md, secret, len, salt, sizeof(wrapSalt), iterations,
+                                        2 * KEY_SIZE, out) == 0;
+    mbedtls_md_free(&md);
+    return ok;
+}
+
+// Time a fixed number of iterations and scale it to the budget
+uint32_t CryptoManager::calibrateKdf() {
+    const uint32_t probe = 1000;
+    uint8_t salt[sizeof(wrapSalt)] = {};
+    uint8_t out[2 * KEY_SIZE];
+    unsigned long start = micros();
+    if (!deriveWrapKey((const uint8_t*)KEY_WRAP_LABEL, sizeof(KEY_WRAP_LABEL) - 1, salt, probe, out)) {
+        return CRYPTO_KDF_MIN_ITERATIONS;
+    }
+    unsigned long elapsed = micros() - start;
+    uint64_t iterations = (uint64_t)CRYPTO_UNLOCK_BUDGET_MS * 1000 * probe / (elapsed ? elapsed : 1);
+    iterations -= iterations % 1000;
+    if (iterations < CRYPTO_KDF_MIN_ITERATIONS) {
+        iterations = CRYPTO_KDF_MIN_ITERATIONS;
+    } else if (iterations > CRYPTO_KDF_MAX_ITERATIONS) {
+        iterations = CRYPTO_KDF_MAX_ITERATIONS;
+    }
+    Serial.println("KDF calibrated: " + String((unsigned long)iterations) + " iterations, about " +
+                   String((unsigned long)(iterations * elapsed / probe / 1000)) + " ms per unlock");
+    return iterations;
+}
+
+uint32_t CryptoManager::kdfIterationCount() {
+    if (kdfIterations != 0) {
+        return kdfIterations;
+    }
+    Preferences prefs;
+    if (prefs.begin("crypto", false)) {
+        kdfIterations = prefs.getUInt("kdf_iter", 0);
+        if (kdfIterations == 0) {
+            kdfIterations = calibrateKdf();
+            prefs.putUInt("kdf_iter", kdfIterations);
+        }
+        prefs.end();
+    }
+    return kdfIterations ? kdfIterations : CRYPTO_KDF_MIN_ITERATIONS;
+}
+
+bool CryptoManager::wrapKeys(WrappedKeys& wrapped) {
+    uint8_t counter[16];
+    uint8_t stream[16];
+    size_t streamPos = 0;
+    uint8_t tag[32];
+    CryptoAesContext ctx;
+
+    wrapped.iterations = wrapIterations;
+    memcpy(wrapped.salt, wrapSalt, sizeof(wrapped.salt));
+    generateRandomBytes(wrapped.nonce, sizeof(wrapped.nonce));
+    wrapped.keyVersion = currentKeyVersion;
+    memcpy(wrapped.keys, encryptionKey, KEY_SIZE);
+    memcpy(wrapped.keys + KEY_SIZE, oldKeys, sizeof(oldKeys));
+
+    memcpy(counter, wrapped.nonce, sizeof(counter));
+    cryptoAesInit(&ctx);
+    bool ok = cryptoAesSetKey(&ctx, wrapKey, true) &&
+              cryptoAesCtr(&ctx, sizeof(wrapped.keys), &streamPos, counter, stream, wrapped.keys, wrapped.keys) &&
+              mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), wrapKey + KEY_SIZE, KEY_SIZE,
+                              (const uint8_t*)&wrapped, offsetof(WrappedKeys, tag), tag) == 0;
+    cryptoAesFree(&ctx);
+    mbedtls_platform_zeroize(stream, sizeof(stream));
+    memcpy(wrapped.tag, tag, sizeof(wrapped.tag));
+    return ok;
+}
+
+// Checked before anything is decrypted; a wrong secret fails here
+bool CryptoManager::unwrapKeys(WrappedKeys& wrapped) {
+    uint8_t counter[16];
+    uint8_t stream[16];
+    size_t streamPos = 0;
+    uint8_t tag[32];
+    CryptoAesContext ctx;
+
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), wrapKey + KEY_SIZE, KEY_SIZE,
+                        (const uint8_t*)&wrapped, offsetof(WrappedKeys, tag), tag) != 0 ||
+        !sameTag(tag, wrapped.tag, sizeof(wrapped.tag))) {
+        return false;
+    }
+
+    memcpy(counter, wrapped.nonce, sizeof(counter));
+    cryptoAesInit(&ctx);
+    bool ok = cryptoAesSetKey(&ctx, wrapKey, true) &&
+              cryptoAesCtr(&ctx, sizeof(wrapped.keys), &streamPos, counter, stream, wrapped.keys, wrapped.keys);
+    cryptoAesFree(&ctx);
+    mbedtls_platform_zeroize(stream, sizeof(stream));
+    if (!ok) {
+        return false;
+    }
+    memcpy(encryptionKey, wrapped.keys, KEY_SIZE);
+    memcpy(oldKeys, wrapped.keys + KEY_SIZE, sizeof(oldKeys));
+    currentKeyVersion = wrapped.keyVersion;
+    wrapIterations = wrapped.iterations;
+    memcpy(wrapSalt, wrapped.salt, sizeof(wrapSalt));
+    return true;
+}
+
+bool CryptoManager::unlock(const uint8_t* secret, size_t len) {
+    WrappedKeys wrapped;
+    Preferences prefs;
+    if (!prefs.begin("crypto", true)) {
+        return false;
+    }
+    bool isWrapped = prefs.getBytes("wrapped", &wrapped, sizeof(wrapped)) == sizeof(wrapped);
+    prefs.end();
+    if (!isWrapped) {
+        // Nothing under a secret
+        return initialize();
+    }
+
+    uint8_t derived[2 * KEY_SIZE];
+    bool ok = deriveWrapKey(secret, len, wrapped.salt, wrapped.iterations, derived);
+    if (ok && initialized) {
+        // Already unlocked: just check the secret
+        ok = wrapKeyCached && sameTag(derived, wrapKey, sizeof(derived));
+    } else if (ok) {
+        memcpy(wrapKey, derived, sizeof(wrapKey));
+        wrapKeyCached = true;
+        ok = initialize();
+        if (!ok) {
+            mbedtls_platform_zeroize(wrapKey, sizeof(wrapKey));
+            wrapKeyCached = false;
+        }
+    }
+    mbedtls_platform_zeroize(derived, sizeof(derived));
+    mbedtls_platform_zeroize(&wrapped, sizeof(wrapped));
+    if (!ok) {
+        Serial.println("Wrong secret");
+    }
+    return ok;
+}
+
+void CryptoManager::lock() {
+    if (!wrapKeyCached) {
+        return;
+    }
+    initialized = false;
+    keyGeneration++;
+    clearSlots();
+    mbedtls_platform_zeroize(encryptionKey, sizeof(encryptionKey));
+    mbedtls_platform_zeroize(oldKeys, sizeof(oldKeys));
+    mbedtls_platform_zeroize(wrapKey, sizeof(wrapKey));
+    wrapKeyCached = false;
+    Serial.println("Crypto system locked");
+}
+
+bool CryptoManager::setSecret(const uint8_t* secret, size_t len) {
+    if (!initialized || len > CRYPTO_SECRET_MAX) {
+        return false;
+    }
+
+    if (len == 0) {
+        mbedtls_platform_zeroize(wrapKey, sizeof(wrapKey));
+        wrapKeyCached = false;
+        if (!saveKeyToNVS()) {
+            return false;
+        }
+        Serial.println("Keys are no longer under a secret");
+        return true;
+    }
+
+    uint8_t salt[sizeof(wrapSalt)];
+    uint8_t derived[2 * KEY_SIZE];
+    uint32_t iterations = kdfIterationCount();
+    generateRandomBytes(salt, sizeof(salt));
+    if (!deriveWrapKey(secret, len, salt, iterations, derived)) {
+        return false;
+    }
+    memcpy(wrapKey, derived, sizeof(wrapKey));
+    memcpy(wrapSalt, salt, sizeof(wrapSalt));
+    wrapIterations = iterations;
+    wrapKeyCached = true;
+    mbedtls_platform_zeroize(derived, sizeof(derived));
+    if (!saveKeyToNVS()) {
+        return false;
+    }
+    Serial.println("Keys wrapped under the secret (" + String((unsigned long)iterations) + " iterations)");
+    return true;
+}
+
+CbcEncryptStream::~CbcEncryptStream() {
+    memset(pending, 0, sizeof(pending));
+}
+
+bool CbcEncryptStream::begin(const uint8_t* ivIn) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    ready = false;
+    pendingLen = 0;
+    if (!lease.acquire(true)) {
+        return false;
+    }
+    memcpy(iv, ivIn ? ivIn : crypto.iv, BLOCK_SIZE);
+    ready = true;
+    return true;
+}
+
+size_t CbcEncryptStream::update(const uint8_t* in, size_t len, uint8_t* out) {
+    size_t written = 0;
+    if (!ready) {
+        return 0;
+    }
+
+    // Complete a block started by an earlier piece
+    if (pendingLen > 0) {
+        size_t take = BLOCK_SIZE - pendingLen;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(pending + pendingLen, in, take);
+        pendingLen += take;
+        in += take;
+        len -= take;
+        if (pendingLen < BLOCK_SIZE) {
+            return 0;
+        }
+        if (!cryptoAesCbc(lease.context(), true, BLOCK_SIZE, iv, pending, out)) {
+            ready = false;
+            return 0;
+        }
+        written = BLOCK_SIZE;
+        pendingLen = 0;
+    }
+
+    size_t run = len & ~(BLOCK_SIZE - 1);
+    if (run > 0) {
+        if (!cryptoAesCbc(lease.context(), true, run, iv, in, out + written)) {
+            ready = false;
+            return written;
+        }
+        written += run;
+    }
+    memcpy(pending, in + run, len - run);
+    pendingLen = len - run;
+    return written;
+}
+
+bool CbcEncryptStream::finish(uint8_t* out, size_t& outLen) {
+    outLen = 0;
+    if (!ready) {
+        return false;
+    }
+    ready = false;
+
+    uint8_t padding = BLOCK_SIZE - pendingLen;
+    memset(pending + pendingLen, padding, padding);
+    if (!cryptoAesCbc(lease.context(), true, BLOCK_SIZE, iv, pending, out)) {
+        return false;
+    }
+    outLen = BLOCK_SIZE;
+    return true;
+}
+
+CbcDecryptStream::~CbcDecryptStream() {
+    memset(pending, 0, sizeof(pending));
+}
+
+bool CbcDecryptStream::begin(const uint8_t* ivIn, uint16_t keyVersion) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    ready = false;
+    pendingLen = 0;
+    if (!lease.acquire(false, keyVersion)) {
+        return false;
+    }
+    memcpy(iv, ivIn ? ivIn : crypto.iv, BLOCK_SIZE);
+    ready = true;
+    return true;
+}
+
+size_t CbcDecryptStream::update(const uint8_t* in, size_t len, uint8_t* out) {
+    size_t written = 0;
+    if (!ready) {
+        return 0;
+    }
+
+    while (len > 0) {
+        // A held block is only the last one if nothing follows it
+        if (pendingLen == BLOCK_SIZE) {
+            if (!cryptoAesCbc(lease.context(), false, BLOCK_SIZE, iv, pending, out + written)) {
+                ready = false;
+                return written;
+            }
+            written += BLOCK_SIZE;
+            pendingLen = 0;
+        }
+
+        // Whole blocks straight from the input, short of the last one
+        if (pendingLen == 0 && len > BLOCK_SIZE) {
+            size_t run = (len - 1) & ~(BLOCK_SIZE - 1);
+            if (!cryptoAesCbc(lease.context(), false, run, iv, in, out + written)) {
+                ready = false;
+                return written;
+            }
+            written += run;
+            in += run;
+            len -= run;
+        }
+
+        size_t take = BLOCK_SIZE - pendingLen;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(pending + pendingLen, in, take);
+        pendingLen += take;
+        in += take;
+        len -= take;
+    }
+    return written;
+}
+
+bool CbcDecryptStream::finish(uint8_t* out, size_t& outLen) {
+    outLen = 0;
+    if (!ready || pendingLen != BLOCK_SIZE) {
+        return false;
+    }
+    ready = false;
+
+    uint8_t block[BLOCK_SIZE];
+    if (!cryptoAesCbc(lease.context(), false, BLOCK_SIZE, iv, pending, block)) {
+        return false;
+    }
+    uint8_t padding = block[BLOCK_SIZE - 1];
+    bool ok = padding > 0 && padding <= BLOCK_SIZE;
+    for (size_t i = BLOCK_SIZE - padding; ok && i < BLOCK_SIZE; i++) {
+        ok = block[i] == padding;
+    }
+    if (ok) {
+        outLen = BLOCK_SIZE - padding;
+        memcpy(out, block, outLen);
+    }
+    memset(block, 0, sizeof(block));
+    return ok;
+}
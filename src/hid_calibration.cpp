@@ -0,0 +1,319 @@
+#include "../include/hid_calibration.h"
+#include <Preferences.h>
+
+// Lock key usages and their bits in the LED output report
+#define HID_KEY_CAPS_LOCK   0x39
+#define HID_KEY_SCROLL_LOCK 0x47
+#define HID_KEY_NUM_LOCK    0x53
+#define LED_NUM_LOCK    0x01
+#define LED_CAPS_LOCK   0x02
+#define LED_SCROLL_LOCK 0x04
+
+volatile uint8_t HidCalibrator::ledState = 0;
+volatile uint32_t HidCalibrator::ledEvents = 0;
+volatile uint32_t HidCalibrator::capsToggles = 0;
+volatile unsigned long HidCalibrator::lastLedEventUs = 0;
+
+HidCalibrator& HidCalibrator::getInstance() {
+    static HidCalibrator instance;
+    return instance;
+}
+
+void HidCalibrator::onLedEvent(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    arduino_usb_hid_keyboard_event_data_t* event = (arduino_usb_hid_keyboard_event_data_t*)data;
+    uint8_t leds = event->leds;
+
+    if ((leds ^ ledState) & LED_CAPS_LOCK) {
+        capsToggles++;
+    }
+    ledState = leds;
+    lastLedEventUs = micros();
+    ledEvents++;
+}
+
+void HidCalibrator::begin(USBHIDKeyboard* keyboard) {
+    keyboard->onEvent(ARDUINO_USB_HID_KEYBOARD_LED_EVENT, onLedEvent);
+
+    PacingProfile profile;
+    String host = activeHost();
+    if (host.length() > 0 && loadProfile(host, profile)) {
+        applyProfile(profile);
+        Serial.println("HID pacing profile '" + host + "': " + String(profile.reportIntervalUs) +
+                       " us, " + String(profile.maxKeysPerReport) + " keys/report");
+    } else {
+        Serial.println("HID pacing: defaults (no calibrated host)");
+    }
+}
+
+bool HidCalibrator::waitForEvents(uint32_t target, uint32_t timeoutMs) {
+    unsigned long start = millis();
+    while ((int32_t)(ledEvents - target) < 0) {
+        if (millis() - start > timeoutMs) {
+            return false;
+        }
+        delay(1);
+    }
+    return true;
+}
+
+void HidCalibrator::tapKeys(const uint8_t* keycodes, uint8_t count) {
+    HidInjector& injector = HidInjector::getInstance();
+    for (uint8_t i = 0; i < count; i++) {
+        KeyStroke stroke = {0, keycodes[i]};
+        injector.pushKeyStroke(stroke);
+    }
+    injector.flush();
+}
+
+void HidCalibrator::restoreLeds(uint8_t wanted) {
+    HidInjector& injector = HidInjector::getInstance();
+    injector.setReportInterval(SLOW_INTERVAL_US);
+    injector.setMaxKeysPerReport(1);
+
+    const uint8_t bits[] = {LED_NUM_LOCK, LED_CAPS_LOCK, LED_SCROLL_LOCK};
+    const uint8_t keys[] = {HID_KEY_NUM_LOCK, HID_KEY_CAPS_LOCK, HID_KEY_SCROLL_LOCK};
+    for (uint8_t i = 0; i < 3; i++) {
+        if ((ledState ^ wanted) & bits[i]) {
+            uint32_t target = ledEvents + 1;
+            tapKeys(&keys[i], 1);
+            waitForEvents(target, ECHO_TIMEOUT_MS);
+        }
+    }
+}
+
+bool HidCalibrator::measureEcho(uint32_t& latencyUs) {
+    HidInjector& injector = HidInjector::getInstance();
+    injector.setReportInterval(SLOW_INTERVAL_US);
+    injector.setMaxKeysPerReport(1);
+
+    const uint8_t caps = HID_KEY_CAPS_LOCK;
+    uint32_t target = ledEvents + 1;
+    unsigned long start = micros();
+    tapKeys(&caps, 1);
+    if (!waitForEvents(target, ECHO_TIMEOUT_MS)) {
+        return false;
+    }
+    latencyUs = lastLedEventUs - start;
+
+    // Toggle back
+    target = ledEvents + 1;
+    tapKeys(&caps, 1);
+    return waitForEvents(target, ECHO_TIMEOUT_MS);
+}
+
+bool HidCalibrator::trial(uint32_t intervalUs, uint32_t settleMs) {
+    HidInjector& injector = HidInjector::getInstance();
+    injector.setReportInterval(intervalUs);
+    injector.setMaxKeysPerReport(1);
+
+    uint8_t before = ledState;
+    uint32_t togglesBefore = capsToggles;
+
+    // Repeating a key forces a release report between presses, so this is
+    // 2 * TRIAL_TOGGLES reports at the interval under test
+    KeyStroke caps = {0, HID_KEY_CAPS_LOCK};
+    for (uint8_t i = 0; i < TRIAL_TOGGLES; i++) {
+        injector.pushKeyStroke(caps);
+    }
+    injector.flush();
+    delay(settleMs);
+
+    bool ok = (capsToggles - togglesBefore) == TRIAL_TOGGLES;
+    restoreLeds(before);
+    return ok;
+}
+
+bool HidCalibrator::probeMultiKey(uint32_t intervalUs, uint32_t settleMs) {
+    HidInjector& injector = HidInjector::getInstance();
+    injector.setReportInterval(intervalUs);
+    injector.setMaxKeysPerReport(3);
+
+    uint8_t before = ledState;
+    const uint8_t keys[] = {HID_KEY_NUM_LOCK, HID_KEY_CAPS_LOCK, HID_KEY_SCROLL_LOCK};
+    tapKeys(keys, 3);
+    delay(settleMs);
+
+    // All three lock keys must have registered from the one report
+    const uint8_t all = LED_NUM_LOCK | LED_CAPS_LOCK | LED_SCROLL_LOCK;
+    bool ok = ((ledState ^ before) & all) == all;
+    restoreLeds(before);
+    return ok;
+}
+
+CalibrationResult HidCalibrator::lastResult() {
+    portENTER_CRITICAL(&resultMux);
+    CalibrationResult copy = result;
+    portEXIT_CRITICAL(&resultMux);
+    return copy;
+}
+
+// Makes a run's result the one lastResult() returns; passes on its outcome
+bool HidCalibrator::publish(const CalibrationResult& run) {
+    portENTER_CRITICAL(&resultMux);
+    result = run;
+    portEXIT_CRITICAL(&resultMux);
+    return run.valid;
+}
+
+bool HidCalibrator::calibrate(const String& host) {
+    HidInjector& injector = HidInjector::getInstance();
+    uint32_t savedInterval = injector.getReportInterval();
+    uint8_t savedMaxKeys = injector.getMaxKeysPerReport();
+
+    CalibrationResult run = {};
+    snprintf(run.host, sizeof(run.host), "%s", host.c_str());
+    run.error = "";
+
+    if (!validHostName(host)) {
+        run.error = "Host name must be 1-12 letters, digits, '-' or '_'";
+        return publish(run);
+    }
+
+    Serial.println("Calibrating HID pacing for host '" + host + "'...");
+
+    uint32_t latencyUs = 0;
+    if (!measureEcho(latencyUs)) {
+        run.error = "Host does not echo lock key LEDs";
+        Serial.println("Calibration failed: " + String(run.error));
+        injector.setReportInterval(savedInterval);
+        injector.setMaxKeysPerReport(savedMaxKeys);
+        return publish(run);
+    }
+    run.echoLatencyUs = latencyUs;
+    uint32_t settleMs = (2 * latencyUs) / 1000 + 30;
+    Serial.println("  LED echo latency: " + String(latencyUs) + " us");
+
+    // Binary search for the shortest interval that loses no toggles
+    uint32_t lo = 0;
+    uint32_t hi = SLOW_INTERVAL_US;
+    if (!trial(hi, settleMs)) {
+        run.error = "Host drops keystrokes even at the slowest rate";
+        Serial.println("Calibration failed: " + String(run.error));
+        injector.setReportInterval(savedInterval);
+        injector.setMaxKeysPerReport(savedMaxKeys);
+        return publish(run);
+    }
+    while (hi - lo > SEARCH_STEP_US) {
+        uint32_t mid = (lo + hi) / 2;
+        bool ok = trial(mid, settleMs);
+        Serial.println("  " + String(mid) + " us: " + String(ok ? "ok" : "lost keys"));
+        if (ok) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    // Margin for host load, never faster than one report per poll frame
+    uint32_t interval = hi + hi / 4;
+    if (interval < HID_POLL_INTERVAL_US) {
+        interval = HID_POLL_INTERVAL_US;
+    }
+
+    PacingProfile profile = {};
+    profile.reportIntervalUs = interval;
+    profile.maxKeysPerReport = probeMultiKey(interval, settleMs) ? 6 : 1;
+
+    run.profile = profile;
+    run.valid = true;
+
+    saveProfile(host, profile);
+    applyProfile(profile);
+    publish(run);
+
+    Serial.println("Calibration done: " + String(interval) + " us, " +
+                   String(profile.maxKeysPerReport) + " keys/report");
+    return true;
+}
+
+void HidCalibrator::applyProfile(const PacingProfile& profile) {
+    HidInjector& injector = HidInjector::getInstance();
+    injector.setReportInterval(profile.reportIntervalUs);
+    injector.setMaxKeysPerReport(profile.maxKeysPerReport);
+}
+
+bool HidCalibrator::validHostName(const String& host) {
+    if (host.length() == 0 || host.length() > PACING_HOST_NAME_MAX) {
+        return false;
+    }
+    for (unsigned int i = 0; i < host.length(); i++) {
+        char c = host.charAt(i);
+        if (!isalnum(c) && c != '-' && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HidCalibrator::saveProfile(const String& host, const PacingProfile& profile) {
+    Preferences prefs;
+    if (!prefs.begin("hidpace", false)) {
+        return false;
+    }
+
+    String key = "p_" + host;
+    bool ok = prefs.putBytes(key.c_str(), &profile, sizeof(profile)) == sizeof(profile);
+
+    // Keep a list of hosts so the web UI can offer them
+    String hosts = prefs.getString("hosts", "");
+    if (("," + hosts + ",").indexOf("," + host + ",") < 0) {
+        hosts = hosts.length() > 0 ? hosts + "," + host : host;
+        prefs.putString("hosts", hosts);
+    }
+    prefs.putString("active", host);
+
+    prefs.end();
+    return ok;
+}
+
+bool HidCalibrator::loadProfile(const String& host, PacingProfile& out) {
+    if (!validHostName(host)) {
+        return false;
+    }
+
+    Preferences prefs;
+    if (!prefs.begin("hidpace", true)) {
+        return false;
+    }
+    String key = "p_" + host;
+    bool ok = prefs.getBytes(key.c_str(), &out, sizeof(out)) == sizeof(out);
+    prefs.end();
+
+    return ok && out.maxKeysPerReport >= 1;
+}
+
+bool HidCalibrator::selectHost(const String& host) {
+    PacingProfile profile;
+    if (!loadProfile(host, profile)) {
+        return false;
+    }
+
+    Preferences prefs;
+    if (prefs.begin("hidpace", false)) {
+        prefs.putString("active", host);
+        prefs.end();
+    }
+
+    applyProfile(profile);
+    return true;
+}
+
+String HidCalibrator::activeHost() {
+    Preferences prefs;
+    if (!prefs.begin("hidpace", true)) {
+        return "";
+    }
+    String host = prefs.getString("active", "");
+    prefs.end();
+    return host;
+}
+
+String HidCalibrator::knownHosts() {
+    Preferences prefs;
+    if (!prefs.begin("hidpace", true)) {
+        return "";
+    }
+    String hosts = prefs.getString("hosts", "");
+    prefs.end();
+    return hosts;
+}
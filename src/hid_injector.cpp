@@ -0,0 +1,177 @@
+#include "../include/hid_injector.h"
+
+HidInjector& HidInjector::getInstance() {
+    static HidInjector instance;
+    return instance;
+}
+
+void HidInjector::begin(USBHIDKeyboard* kbd) {
+    keyboard = kbd;
+    pendingCount = 0;
+    lastSentCount = 0;
+    memset(&pending, 0, sizeof(pending));
+    memset(&lastSent, 0, sizeof(lastSent));
+    lastReportUs = micros();
+}
+
+void HidInjector::setReportInterval(uint32_t intervalUs) {
+    reportIntervalUs = intervalUs;
+}
+
+void HidInjector::setMaxKeysPerReport(uint8_t maxKeys) {
+    if (maxKeys < 1) maxKeys = 1;
+    if (maxKeys > REPORT_KEYS) maxKeys = REPORT_KEYS;
+    maxKeysPerReport = maxKeys;
+}
+
+uint8_t HidInjector::charToKeyStrokes(char c, KeyboardLayoutId layout, KeyStroke out[2]) {
+    if ((uint8_t)c >= 128 || layout >= LAYOUT_COUNT) {
+        return 0;
+    }
+
+    const LayoutKey& key = layoutLookup(layout, c);
+    if (key.keycode == 0) {
+        return 0;
+    }
+
+    uint8_t count = 0;
+    if (key.deadKeycode != 0) {
+        out[count].modifiers = key.deadModifiers;
+        out[count].keycode = key.deadKeycode;
+        count++;
+    }
+    out[count].modifiers = key.modifiers;
+    out[count].keycode = key.keycode;
+    return count + 1;
+}
+
+bool HidInjector::reportHasKey(const KeyReport& report, uint8_t count, uint8_t keycode) {
+    for (uint8_t i = 0; i < count; i++) {
+        if (report.keys[i] == keycode) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void HidInjector::pushKeyStroke(const KeyStroke& stroke) {
+    // A key can only be in a report once, and all keys share the modifiers.
+    // A key held in the last report has to wait for the pending one, which
+    // releases it.
+    if (pendingCount > 0 &&
+        (pendingCount >= maxKeysPerReport ||
+         pending.modifiers != stroke.modifiers ||
+         reportHasKey(pending, pendingCount, stroke.keycode) ||
+         reportHasKey(lastSent, lastSentCount, stroke.keycode))) {
+        sendPending();
+    }
+
+    if (pendingCount == 0) {
+        // A key still held from the previous report would not register as a
+        // new press, so the host has to see it released first
+        if (reportHasKey(lastSent, lastSentCount, stroke.keycode)) {
+            KeyReport release = {};
+            sendReport(release, 0);
+        }
+        pending.modifiers = stroke.modifiers;
+    }
+
+    // Keys missing from this report are released by it, so the releases of
+    // the previous report ride along with these presses
+    pending.keys[pendingCount++] = stroke.keycode;
+}
+
+void HidInjector::flush() {
+    sendPending();
+    if (lastSentCount > 0 || lastSent.modifiers != 0) {
+        KeyReport release = {};
+        sendReport(release, 0);
+    }
+}
+
+size_t HidInjector::compileText(const char* text, size_t len, KeyboardLayoutId layout,
+                                std::vector<KeyStroke>& out) {
+    size_t untypeable = 0;
+    KeyStroke strokes[2];
+
+    out.clear();
+    out.reserve(len);
+    for (size_t i = 0; i < len; i++) {
+        uint8_t count = charToKeyStrokes(text[i], layout, strokes);
+        if (count == 0) {
+            untypeable++;
+        }
+        for (uint8_t j = 0; j < count; j++) {
+            out.push_back(strokes[j]);
+        }
+    }
+    out.shrink_to_fit();
+
+    return untypeable;
+}
+
+size_t HidInjector::typeKeyStrokes(const KeyStroke* strokes, size_t count,
+                                   InjectProgressFn progress, void* ctx) {
+    size_t sent = 0;
+
+    while (sent < count) {
+        pushKeyStroke(strokes[sent++]);
+        if (progress && !progress(sent, count, ctx)) {
+            break;
+        }
+    }
+
+    flush();
+    return sent;
+}
+
+size_t HidInjector::typeText(const char* text, size_t len, KeyboardLayoutId layout,
+                             InjectProgressFn progress, void* ctx) {
+    size_t typed = 0;
+    KeyStroke strokes[2];
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t count = charToKeyStrokes(text[i], layout, strokes);
+        for (uint8_t j = 0; j < count; j++) {
+            pushKeyStroke(strokes[j]);
+        }
+        if (count > 0) {
+            typed++;
+        }
+        if (progress && !progress(i + 1, len, ctx)) {
+            break;
+        }
+    }
+
+    flush();
+    return typed;
+}
+
+void HidInjector::sendPending() {
+    if (pendingCount == 0) {
+        return;
+    }
+    sendReport(pending, pendingCount);
+    memset(&pending, 0, sizeof(pending));
+    pendingCount = 0;
+}
+
+void HidInjector::sendReport(const KeyReport& report, uint8_t keyCount) {
+    if (!keyboard) {
+        return;
+    }
+
+    // sendReport() blocks until the host has polled the report, so the gap
+    // is measured from when it was handed over. Measuring from the return
+    // would add a whole poll frame to every report.
+    while (micros() - lastReportUs < reportIntervalUs) {
+        delayMicroseconds(50);
+    }
+
+    KeyReport copy = report;
+    lastReportUs = micros();
+    keyboard->sendReport(&copy);
+
+    lastSent = report;
+    lastSentCount = keyCount;
+}
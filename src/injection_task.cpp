@@ -0,0 +1,309 @@
+#include "../include/injection_task.h"
+#include "../include/hid_calibration.h"
+
+InjectionTask& InjectionTask::getInstance() {
+    static InjectionTask instance;
+    return instance;
+}
+
+bool InjectionTask::begin() {
+    if (task) {
+        return true;
+    }
+
+    queue = xQueueCreate(INJECTION_QUEUE_DEPTH, sizeof(Job));
+    if (!queue) {
+        Serial.println("Failed to create injection queue");
+        return false;
+    }
+
+    if (xTaskCreatePinnedToCore(taskMain, "hid_inject", HID_TASK_STACK, this,
+                                HID_TASK_PRIORITY, &task, HID_TASK_CORE) != pdPASS) {
+        Serial.println("Failed to start injection task");
+        task = nullptr;
+        return false;
+    }
+
+    Serial.println("Injection task running on core " + String(HID_TASK_CORE));
+    return true;
+}
+
+uint32_t InjectionTask::enqueueText(const char* text, size_t len, KeyboardLayoutId layout) {
+    return enqueue(JOB_TEXT, layout, text, len, len);
+}
+
+uint32_t InjectionTask::enqueueKeyStrokes(const KeyStroke* strokes, size_t count) {
+    return enqueue(JOB_KEYSTROKES, LAYOUT_DEFAULT, strokes, count * sizeof(KeyStroke), count);
+}
+
+uint32_t InjectionTask::enqueueCalibration(const String& host) {
+    return enqueue(JOB_CALIBRATE, LAYOUT_DEFAULT, host.c_str(), host.length() + 1, host.length() + 1);
+}
+
+uint32_t InjectionTask::enqueueHostSelect(const String& host) {
+    return enqueue(JOB_SELECT_HOST, LAYOUT_DEFAULT, host.c_str(), host.length() + 1, host.length() + 1);
+}
+
+uint32_t InjectionTask::openStream(KeyboardLayoutId layout, size_t expectedLen,
+                                  InjectionAckFn ack, void* ctx) {
+    if (!queue || expectedLen == 0) {
+        return 0;
+    }
+
+    // Claim the ring; the last stream may still be held by a side
+    portENTER_CRITICAL(&streamMux);
+    bool busy = writerOpen || readerOpen;
+    if (!busy) {
+        writerOpen = true;
+        readerOpen = true;
+        written = 0;
+        consumed = 0;
+        streamClosed = false;
+        streamAborted = false;
+        ackFn = ack;
+        ackCtx = ctx;
+    }
+    portEXIT_CRITICAL(&streamMux);
+    if (busy) {
+        return 0;
+    }
+
+    uint32_t jobId = enqueue(JOB_STREAM, layout, nullptr, 0, expectedLen);
+    if (jobId == 0) {
+        portENTER_CRITICAL(&streamMux);
+        ackFn = nullptr;
+        writerOpen = false;
+        readerOpen = false;
+        portEXIT_CRITICAL(&streamMux);
+        return 0;
+    }
+    streamJobId = jobId;
+    return jobId;
+}
+
+bool InjectionTask::writeStream(uint32_t jobId, const uint8_t* data, size_t len) {
+    // The ring stays ours until closeStream(), even after the task stops
+    if (streamJobId != jobId || streamClosed || streamAborted) {
+        return false;
+    }
+    size_t pos = written;
+    if (len > INJECTION_RING_SIZE - (pos - __atomic_load_n(&consumed, __ATOMIC_ACQUIRE))) {
+        Serial.println("Injection stream overran its window");
+        return false;
+    }
+
+    size_t at = pos % INJECTION_RING_SIZE;
+    size_t first = len < INJECTION_RING_SIZE - at ? len : INJECTION_RING_SIZE - at;
+    memcpy(ring + at, data, first);
+    memcpy(ring, data + first, len - first);
+    __atomic_store_n(&written, pos + len, __ATOMIC_SEQ_CST);
+    xTaskNotifyGive(task);
+
+    // A task that stopped reading before it saw this write does not ack it
+    return !__atomic_load_n(&streamAborted, __ATOMIC_SEQ_CST);
+}
+
+void InjectionTask::closeStream(uint32_t jobId) {
+    if (streamJobId != jobId || jobId == 0) {
+        return;
+    }
+    __atomic_store_n(&streamClosed, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(task);
+
+    // The writer's connection may go away after this, so wait out an ack
+    portENTER_CRITICAL(&streamMux);
+    ackFn = nullptr;
+    portEXIT_CRITICAL(&streamMux);
+    while (acking) {
+        vTaskDelay(1);
+    }
+    releaseStream(true);
+}
+
+// Outside the critical section: the ack goes through the TCP/IP task
+void InjectionTask::ackStream(size_t bytes) {
+    portENTER_CRITICAL(&streamMux);
+    InjectionAckFn fn = ackFn;
+    void* ctx = ackCtx;
+    acking = fn != nullptr;
+    portEXIT_CRITICAL(&streamMux);
+
+    if (fn) {
+        fn(bytes, ctx);
+        acking = false;
+    }
+}
+
+// Later writes fail at once. What is left in the ring is acked, so a
+// sender held at a closed window gets through to a write that fails.
+void InjectionTask::stopReading(size_t done) {
+    __atomic_store_n(&streamAborted, true, __ATOMIC_SEQ_CST);
+    size_t left = __atomic_load_n(&written, __ATOMIC_SEQ_CST) - done;
+    if (left > 0) {
+        ackStream(left);
+    }
+    releaseStream(false);
+}
+
+void InjectionTask::releaseStream(bool writer) {
+    portENTER_CRITICAL(&streamMux);
+    bool& side = writer ? writerOpen : readerOpen;
+    if (side) {
+        side = false;
+        if (!writerOpen && !readerOpen) {
+            streamJobId = 0;
+        }
+    }
+    portEXIT_CRITICAL(&streamMux);
+}
+
+uint32_t InjectionTask::enqueue(JobType type, KeyboardLayoutId layout, const void* data,
+                                size_t bytes, size_t length) {
+    if (!queue || (length == 0 && type != JOB_STREAM)) {
+        return 0;
+    }
+
+    void* copy = nullptr;
+    if (bytes > 0) {
+        copy = malloc(bytes);
+        if (!copy) {
+            Serial.println("Out of memory for injection job");
+            return 0;
+        }
+        memcpy(copy, data, bytes);
+    }
+
+    Job job;
+    job.id = __atomic_fetch_add(&nextJobId, 1, __ATOMIC_RELAXED);
+    job.generation = generation;
+    job.type = type;
+    job.layout = layout;
+    job.data = copy;
+    job.length = length;
+
+    if (xQueueSend(queue, &job, 0) != pdTRUE) {
+        Serial.println("Injection queue full");
+        free(copy);
+        return 0;
+    }
+    return job.id;
+}
+
+void InjectionTask::cancelAll() {
+    // Jobs from an older generation are dropped by the task, including the
+    // one it is typing right now
+    generation.fetch_add(1);
+    Serial.println("Injection cancelled");
+}
+
+bool InjectionTask::isBusy() {
+    return running || (queue && uxQueueMessagesWaiting(queue) > 0);
+}
+
+InjectionStatus InjectionTask::getStatus() {
+    InjectionStatus status;
+    status.busy = running;
+    status.jobId = currentJobId;
+    status.done = progressDone;
+    status.total = progressTotal;
+    status.queued = queue ? uxQueueMessagesWaiting(queue) : 0;
+    status.finished = finishedJobs;
+    status.lastCancelled = lastCancelled;
+    return status;
+}
+
+bool InjectionTask::onProgress(size_t done, size_t total, void* ctx) {
+    const Job* job = (const Job*)ctx;
+    InjectionTask& self = getInstance();
+    self.progressDone = done;
+    return job->generation == self.generation;
+}
+
+void InjectionTask::runJob(const Job& job) {
+    // Nothing is typed, so not reported as a finished job
+    if (job.type == JOB_SELECT_HOST) {
+        HidCalibrator::getInstance().selectHost(String((const char*)job.data));
+        return;
+    }
+
+    currentJobId = job.id;
+    progressDone = 0;
+    progressTotal = job.length;
+    running = true;
+
+    HidInjector& injector = HidInjector::getInstance();
+    if (job.type == JOB_TEXT) {
+        injector.typeText((const char*)job.data, job.length, job.layout, onProgress, (void*)&job);
+    } else if (job.type == JOB_KEYSTROKES) {
+        injector.typeKeyStrokes((const KeyStroke*)job.data, job.length, onProgress, (void*)&job);
+    } else if (job.type == JOB_STREAM) {
+        runStream(job);
+    } else {
+        HidCalibrator::getInstance().calibrate(String((const char*)job.data));
+    }
+
+    lastCancelled = (job.generation != generation);
+    running = false;
+    finishedJobs++;
+}
+
+void InjectionTask::runStream(const Job& job) {
+    HidInjector& injector = HidInjector::getInstance();
+    KeyStroke strokes[2];
+    size_t done = 0;
+
+    while (job.generation == generation) {
+        // Closed is read before the count, so nothing written before the
+        // close is missed
+        bool closed = __atomic_load_n(&streamClosed, __ATOMIC_ACQUIRE);
+        size_t available = __atomic_load_n(&written, __ATOMIC_ACQUIRE);
+
+        if (available == done) {
+            if (closed) {
+                break;
+            }
+            // Input is lagging: don't leave keys sitting in a half-full report
+            injector.flush();
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+            continue;
+        }
+
+        // A slice at a time so a cancel is seen promptly, and the sender
+        // is let on as soon as there is room
+        size_t end = available - done > 128 ? done + 128 : available;
+        size_t start = done;
+        for (; done < end; done++) {
+            uint8_t count = HidInjector::charToKeyStrokes(ring[done % INJECTION_RING_SIZE], job.layout, strokes);
+            for (uint8_t j = 0; j < count; j++) {
+                injector.pushKeyStroke(strokes[j]);
+            }
+        }
+        __atomic_store_n(&consumed, done, __ATOMIC_RELEASE);
+        ackStream(done - start);
+        progressDone = done;
+        if (done > progressTotal) {
+            progressTotal = done;
+        }
+    }
+
+    injector.flush();
+    stopReading(done);
+}
+
+void InjectionTask::taskMain(void* arg) {
+    InjectionTask* self = (InjectionTask*)arg;
+    Job job;
+
+    for (;;) {
+        if (xQueueReceive(self->queue, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        if (job.generation == self->generation) {
+            self->runJob(job);
+        } else if (job.type == JOB_STREAM) {
+            self->stopReading(0);
+        }
+        free(job.data);
+    }
+}
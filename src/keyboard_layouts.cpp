@@ -0,0 +1,171 @@
+#include "../include/keyboard_layouts.h"
+#include "../include/hid_injector.h"
+#include <strings.h>
+
+// Layout tables are generated by constexpr builders so they land in flash
+// as plain arrays and lookups are a single index. Each layout is the US
+// table plus a list of per-character overrides; definitions follow the
+// Windows variants of each layout (dead keys are followed by a space).
+
+namespace {
+
+#define S  HID_MOD_LSHIFT
+#define AG HID_MOD_RALT
+
+// HID usages for keys that move between layouts (named by the US legend)
+enum : uint8_t {
+    K_A = 0x04, K_M = 0x10, K_Q = 0x14, K_W = 0x1A, K_Y = 0x1C, K_Z = 0x1D,
+    K_1 = 0x1E, K_2 = 0x1F, K_3 = 0x20, K_4 = 0x21, K_5 = 0x22,
+    K_6 = 0x23, K_7 = 0x24, K_8 = 0x25, K_9 = 0x26, K_0 = 0x27,
+    K_ENTER = 0x28, K_ESC = 0x29, K_BKSP = 0x2A, K_TAB = 0x2B, K_SPACE = 0x2C,
+    K_MINUS = 0x2D, K_EQUAL = 0x2E, K_LBRACKET = 0x2F, K_RBRACKET = 0x30,
+    K_BACKSLASH = 0x31, K_NONUS_HASH = 0x32, K_SEMICOLON = 0x33,
+    K_QUOTE = 0x34, K_GRAVE = 0x35, K_COMMA = 0x36, K_DOT = 0x37,
+    K_SLASH = 0x38, K_NONUS_BACKSLASH = 0x64
+};
+
+struct LayoutOverride {
+    char c;
+    LayoutKey key;
+};
+
+constexpr LayoutKey key(uint8_t keycode, uint8_t modifiers = 0) {
+    return LayoutKey{keycode, modifiers, 0, 0};
+}
+
+constexpr LayoutKey dead(uint8_t deadKeycode, uint8_t deadModifiers) {
+    return LayoutKey{K_SPACE, 0, deadKeycode, deadModifiers};
+}
+
+constexpr KeyboardLayout makeUsLayout() {
+    KeyboardLayout layout{};
+
+    layout.keys['\b'] = key(K_BKSP);
+    layout.keys['\t'] = key(K_TAB);
+    layout.keys['\n'] = key(K_ENTER);
+    layout.keys[0x1B] = key(K_ESC);
+    layout.keys[' '] = key(K_SPACE);
+
+    for (int i = 0; i < 26; i++) {
+        layout.keys['a' + i] = key(K_A + i);
+        layout.keys['A' + i] = key(K_A + i, S);
+    }
+    layout.keys['0'] = key(K_0);
+    for (int i = 0; i < 9; i++) {
+        layout.keys['1' + i] = key(K_1 + i);
+    }
+
+    const char shiftedDigits[] = "!@#$%^&*(";
+    for (int i = 0; i < 9; i++) {
+        layout.keys[(uint8_t)shiftedDigits[i]] = key(K_1 + i, S);
+    }
+    layout.keys[')'] = key(K_0, S);
+
+    layout.keys['-'] = key(K_MINUS);       layout.keys['_'] = key(K_MINUS, S);
+    layout.keys['='] = key(K_EQUAL);       layout.keys['+'] = key(K_EQUAL, S);
+    layout.keys['['] = key(K_LBRACKET);    layout.keys['{'] = key(K_LBRACKET, S);
+    layout.keys[']'] = key(K_RBRACKET);    layout.keys['}'] = key(K_RBRACKET, S);
+    layout.keys['\\'] = key(K_BACKSLASH);  layout.keys['|'] = key(K_BACKSLASH, S);
+    layout.keys[';'] = key(K_SEMICOLON);   layout.keys[':'] = key(K_SEMICOLON, S);
+    layout.keys['\''] = key(K_QUOTE);      layout.keys['"'] = key(K_QUOTE, S);
+    layout.keys['`'] = key(K_GRAVE);       layout.keys['~'] = key(K_GRAVE, S);
+    layout.keys[','] = key(K_COMMA);       layout.keys['<'] = key(K_COMMA, S);
+    layout.keys['.'] = key(K_DOT);         layout.keys['>'] = key(K_DOT, S);
+    layout.keys['/'] = key(K_SLASH);       layout.keys['?'] = key(K_SLASH, S);
+
+    return layout;
+}
+
+template <size_t N>
+constexpr KeyboardLayout makeLayout(const LayoutOverride (&overrides)[N]) {
+    KeyboardLayout layout = makeUsLayout();
+    for (size_t i = 0; i < N; i++) {
+        layout.keys[(uint8_t)overrides[i].c] = overrides[i].key;
+    }
+    return layout;
+}
+
+// Polish as typed by earlier firmware versions: US positions, '@' on AltGr+2
+constexpr LayoutOverride plOverrides[] = {
+    {'@', key(K_2, AG)},
+};
+
+// German QWERTZ
+constexpr LayoutOverride deOverrides[] = {
+    {'y', key(K_Z)}, {'Y', key(K_Z, S)}, {'z', key(K_Y)}, {'Z', key(K_Y, S)},
+    {'"', key(K_2, S)}, {'&', key(K_6, S)}, {'/', key(K_7, S)},
+    {'(', key(K_8, S)}, {')', key(K_9, S)}, {'=', key(K_0, S)},
+    {'?', key(K_MINUS, S)}, {'\\', key(K_MINUS, AG)},
+    {'{', key(K_7, AG)}, {'[', key(K_8, AG)}, {']', key(K_9, AG)}, {'}', key(K_0, AG)},
+    {'+', key(K_RBRACKET)}, {'*', key(K_RBRACKET, S)}, {'~', key(K_RBRACKET, AG)},
+    {'#', key(K_NONUS_HASH)}, {'\'', key(K_NONUS_HASH, S)},
+    {'<', key(K_NONUS_BACKSLASH)}, {'>', key(K_NONUS_BACKSLASH, S)},
+    {'|', key(K_NONUS_BACKSLASH, AG)},
+    {',', key(K_COMMA)}, {';', key(K_COMMA, S)},
+    {'.', key(K_DOT)}, {':', key(K_DOT, S)},
+    {'-', key(K_SLASH)}, {'_', key(K_SLASH, S)},
+    {'@', key(K_Q, AG)},
+    {'^', dead(K_GRAVE, 0)}, {'`', dead(K_EQUAL, S)},
+};
+
+// French AZERTY
+constexpr LayoutOverride frOverrides[] = {
+    {'a', key(K_Q)}, {'A', key(K_Q, S)}, {'q', key(K_A)}, {'Q', key(K_A, S)},
+    {'z', key(K_W)}, {'Z', key(K_W, S)}, {'w', key(K_Z)}, {'W', key(K_Z, S)},
+    {'m', key(K_SEMICOLON)}, {'M', key(K_SEMICOLON, S)},
+    {'1', key(K_1, S)}, {'2', key(K_2, S)}, {'3', key(K_3, S)}, {'4', key(K_4, S)},
+    {'5', key(K_5, S)}, {'6', key(K_6, S)}, {'7', key(K_7, S)}, {'8', key(K_8, S)},
+    {'9', key(K_9, S)}, {'0', key(K_0, S)},
+    {'&', key(K_1)}, {'"', key(K_3)}, {'\'', key(K_4)}, {'(', key(K_5)},
+    {'-', key(K_6)}, {'_', key(K_8)}, {')', key(K_MINUS)}, {'=', key(K_EQUAL)},
+    {'+', key(K_EQUAL, S)},
+    {'#', key(K_3, AG)}, {'{', key(K_4, AG)}, {'[', key(K_5, AG)}, {'|', key(K_6, AG)},
+    {'\\', key(K_8, AG)}, {'^', key(K_9, AG)}, {'@', key(K_0, AG)},
+    {']', key(K_MINUS, AG)}, {'}', key(K_EQUAL, AG)},
+    {'~', dead(K_2, AG)}, {'`', dead(K_7, AG)},
+    {'$', key(K_RBRACKET)}, {'%', key(K_QUOTE, S)}, {'*', key(K_NONUS_HASH)},
+    {'<', key(K_NONUS_BACKSLASH)}, {'>', key(K_NONUS_BACKSLASH, S)},
+    {',', key(K_M)}, {'?', key(K_M, S)}, {';', key(K_COMMA)}, {'.', key(K_COMMA, S)},
+    {':', key(K_DOT)}, {'/', key(K_DOT, S)}, {'!', key(K_SLASH)},
+};
+
+// British ISO
+constexpr LayoutOverride ukOverrides[] = {
+    {'"', key(K_2, S)}, {'@', key(K_QUOTE, S)},
+    {'#', key(K_NONUS_HASH)}, {'~', key(K_NONUS_HASH, S)},
+    {'\\', key(K_NONUS_BACKSLASH)}, {'|', key(K_NONUS_BACKSLASH, S)},
+};
+
+#undef S
+#undef AG
+
+const char* const layoutNames[LAYOUT_COUNT] = {"US", "PL", "DE", "FR", "UK"};
+
+}  // namespace
+
+constexpr KeyboardLayout keyboardLayouts[LAYOUT_COUNT] = {
+    makeUsLayout(),
+    makeLayout(plOverrides),
+    makeLayout(deOverrides),
+    makeLayout(frOverrides),
+    makeLayout(ukOverrides),
+};
+
+static_assert(keyboardLayouts[LAYOUT_US].keys['a'].keycode == K_A, "US table");
+static_assert(keyboardLayouts[LAYOUT_DE].keys['z'].keycode == K_Y, "DE table");
+static_assert(keyboardLayouts[LAYOUT_FR].keys['a'].keycode == K_Q, "FR table");
+static_assert(keyboardLayouts[LAYOUT_PL].keys['@'].modifiers == HID_MOD_RALT, "PL table");
+
+bool keyboardLayoutFromName(const char* name, KeyboardLayoutId& out) {
+    for (uint8_t i = 0; i < LAYOUT_COUNT; i++) {
+        if (strcasecmp(name, layoutNames[i]) == 0) {
+            out = (KeyboardLayoutId)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* keyboardLayoutName(KeyboardLayoutId layout) {
+    return layout < LAYOUT_COUNT ? layoutNames[layout] : "?";
+}
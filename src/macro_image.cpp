@@ -0,0 +1,280 @@
+#include "../include/macro_image.h"
+#include <esp_attr.h>
+#include <esp_rom_crc.h>
+#include <esp_system.h>
+
+#define MACRO_WARM_MAGIC 0x4D524157   // "WARM"
+
+// The image that was last checked in full, and the log state it went with.
+// RTC memory keeps it across software resets, panics and deep sleep, so a
+// warm boot can skip the CRC pass over the table. The key is deliberately
+// not kept: it is reloaded from NVS.
+struct MacroWarmState {
+    uint32_t magic;
+    uint32_t imageCrc;
+    MacroLogState log;
+    uint32_t tag;              // CRC32 of the fields above
+};
+
+RTC_NOINIT_ATTR static MacroWarmState warmState;
+
+static uint32_t warmTag() {
+    return esp_rom_crc32_le(0, (const uint8_t*)&warmState, offsetof(MacroWarmState, tag));
+}
+
+static bool warmMatches(const MacroImageHeader& header) {
+    // After power loss RTC memory holds whatever it powered up with
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT || reason == ESP_RST_UNKNOWN) {
+        return false;
+    }
+    return warmState.magic == MACRO_WARM_MAGIC && warmState.tag == warmTag() &&
+           warmState.imageCrc == header.crc &&
+           memcmp(&warmState.log, &header.log, sizeof(header.log)) == 0;
+}
+
+static void setWarm(const MacroImageHeader& header) {
+    warmState.magic = MACRO_WARM_MAGIC;
+    warmState.imageCrc = header.crc;
+    warmState.log = header.log;
+    warmState.tag = warmTag();
+}
+
+static void clearWarm() {
+    warmState.magic = 0;
+}
+
+MacroImage& MacroImage::getInstance() {
+    static MacroImage instance;
+    return instance;
+}
+
+bool MacroImage::begin() {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                         (esp_partition_subtype_t)MACRO_IMAGE_SUBTYPE,
+                                         MACRO_IMAGE_PARTITION);
+    if (!partition) {
+        Serial.println("No " MACRO_IMAGE_PARTITION " partition, macro image disabled");
+        return false;
+    }
+
+    const void* ptr = nullptr;
+    if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &ptr, &mapHandle) != ESP_OK) {
+        Serial.println("Failed to map the " MACRO_IMAGE_PARTITION " partition");
+        partition = nullptr;
+        return false;
+    }
+    mapped = (const uint8_t*)ptr;
+    return true;
+}
+
+bool MacroImage::load(MacroTable& table, KeyboardLayoutId& layout) {
+    if (!mapped) {
+        return false;
+    }
+
+    MacroImageHeader header;
+    memcpy(&header, mapped, sizeof(header));
+    if (header.magic != MACRO_IMAGE_MAGIC || header.version != MACRO_IMAGE_VERSION ||
+        header.tableBytes > partition->size - sizeof(header) ||
+        (size_t)header.count * sizeof(MacroEntry) > header.tableBytes) {
+        return false;
+    }
+
+    // The log is checked either way: it may have been changed elsewhere
+    const uint8_t* image = mapped + sizeof(header);
+    bool warm = warmMatches(header);
+    if (!warm && esp_rom_crc32_le(0, image, header.tableBytes) != header.crc) {
+        Serial.println("Macro image is damaged");
+        clearWarm();
+        return false;
+    }
+    if (!MacroStore::getInstance().resume(header.log)) {
+        clearWarm();
+        return false;
+    }
+    setWarm(header);
+
+    if (warm) {
+        Serial.println("Warm start, macro image check skipped");
+    }
+    table.attach(image, header.count, header.tableBytes);
+    layout = header.layout < LAYOUT_COUNT ? (KeyboardLayoutId)header.layout : LAYOUT_DEFAULT;
+    return true;
+}
+
+// Erase ahead of the write position; flash only clears bits
+bool MacroImage::writeAt(size_t offset, const void* data, size_t len) {
+    if (offset + len > partition->size) {
+        return false;
+    }
+    if (offset + len > erasedTo) {
+        size_t end = (offset + len + SPI_FLASH_SEC_SIZE - 1) & ~(size_t)(SPI_FLASH_SEC_SIZE - 1);
+        if (esp_partition_erase_range(partition, erasedTo, end - erasedTo) != ESP_OK) {
+            return false;
+        }
+        erasedTo = end;
+    }
+    return esp_partition_write(partition, offset, data, len) == ESP_OK;
+}
+
+// Name, preview or content, and keystrokes of one macro
+bool MacroImage::writeMacro(MacroTable& table, size_t i) {
+    MacroEntry entry = table.entry(i);
+    const char* text = table.content(i);
+    size_t textLen = table.isStored(i) ? strlen(text) : table.contentLength(i);
+    size_t pos = dataStart + dataSize;
+
+    entry.nameOffset = dataSize;
+    if (!writeAt(pos, table.name(i), entry.nameLen + 1)) {
+        return false;
+    }
+    pos += entry.nameLen + 1;
+    entry.contentOffset = pos - dataStart;
+    if (!writeAt(pos, text, textLen + 1)) {
+        return false;
+    }
+    pos += textLen + 1;
+
+    std::vector<KeyStroke> strokes;
+    if (table.isStored(i) && !table.isSensitive(i)) {
+        std::vector<uint8_t> content;
+        if (!MacroStore::getInstance().readContent(table.recordOffset(i), table.recordLength(i), content)) {
+            return false;
+        }
+        HidInjector::compileText((const char*)content.data(), content.size(), table.layout(i), strokes);
+        memset(content.data(), 0, content.size());
+    } else if (!table.isStored(i)) {
+        strokes.assign(table.strokes(i), table.strokes(i) + table.strokeCount(i));
+    }
+
+    // KeyStroke is two bytes, so any offset will do
+    entry.strokesOffset = pos - dataStart;
+    entry.strokeCount = strokes.size();
+    if (!strokes.empty() && !writeAt(pos, strokes.data(), strokes.size() * sizeof(KeyStroke))) {
+        return false;
+    }
+    pos += strokes.size() * sizeof(KeyStroke);
+
+    entries[i] = entry;
+    dataSize = pos - dataStart;
+    return true;
+}
+
+bool MacroImage::updateStep(MacroTable& table, KeyboardLayoutId layout) {
+    MacroStoreLock guard;   // A web edit may replace the table otherwise
+    MacroStore& store = MacroStore::getInstance();
+    if (!mapped || CryptoManager::getInstance().hasSecret()) {
+        abort();
+        return false;
+    }
+
+    if (!writing) {
+        // Nothing to do while the table is the image, or was not loaded
+        if (table.isAttached() || table.count() == 0 || store.generation() == skipGeneration) {
+            return false;
+        }
+        MacroLogState state;
+        if (!store.getState(state)) {
+            return false;
+        }
+
+        // The first write erases the old header
+        clearWarm();
+        writing = true;
+        writeGeneration = store.generation();
+        next = 0;
+        dataStart = sizeof(MacroImageHeader) + table.count() * sizeof(MacroEntry);
+        dataSize = 0;
+        erasedTo = 0;
+        entries.assign(table.count(), MacroEntry());
+        Serial.println("Writing macro image (" + String((unsigned long)table.count()) + " macros)");
+        return true;
+    }
+
+    // The table and the state it was built from must not change under us
+    if (store.generation() != writeGeneration || table.isAttached() || entries.size() != table.count()) {
+        abort();
+        return false;
+    }
+
+    for (size_t n = 0; n < MACRO_IMAGE_STEP_MACROS && next < table.count(); n++, next++) {
+        if (!writeMacro(table, next)) {
+            if (dataStart + dataSize + SPI_FLASH_SEC_SIZE > partition->size) {
+                Serial.println("Macro library does not fit the " MACRO_IMAGE_PARTITION " partition");
+                skipGeneration = writeGeneration;
+            } else {
+                Serial.println("Failed to write macro image");
+            }
+            abort();
+            return false;
+        }
+    }
+    if (next < table.count()) {
+        return true;
+    }
+    return finish(table, layout);
+}
+
+bool MacroImage::finish(MacroTable& table, KeyboardLayoutId layout) {
+    MacroImageHeader header = {};
+    header.magic = MACRO_IMAGE_MAGIC;
+    header.version = MACRO_IMAGE_VERSION;
+    header.layout = layout;
+    header.count = entries.size();
+    header.tableBytes = dataStart + dataSize - sizeof(header);
+
+    bool ok = MacroStore::getInstance().getState(header.log) &&
+              writeAt(sizeof(header), entries.data(), entries.size() * sizeof(MacroEntry));
+    if (ok) {
+        // Read back through the mapping, so the CRC covers what is in flash
+        const uint8_t* image = mapped + sizeof(header);
+        header.crc = esp_rom_crc32_le(0, image, header.tableBytes);
+        ok = writeAt(0, &header, sizeof(header));
+    }
+
+    writing = false;
+    entries.clear();
+    entries.shrink_to_fit();
+    if (!ok) {
+        Serial.println("Failed to write macro image");
+        return false;
+    }
+
+    setWarm(header);
+    table.attach(mapped + sizeof(header), header.count, header.tableBytes);
+    Serial.println("Macro image written (" + String((unsigned long)(dataStart + dataSize)) + " bytes)");
+    return false;
+}
+
+bool MacroImage::erase() {
+    MacroStoreLock guard;
+    if (!mapped) {
+        return true;
+    }
+    abort();
+    clearWarm();
+
+    // A torn update leaves data without a header, so look at all of it
+    const uint32_t* word = (const uint32_t*)mapped;
+    size_t words = partition->size / sizeof(uint32_t);
+    size_t i = 0;
+    while (i < words && word[i] == 0xFFFFFFFF) {
+        i++;
+    }
+    if (i == words) {
+        return true;
+    }
+    if (esp_partition_erase_range(partition, 0, partition->size) != ESP_OK) {
+        Serial.println("Failed to erase the macro image");
+        return false;
+    }
+    Serial.println("Macro image erased");
+    return true;
+}
+
+void MacroImage::abort() {
+    writing = false;
+    entries.clear();
+    entries.shrink_to_fit();
+}
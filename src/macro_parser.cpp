@@ -0,0 +1,180 @@
+#include "../include/macro_parser.h"
+#include <string.h>
+
+// Same set as String::trim()
+static inline bool isTrimSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool hasPrefix(const char* start, const char* end, const char* prefix, size_t len) {
+    return (size_t)(end - start) >= len && memcmp(start, prefix, len) == 0;
+}
+
+static bool parseLayoutName(const char* start, const char* end, KeyboardLayoutId& out) {
+    while (start < end && isTrimSpace(*start)) {
+        start++;
+    }
+
+    // Layout names are short; anything longer is unknown anyway
+    char name[8];
+    size_t len = end - start;
+    if (len == 0 || len >= sizeof(name)) {
+        return false;
+    }
+    memcpy(name, start, len);
+    name[len] = '\0';
+    return keyboardLayoutFromName(name, out);
+}
+
+// Decode escapes from [start, end) into the same place; returns the new end
+static char* decodeEscapes(char* start, char* end) {
+    char* out = start;
+    for (char* in = start; in < end; in++) {
+        if (*in == '\\' && in + 1 < end) {
+            char next = in[1];
+            if (next == 'n' || next == 't' || next == '\\') {
+                *out++ = (next == 'n') ? '\n' : (next == 't') ? '\t' : '\\';
+                in++;
+                continue;
+            }
+        }
+        *out++ = *in;
+    }
+    return out;
+}
+
+MacroParseStats parseMacroBuffer(char* buf, size_t len, MacroRecordFn onRecord, void* ctx,
+                                 KeyboardLayoutId layout) {
+    MacroParseStats stats = {};
+    char* pos = buf;
+    char* bufEnd = buf + len;
+
+    while (pos < bufEnd) {
+        char* lineEnd = (char*)memchr(pos, '\n', bufEnd - pos);
+        char* next = lineEnd ? lineEnd + 1 : bufEnd;
+        if (!lineEnd) {
+            lineEnd = bufEnd;
+        }
+
+        char* start = pos;
+        char* end = lineEnd;
+        pos = next;
+        stats.lines++;
+
+        while (start < end && isTrimSpace(*start)) {
+            start++;
+        }
+        while (end > start && isTrimSpace(end[-1])) {
+            end--;
+        }
+        if (start == end) {
+            continue;
+        }
+
+        // Layout directive, applies to the macros that follow it
+        if (hasPrefix(start, end, "#!LAYOUT:", 9)) {
+            if (!parseLayoutName(start + 9, end, layout)) {
+                stats.badLayouts++;
+            }
+            continue;
+        }
+        if (*start == '#') {
+            continue;
+        }
+
+        bool sensitive = false;
+        if (hasPrefix(start, end, "SENSITIVE:", 10)) {
+            sensitive = true;
+            start += 10;
+        }
+
+        char* colon = (char*)memchr(start, ':', end - start);
+        if (!colon || colon == start) {
+            continue;
+        }
+
+        char* content = colon + 1;
+        char* contentEnd = decodeEscapes(content, end);
+
+        MacroRecord record;
+        record.name = start;
+        record.nameLen = colon - start;
+        record.content = content;
+        record.contentLen = contentEnd - content;
+        record.sensitive = sensitive;
+        record.layout = layout;
+
+        stats.macros++;
+        if (sensitive) {
+            stats.sensitive++;
+        }
+        if (onRecord) {
+            onRecord(record, ctx);
+        }
+    }
+
+    stats.layout = layout;
+    return stats;
+}
+
+MacroStreamParser::MacroStreamParser(MacroRecordFn onRecord, void* ctx, KeyboardLayoutId layout)
+    : onRecord(onRecord), ctx(ctx), stats() {
+    stats.layout = layout;
+}
+
+MacroStreamParser::~MacroStreamParser() {
+    clearLine();
+}
+
+void MacroStreamParser::clearLine() {
+    // It may hold plaintext
+    if (!line.empty()) {
+        memset(line.data(), 0, line.size());
+        line.clear();
+    }
+}
+
+void MacroStreamParser::parse(char* data, size_t len) {
+    MacroParseStats part = parseMacroBuffer(data, len, onRecord, ctx, stats.layout);
+    stats.lines += part.lines;
+    stats.macros += part.macros;
+    stats.sensitive += part.sensitive;
+    stats.badLayouts += part.badLayouts;
+    stats.layout = part.layout;
+}
+
+void MacroStreamParser::feed(char* data, size_t len) {
+    char* pos = data;
+    char* end = data + len;
+
+    // Finish a line started in an earlier piece
+    if (!line.empty()) {
+        char* lineEnd = (char*)memchr(pos, '\n', end - pos);
+        char* next = lineEnd ? lineEnd + 1 : end;
+        line.insert(line.end(), pos, next);
+        pos = next;
+        if (!lineEnd) {
+            return;
+        }
+        parse(line.data(), line.size());
+        clearLine();
+    }
+
+    // Every whole line in place, in one go
+    char* last = end;
+    while (last > pos && last[-1] != '\n') {
+        last--;
+    }
+    if (last > pos) {
+        parse(pos, last - pos);
+    }
+    line.insert(line.end(), last, end);
+}
+
+MacroParseStats MacroStreamParser::finish() {
+    if (!line.empty()) {
+        parse(line.data(), line.size());
+        clearLine();
+    }
+    return stats;
+}
@@ -0,0 +1,1659 @@
+#include "../include/macro_store.h"
+#include "../include/macro_parser.h"
+#include "../include/crypto_manager.h"
+#include <SD_MMC.h>
+#include <FFat.h>
+#include <Preferences.h>
+#include <esp_rom_crc.h>
+
+// MAC keys of the parts of a log (see macro_store.h)
+static const char HEADER_MAC_LABEL[] = "USBone macro log header";
+static const char RECORD_MAC_LABEL[] = "USBone macro log record";
+static const char INDEX_MAC_LABEL[] = "USBone macro log index";
+
+MacroStore& MacroStore::getInstance() {
+    static MacroStore instance;
+    return instance;
+}
+
+MacroStore::MacroStore() {
+    lock = xSemaphoreCreateRecursiveMutex();
+}
+
+void MacroStore::begin(bool sdAvailable, bool flashAvailable) {
+    MacroStoreLock guard;
+    sdPresent = sdAvailable;
+    flashPresent = flashAvailable;
+    mirrorCurrent = false;
+    indexKnown = false;
+}
+
+bool MacroStore::exists() {
+    if (!sdPresent) {
+        return flashPresent && FFat.exists(MACRO_DB_PATH);
+    }
+    return SD_MMC.exists(MACRO_DB_PATH) || SD_MMC.exists(MACRO_DB_TMP_PATH);
+}
+
+fs::FS& MacroStore::source() {
+    if (readsFromFlash()) {
+        return FFat;
+    }
+    return SD_MMC;
+}
+
+// A compaction pass in progress, saved after every step
+static bool loadCheckpoint(MacroCompactCheckpoint& checkpoint) {
+    Preferences prefs;
+    if (!prefs.begin(MACRO_COMPACT_NVS, true)) {
+        return false;
+    }
+    bool ok = prefs.getBytes("compact", &checkpoint, sizeof(checkpoint)) == sizeof(checkpoint);
+    prefs.end();
+    return ok;
+}
+
+static bool saveCheckpoint(const MacroCompactCheckpoint& checkpoint) {
+    Preferences prefs;
+    if (!prefs.begin(MACRO_COMPACT_NVS, false)) {
+        return false;
+    }
+    bool ok = prefs.putBytes("compact", &checkpoint, sizeof(checkpoint)) == sizeof(checkpoint);
+    prefs.end();
+    return ok;
+}
+
+static void clearCheckpoint() {
+    Preferences prefs;
+    if (prefs.begin(MACRO_COMPACT_NVS, false)) {
+        prefs.remove("compact");
+        prefs.end();
+    }
+}
+
+// Compaction removes the old log before renaming the new one into place; if
+// power was lost in between, finish the job. A new log that was still being
+// written is dropped, unless a checkpoint says where to pick it up.
+bool MacroStore::recover() {
+    if (!sdPresent) {
+        return flashPresent && FFat.exists(MACRO_DB_PATH);
+    }
+    if (SD_MMC.exists(MACRO_DB_PATH)) {
+        MacroCompactCheckpoint checkpoint;
+        if (!compacting && SD_MMC.exists(MACRO_DB_TMP_PATH) && !loadCheckpoint(checkpoint)) {
+            SD_MMC.remove(MACRO_DB_TMP_PATH);
+        }
+        return true;
+    }
+    if (!SD_MMC.exists(MACRO_DB_TMP_PATH)) {
+        return false;
+    }
+    Serial.println("Recovering " MACRO_DB_PATH " from interrupted compaction");
+    return SD_MMC.rename(MACRO_DB_TMP_PATH, MACRO_DB_PATH);
+}
+
+// The mirror is a prefix of the SD log if the bytes at its end are the same
+// in both. They are trailer, ciphertext or IV bytes, so a mirror of an older,
+// since compacted log does not match.
+static bool mirrorIsPrefix(fs::File& sd, fs::File& mirror) {
+    size_t len = mirror.size();
+    uint8_t a[sizeof(MacroDbTrailer)], b[sizeof(MacroDbTrailer)];
+    if (len < sizeof(MacroDbHeader) + sizeof(a) || len > sd.size()) {
+        return false;
+    }
+    return sd.seek(len - sizeof(a)) && sd.read(a, sizeof(a)) == sizeof(a) &&
+           mirror.seek(len - sizeof(b)) && mirror.read(b, sizeof(b)) == sizeof(b) &&
+           memcmp(a, b, sizeof(a)) == 0;
+}
+
+// Copy what the flash mirror is missing from the SD log
+bool MacroStore::syncMirror() {
+    mirrorCurrent = false;
+    if (!sdPresent || !flashPresent) {
+        return false;
+    }
+
+    fs::File sd = SD_MMC.open(MACRO_DB_PATH, FILE_READ);
+    if (!sd) {
+        return false;
+    }
+    size_t have = 0;
+    fs::File mirror = FFat.open(MACRO_DB_PATH, FILE_READ);
+    if (mirror) {
+        have = mirrorIsPrefix(sd, mirror) ? mirror.size() : 0;
+        mirror.close();
+    }
+
+    size_t total = sd.size();
+    bool ok = true;
+    if (have < total) {
+        mirror = FFat.open(MACRO_DB_PATH, have > 0 ? FILE_APPEND : FILE_WRITE);
+        std::vector<uint8_t> chunk(MACRO_MIRROR_CHUNK);
+        ok = mirror && sd.seek(have);
+        for (size_t pos = have; ok && pos < total; pos += chunk.size()) {
+            size_t len = min(total - pos, chunk.size());
+            ok = sd.read(chunk.data(), len) == len && mirror.write(chunk.data(), len) == len;
+        }
+        mirror.close();
+        if (have == 0) {
+            Serial.println("Copied " + String((unsigned long)total) + " bytes of " MACRO_DB_PATH " to flash");
+        }
+    }
+    sd.close();
+
+    if (!ok) {
+        Serial.println("Failed to update the flash copy of " MACRO_DB_PATH);
+        return false;
+    }
+    mirrorCurrent = true;
+    return true;
+}
+
+// Stop reading a mirror that turned out damaged, and have it copied anew
+void MacroStore::dropMirror() {
+    Serial.println("Flash copy of " MACRO_DB_PATH " is damaged, reading SD");
+    mirrorCurrent = false;
+    FFat.remove(MACRO_DB_PATH);
+}
+
+static uint32_t crc32(const void* data, size_t len) {
+    return esp_rom_crc32_le(0, (const uint8_t*)data, len);
+}
+
+static void wipe(std::vector<uint8_t>& data) {
+    if (!data.empty()) {
+        memset(data.data(), 0, data.size());
+    }
+}
+
+static void appendBytes(std::vector<uint8_t>& out, const void* data, size_t len) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    out.insert(out.end(), bytes, bytes + len);
+}
+
+// A tag over a record at offset, or over an index and its trailer, up to
+// its end; the writer then finishes it and the reader verifies it
+static bool startRecordTag(CryptoMac& mac, uint16_t keyVersion, uint32_t offset,
+                           const MacroRecordHeader& header, const uint8_t* cipher) {
+    return mac.begin(keyVersion, RECORD_MAC_LABEL) &&
+           mac.update(&offset, sizeof(offset)) &&
+           mac.update(&header, offsetof(MacroRecordHeader, tag)) &&
+           mac.update(cipher, header.cipherLen);
+}
+
+static bool startIndexTag(CryptoMac& mac, uint16_t keyVersion, const MacroDbTrailer& trailer,
+                          const uint8_t* cipher) {
+    return mac.begin(keyVersion, INDEX_MAC_LABEL) &&
+           mac.update(&trailer, offsetof(MacroDbTrailer, tag)) &&
+           mac.update(cipher, trailer.indexLen);
+}
+
+// A new log's header, naming its key
+bool MacroStore::writeHeader(fs::File& file, uint16_t keyVersion) {
+    MacroDbHeader header = {};
+    header.magic = MACRO_DB_MAGIC;
+    header.version = MACRO_DB_VERSION;
+    return CryptoManager::getInstance().keyIdFor(keyVersion, header.keyId) &&
+           mac.begin(keyVersion, HEADER_MAC_LABEL) &&
+           mac.update(&header, offsetof(MacroDbHeader, mac)) &&
+           mac.finish(header.mac, MACRO_DB_TAG_SIZE) &&
+           file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+}
+
+// Which of the kept keys a log is under, once its header checks out
+bool MacroStore::checkHeader(const MacroDbHeader& header, uint16_t& keyVersion) {
+    if (header.magic != MACRO_DB_MAGIC || header.version != MACRO_DB_VERSION) {
+        Serial.println("Invalid " MACRO_DB_PATH);
+        return false;
+    }
+    if (!CryptoManager::getInstance().keyVersionForId(header.keyId, keyVersion)) {
+        Serial.println(MACRO_DB_PATH " is under a key that is no longer kept");
+        return false;
+    }
+    if (!mac.begin(keyVersion, HEADER_MAC_LABEL) ||
+        !mac.update(&header, offsetof(MacroDbHeader, mac)) ||
+        !mac.verify(header.mac, MACRO_DB_TAG_SIZE)) {
+        Serial.println(MACRO_DB_PATH " header is damaged");
+        return false;
+    }
+    return true;
+}
+
+// Encrypt one macro's content under its own IV and write header + ciphertext
+// at offset, which its tag covers
+static bool writeRecord(fs::File& file, const char* content, size_t contentLen, CryptoScratch& scratch,
+                        CryptoMac& mac, uint16_t keyVersion, uint32_t offset, uint32_t& recordLen) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    MacroRecordHeader header;
+    const uint8_t* cipher;
+    size_t cipherLen;
+    header.magic = MACRO_RECORD_MAGIC;
+    crypto.generateIV(header.iv);
+    if (!crypto.encryptData((const uint8_t*)content, contentLen, header.iv, scratch, cipher, cipherLen,
+                            keyVersion)) {
+        return false;
+    }
+    header.cipherLen = cipherLen;
+    if (!startRecordTag(mac, keyVersion, offset, header, cipher) || !mac.finish(header.tag, MACRO_DB_TAG_SIZE)) {
+        return false;
+    }
+    recordLen = sizeof(header) + cipherLen;
+
+    return file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+           file.write(cipher, cipherLen) == cipherLen;
+}
+
+// Characters the layout has no keys for; counted while the content is at
+// hand, so a load can warn without decrypting the records
+static size_t untypeableChars(const char* text, size_t len, KeyboardLayoutId layout) {
+    KeyStroke strokes[2];
+    size_t untypeable = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (HidInjector::charToKeyStrokes(text[i], layout, strokes) == 0) {
+            untypeable++;
+        }
+    }
+    return untypeable;
+}
+
+static void makeEntry(MacroIndexEntry& entry, const MacroRecord& record, uint32_t id,
+                      uint32_t version, uint32_t recordOffset, uint32_t recordLen, uint32_t crc) {
+    entry.id = id;
+    entry.version = version;
+    entry.recordOffset = recordOffset;
+    entry.recordLen = recordLen;
+    entry.contentLen = record.contentLen;
+    entry.crc = crc;
+    entry.flags = record.sensitive ? MACRO_FLAG_SENSITIVE : 0;
+    if (untypeableChars(record.content, record.contentLen, record.layout) > 0) {
+        entry.flags |= MACRO_FLAG_UNTYPEABLE;
+    }
+    entry.layout = record.layout;
+    entry.nameLen = record.nameLen > 255 ? 255 : record.nameLen;
+    entry.previewLen = 0;
+    if (!record.sensitive) {
+        entry.previewLen = record.contentLen > MACRO_PREVIEW_LEN ? MACRO_PREVIEW_LEN : record.contentLen;
+    }
+}
+
+static void makeEntry(MacroIndexEntry& entry, const MacroTable& table, size_t i) {
+    const MacroStoredRef& ref = table.stored(i);
+    entry.id = ref.id;
+    entry.version = ref.version;
+    entry.recordOffset = ref.recordOffset;
+    entry.recordLen = ref.recordLen;
+    entry.contentLen = table.contentLength(i);
+    entry.crc = ref.crc;
+    entry.flags = table.entry(i).flags & (MACRO_FLAG_SENSITIVE | MACRO_FLAG_UNTYPEABLE);
+    entry.layout = table.layout(i);
+    entry.nameLen = table.nameLength(i) > 255 ? 255 : table.nameLength(i);
+    entry.previewLen = strnlen(table.content(i), MACRO_PREVIEW_LEN);
+}
+
+static void appendEntry(std::vector<uint8_t>& index, const MacroIndexEntry& entry,
+                        const char* name, const char* preview) {
+    appendBytes(index, &entry, sizeof(entry));
+    appendBytes(index, name, entry.nameLen);
+    appendBytes(index, preview, entry.previewLen);
+}
+
+static bool addToTable(MacroTable& table, const MacroIndexEntry& entry, const char* name,
+                       const char* preview) {
+    MacroStoredRef ref = {entry.recordOffset, entry.recordLen, entry.id, entry.version, entry.crc};
+    return table.addStored(name, entry.nameLen, preview, entry.previewLen, entry.contentLen,
+                           entry.flags,
+                           entry.layout < LAYOUT_COUNT ? (KeyboardLayoutId)entry.layout : LAYOUT_DEFAULT,
+                           ref);
+}
+
+// Encrypt the index at offset and close it with a trailer
+bool MacroStore::writeIndex(fs::File& file, uint32_t offset, const std::vector<uint8_t>& index,
+                            uint32_t prevTrailer, uint16_t keyVersion, uint32_t& trailerPos) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    MacroDbTrailer trailer;
+    const uint8_t* cipher;
+    size_t cipherLen;
+
+    crypto.generateIV(trailer.iv);
+    if (!crypto.encryptData(index.data(), index.size(), trailer.iv, scratch, cipher, cipherLen, keyVersion)) {
+        return false;
+    }
+    trailer.indexOffset = offset;
+    trailer.indexLen = cipherLen;
+    trailer.prevTrailer = prevTrailer;
+    trailer.magic = MACRO_TRAILER_MAGIC;
+    trailerPos = offset + cipherLen;
+
+    bool ok = startIndexTag(mac, keyVersion, trailer, cipher) && mac.finish(trailer.tag, MACRO_DB_TAG_SIZE) &&
+              file.write(cipher, cipherLen) == cipherLen &&
+              file.write((const uint8_t*)&trailer, sizeof(trailer)) == sizeof(trailer);
+    // An index ends a save or change; a large one is not kept around
+    scratch.trim(MACRO_SCRATCH_KEEP);
+    return ok;
+}
+
+// A macro of the current index, as seen by save()
+struct SavedMacro {
+    MacroIndexEntry entry;
+    const char* name;
+    bool kept;
+};
+
+struct SaveContext {
+    fs::File* file;
+    CryptoScratch* scratch;
+    CryptoMac* mac;
+    uint16_t keyVersion;
+    std::vector<SavedMacro> current;
+    size_t cursor;             // Where the next match is most likely
+    int lastMatch;
+    bool added;                // A macro with a new id was seen
+    bool inOrder;              // A delta reproduces the file's order
+    std::vector<uint8_t> full;
+    std::vector<uint8_t> delta;
+    uint32_t offset;
+    uint32_t count;
+    uint32_t changed;
+    uint32_t nextId;
+    uint32_t version;
+    bool ok;
+};
+
+// Parser callback: match the macro to the current one of the same name,
+// and append a record only if it differs
+static void saveRecord(const MacroRecord& record, void* ctx) {
+    SaveContext* save = (SaveContext*)ctx;
+    if (!save->ok) {
+        return;
+    }
+
+    // Files are mostly saved back in the order they were loaded
+    int match = -1;
+    size_t total = save->current.size();
+    for (size_t n = 0; n < total; n++) {
+        size_t i = (save->cursor + n) % total;
+        const SavedMacro& macro = save->current[i];
+        if (!macro.kept && macro.entry.nameLen == (record.nameLen > 255 ? 255 : record.nameLen) &&
+            memcmp(macro.name, record.name, macro.entry.nameLen) == 0) {
+            match = i;
+            break;
+        }
+    }
+
+    uint32_t crc = crc32(record.content, record.contentLen);
+    MacroIndexEntry entry;
+    if (match >= 0) {
+        SavedMacro& macro = save->current[match];
+        macro.kept = true;
+        save->cursor = match + 1;
+        if (match < save->lastMatch || save->added) {
+            save->inOrder = false;
+        }
+        save->lastMatch = match;
+        entry = macro.entry;
+    } else {
+        save->added = true;
+        entry.id = save->nextId++;
+    }
+
+    if (match < 0 || entry.crc != crc || entry.contentLen != record.contentLen ||
+        entry.layout != record.layout ||
+        (entry.flags & MACRO_FLAG_SENSITIVE) != (record.sensitive ? MACRO_FLAG_SENSITIVE : 0)) {
+        uint32_t recordLen;
+        if (!writeRecord(*save->file, record.content, record.contentLen, *save->scratch, *save->mac,
+                         save->keyVersion, save->offset, recordLen)) {
+            save->ok = false;
+            return;
+        }
+        makeEntry(entry, record, entry.id, save->version, save->offset, recordLen, crc);
+        appendEntry(save->delta, entry, record.name, record.content);
+        save->offset += recordLen;
+        save->changed++;
+    }
+
+    appendEntry(save->full, entry, record.name, record.content);
+    save->count++;
+}
+
+struct TextSpan {
+    const char* text;
+    size_t len;
+    size_t pos;
+};
+
+static bool readSpan(char* buffer, size_t maxLen, size_t& len, void* ctx) {
+    TextSpan* span = (TextSpan*)ctx;
+    len = span->len - span->pos;
+    if (len > maxLen) {
+        len = maxLen;
+    }
+    memcpy(buffer, span->text + span->pos, len);
+    span->pos += len;
+    return true;
+}
+
+bool MacroStore::save(const char* text, size_t len) {
+    TextSpan span = {text, len, 0};
+    return save(readSpan, &span);
+}
+
+bool MacroStore::save(MacroTextFn read, void* ctx) {
+    MacroStoreLock guard;
+    if (!sdPresent) {
+        Serial.println("No SD card, macros are read-only");
+        return false;
+    }
+    CryptoManager& crypto = CryptoManager::getInstance();
+    if (!crypto.initialize()) {
+        Serial.println("Failed to initialize crypto system");
+        return false;
+    }
+
+    std::vector<uint8_t> index;
+    bool append = false;
+    if (exists()) {
+        append = readIndex(index);
+        if (!append) {
+            // Keep what cannot be read rather than write over it
+            SD_MMC.remove(MACRO_DB_BAD_PATH);
+            SD_MMC.rename(MACRO_DB_PATH, MACRO_DB_BAD_PATH);
+            Serial.println("Unreadable macro log moved to " MACRO_DB_BAD_PATH);
+        }
+    }
+
+    fs::File file = SD_MMC.open(MACRO_DB_PATH, append ? FILE_APPEND : FILE_WRITE);
+    if (!file) {
+        Serial.println("Failed to open " MACRO_DB_PATH);
+        wipe(index);
+        return false;
+    }
+
+    SaveContext save;
+    save.file = &file;
+    save.scratch = &scratch;
+    save.mac = &mac;
+    save.cursor = 0;
+    save.lastMatch = -1;
+    save.added = false;
+    save.inOrder = true;
+    save.count = 0;
+    save.changed = 0;
+    save.ok = true;
+
+    MacroIndexHeader header = {};
+    if (append) {
+        memcpy(&header, index.data(), sizeof(header));
+        save.offset = file.size();
+        size_t pos = sizeof(header);
+        for (uint32_t i = 0; i < header.count; i++) {
+            SavedMacro macro;
+            macro.name = nextEntry(index, pos, macro.entry);
+            macro.kept = false;
+            save.current.push_back(macro);
+        }
+    } else {
+        logKeyVersion = crypto.keyVersion();
+        save.ok = writeHeader(file, logKeyVersion);
+        save.offset = sizeof(MacroDbHeader);
+        header.nextId = 1;
+        header.nextVersion = 1;
+        lastTrailer = 0;
+        deltaCount = 0;
+    }
+    save.keyVersion = logKeyVersion;
+    save.nextId = header.nextId;
+    save.version = header.nextVersion;
+    save.full.resize(sizeof(header));
+    save.delta.resize(sizeof(header));
+
+    // Parsed a block at a time as it is read; escapes are decoded in place
+    std::vector<uint8_t> block(MACRO_STREAM_BLOCK);
+    MacroStreamParser parser(saveRecord, &save);
+    size_t got = 0;
+    bool readOk;
+    while ((readOk = read((char*)block.data(), block.size(), got, ctx)) && got > 0) {
+        parser.feed((char*)block.data(), got);
+    }
+    MacroParseStats stats = parser.finish();
+    wipe(block);
+    if (!readOk) {
+        // Macros not read yet would be taken as removed
+        Serial.println("Failed to read macro text");
+        save.ok = false;
+    }
+
+    // Whatever was not matched is gone
+    uint32_t removed = 0;
+    for (const SavedMacro& macro : save.current) {
+        if (!macro.kept) {
+            MacroIndexEntry entry = {};
+            entry.id = macro.entry.id;
+            entry.version = save.version;
+            entry.flags = MACRO_INDEX_REMOVED;
+            appendEntry(save.delta, entry, nullptr, nullptr);
+            removed++;
+        }
+    }
+
+    uint32_t trailerPos = lastTrailer;
+    bool unchanged = append && save.changed == 0 && removed == 0 && stats.layout == header.layout;
+    if (save.ok && !unchanged) {
+        bool useDelta = append && save.inOrder && deltaCount + 1 < MACRO_DB_MAX_DELTAS;
+        std::vector<uint8_t>& out = useDelta ? save.delta : save.full;
+        header.count = useDelta ? save.changed + removed : save.count;
+        header.nextId = save.nextId;
+        header.nextVersion = save.version + 1;
+        header.layout = stats.layout;
+        memcpy(out.data(), &header, sizeof(header));
+        save.ok = writeIndex(file, save.offset, out, useDelta ? lastTrailer : 0, logKeyVersion, trailerPos);
+        deltaCount = useDelta ? deltaCount + 1 : 0;
+    }
+    file.close();
+    appends++;
+
+    // Names, previews and the decoded text are plaintext
+    wipe(index);
+    wipe(save.full);
+    wipe(save.delta);
+
+    if (!save.ok) {
+        // Whatever was appended has no trailer and is ignored
+        indexKnown = false;
+        Serial.println("Failed to write " MACRO_DB_PATH);
+        return false;
+    }
+
+    indexKnown = true;
+    lastTrailer = trailerPos;
+    macroCount = save.count;
+    nextId = header.nextId;
+    nextVersion = header.nextVersion;
+    dbSize = unchanged ? dbSize : trailerPos + sizeof(MacroDbTrailer);
+    syncMirror();
+
+    Serial.println("Saved " + String(save.count) + " macros to " MACRO_DB_PATH " (" +
+                   String(save.changed) + " written, " + String(removed) + " removed)");
+    return true;
+}
+
+static bool readTrailerAt(fs::File& file, size_t pos, MacroDbTrailer& trailer) {
+    return pos >= sizeof(MacroDbHeader) &&
+           file.seek(pos) &&
+           file.read((uint8_t*)&trailer, sizeof(trailer)) == sizeof(trailer) &&
+           trailer.magic == MACRO_TRAILER_MAGIC &&
+           trailer.indexOffset >= sizeof(MacroDbHeader) &&
+           trailer.indexLen > 0 &&
+           (size_t)trailer.indexOffset + trailer.indexLen == pos &&
+           trailer.prevTrailer < trailer.indexOffset;
+}
+
+// Last trailer that ends at or before end. Normally that is the end of the
+// file; after an interrupted append it is further back.
+bool MacroStore::findTrailer(fs::File& file, size_t end, uint32_t& pos, MacroDbTrailer& trailer) {
+    if (end < sizeof(MacroDbHeader) + sizeof(trailer)) {
+        return false;
+    }
+    pos = end - sizeof(trailer);
+    if (readTrailerAt(file, pos, trailer)) {
+        return true;
+    }
+
+    const uint32_t magic = MACRO_TRAILER_MAGIC;
+    const size_t magicAt = sizeof(trailer) - sizeof(magic);
+    uint8_t window[512];
+
+    while (end >= sizeof(MacroDbHeader) + sizeof(trailer)) {
+        size_t start = end > sizeof(window) ? end - sizeof(window) : 0;
+        if (start < sizeof(MacroDbHeader)) {
+            start = sizeof(MacroDbHeader);
+        }
+        size_t len = end - start;
+        if (!file.seek(start) || file.read(window, len) != len) {
+            return false;
+        }
+
+        for (size_t i = len - sizeof(magic) + 1; i-- > 0;) {
+            if (memcmp(window + i, &magic, sizeof(magic)) == 0 && start + i >= magicAt) {
+                pos = start + i - magicAt;
+                if (readTrailerAt(file, pos, trailer)) {
+                    return true;
+                }
+            }
+        }
+
+        if (start == sizeof(MacroDbHeader)) {
+            break;
+        }
+        // Overlap so a magic split across windows is still seen
+        end = start + sizeof(magic) - 1;
+    }
+    return false;
+}
+
+// Decrypted in place, in out, once its tag checks out
+bool MacroStore::readIndexAt(fs::File& file, const MacroDbTrailer& trailer, std::vector<uint8_t>& out) {
+    size_t plainLen;
+    out.resize(trailer.indexLen);
+    if (!file.seek(trailer.indexOffset) ||
+        file.read(out.data(), out.size()) != out.size() ||
+        !startIndexTag(mac, logKeyVersion, trailer, out.data()) ||
+        !mac.verify(trailer.tag, MACRO_DB_TAG_SIZE) ||
+        !CryptoManager::getInstance().decryptData(out.data(), out.size(), trailer.iv,
+                                                  out.data(), out.size(), plainLen, logKeyVersion)) {
+        return false;
+    }
+    out.resize(plainLen);
+    return out.size() >= sizeof(MacroIndexHeader);
+}
+
+// Put a delta's entries into a full index: replace or drop the entry with
+// the same id, or add it at the end
+static bool applyDelta(std::vector<uint8_t>& index, const std::vector<uint8_t>& delta) {
+    MacroIndexHeader header, change;
+    memcpy(&header, index.data(), sizeof(header));
+    memcpy(&change, delta.data(), sizeof(change));
+
+    size_t deltaPos = sizeof(change);
+    for (uint32_t d = 0; d < change.count; d++) {
+        MacroIndexEntry entry;
+        const char* name = MacroStore::nextEntry(delta, deltaPos, entry);
+        if (!name) {
+            return false;
+        }
+
+        size_t start = sizeof(header);
+        size_t pos = start;
+        bool found = false;
+        for (uint32_t i = 0; i < header.count && !found; i++) {
+            MacroIndexEntry existing;
+            start = pos;
+            if (!MacroStore::nextEntry(index, pos, existing)) {
+                return false;
+            }
+            found = existing.id == entry.id;
+        }
+        if (found) {
+            index.erase(index.begin() + start, index.begin() + pos);
+            header.count--;
+        } else {
+            start = pos;
+        }
+
+        if (!(entry.flags & MACRO_INDEX_REMOVED)) {
+            const uint8_t* bytes = (const uint8_t*)name - sizeof(entry);
+            index.insert(index.begin() + start, bytes, bytes + sizeof(entry) + entry.nameLen + entry.previewLen);
+            header.count++;
+        }
+    }
+
+    header.nextId = change.nextId;
+    header.nextVersion = change.nextVersion;
+    header.layout = change.layout;
+    memcpy(index.data(), &header, sizeof(header));
+    return true;
+}
+
+// The full index the chain ending at last starts from, with its deltas
+// replayed in order
+bool MacroStore::readChain(fs::File& file, const MacroDbTrailer& last, std::vector<uint8_t>& out,
+                           uint32_t& deltas) {
+    std::vector<MacroDbTrailer> chain;
+    MacroDbTrailer trailer = last;
+    while (trailer.prevTrailer != 0) {
+        chain.push_back(trailer);
+        if (!readTrailerAt(file, trailer.prevTrailer, trailer)) {
+            return false;
+        }
+    }
+
+    bool ok = readIndexAt(file, trailer, out);
+    std::vector<uint8_t> delta;
+    for (size_t i = chain.size(); ok && i-- > 0;) {
+        ok = readIndexAt(file, chain[i], delta) && applyDelta(out, delta);
+        wipe(delta);
+    }
+    deltas = chain.size();
+    return ok;
+}
+
+bool MacroStore::readIndex(std::vector<uint8_t>& out) {
+    MacroStoreLock guard;
+    CryptoManager& crypto = CryptoManager::getInstance();
+    indexKnown = false;
+    if (!crypto.initialize() || !recover()) {
+        return false;
+    }
+
+    if (readsFromFlash() && readLog(FFat, out)) {
+        return true;
+    }
+    if (!sdPresent) {
+        return false;
+    }
+    if (mirrorCurrent) {
+        dropMirror();
+    }
+    return readLog(SD_MMC, out);
+}
+
+bool MacroStore::readLog(fs::FS& fs, std::vector<uint8_t>& out) {
+    fs::File file = fs.open(MACRO_DB_PATH, FILE_READ);
+    if (!file) {
+        return false;
+    }
+
+    MacroDbHeader header;
+    uint16_t keyVersion;
+    if (file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+        !checkHeader(header, keyVersion)) {
+        file.close();
+        return false;
+    }
+    logKeyVersion = keyVersion;
+
+    // Replay the log up to the last index that is intact
+    size_t fileSize = file.size();
+    size_t end = fileSize;
+    uint32_t pos = 0;
+    uint32_t deltas = 0;
+    MacroDbTrailer trailer;
+    bool ok = false;
+    while (!ok && findTrailer(file, end, pos, trailer)) {
+        ok = readChain(file, trailer, out, deltas);
+        if (!ok) {
+            end = pos + sizeof(trailer) - 1;
+        }
+    }
+    file.close();
+
+    if (!ok) {
+        Serial.println("No readable macro index in " MACRO_DB_PATH);
+        return false;
+    }
+    if (pos + sizeof(trailer) != fileSize) {
+        Serial.println("Ignoring " + String((unsigned long)(fileSize - pos - sizeof(trailer))) +
+                       " bytes of an incomplete append");
+    }
+
+    MacroIndexHeader indexHeader;
+    memcpy(&indexHeader, out.data(), sizeof(indexHeader));
+    indexKnown = true;
+    lastTrailer = pos;
+    deltaCount = deltas;
+    macroCount = indexHeader.count;
+    nextId = indexHeader.nextId;
+    nextVersion = indexHeader.nextVersion;
+    dbSize = fileSize;
+    return true;
+}
+
+const char* MacroStore::nextEntry(const std::vector<uint8_t>& index, size_t& pos,
+                                  MacroIndexEntry& entry) {
+    if (pos > index.size() || index.size() - pos < sizeof(entry)) {
+        return nullptr;
+    }
+    memcpy(&entry, index.data() + pos, sizeof(entry));
+    if (index.size() - pos - sizeof(entry) < (size_t)entry.nameLen + entry.previewLen) {
+        return nullptr;
+    }
+    const char* name = (const char*)index.data() + pos + sizeof(entry);
+    pos += sizeof(entry) + entry.nameLen + entry.previewLen;
+    return name;
+}
+
+bool MacroStore::buildTable(const std::vector<uint8_t>& index, MacroTable& table,
+                            KeyboardLayoutId& layout) {
+    MacroIndexHeader header;
+    memcpy(&header, index.data(), sizeof(header));
+    layout = header.layout < LAYOUT_COUNT ? (KeyboardLayoutId)header.layout : LAYOUT_DEFAULT;
+
+    size_t pos = sizeof(header);
+    for (uint32_t i = 0; i < header.count; i++) {
+        MacroIndexEntry entry;
+        const char* name = nextEntry(index, pos, entry);
+        if (!name || !addToTable(table, entry, name, name + entry.nameLen)) {
+            Serial.println("Macro index is damaged");
+            return false;
+        }
+        // The same warning addMacro() gives for a macro compiled at load
+        if (entry.flags & MACRO_FLAG_UNTYPEABLE) {
+            Serial.println("  WARNING: " + String(name, entry.nameLen) +
+                           " has characters that cannot be typed on " +
+                           keyboardLayoutName(entry.layout < LAYOUT_COUNT ? (KeyboardLayoutId)entry.layout : LAYOUT_DEFAULT));
+        }
+    }
+    return true;
+}
+
+bool MacroStore::load(MacroTable& table, KeyboardLayoutId& layout) {
+    MacroStoreLock guard;
+    if (sdPresent && recover()) {
+        syncMirror();
+    }
+    std::vector<uint8_t> index;
+    if (!readIndex(index)) {
+        return false;
+    }
+    bool ok = buildTable(index, table, layout);
+    wipe(index);
+    // Changes and compaction work from the table, so it has to be complete
+    indexKnown = ok;
+    return ok;
+}
+
+bool MacroStore::getState(MacroLogState& state) {
+    MacroStoreLock guard;
+    if (!indexKnown) {
+        return false;
+    }
+    fs::File file = source().open(MACRO_DB_PATH, FILE_READ);
+    bool ok = file && file.seek(lastTrailer) &&
+              file.read((uint8_t*)&state.trailer, sizeof(state.trailer)) == sizeof(state.trailer);
+    file.close();
+
+    state.size = dbSize;
+    state.lastTrailer = lastTrailer;
+    state.deltaCount = deltaCount;
+    state.macroCount = macroCount;
+    state.nextId = nextId;
+    state.nextVersion = nextVersion;
+    return ok;
+}
+
+bool MacroStore::resume(const MacroLogState& state) {
+    MacroStoreLock guard;
+    indexKnown = false;
+    if (!recover()) {
+        return false;
+    }
+    if (sdPresent) {
+        syncMirror();
+    }
+
+    // The trailer has a random IV, so the same bytes at the same place in a
+    // file of the same length mean the same log
+    MacroDbHeader header;
+    MacroDbTrailer trailer;
+    uint16_t keyVersion;
+    fs::File file = source().open(MACRO_DB_PATH, FILE_READ);
+    bool ok = file && file.size() == state.size &&
+              file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              file.seek(state.lastTrailer) &&
+              file.read((uint8_t*)&trailer, sizeof(trailer)) == sizeof(trailer) &&
+              memcmp(&trailer, &state.trailer, sizeof(trailer)) == 0;
+    file.close();
+    if (!ok || !checkHeader(header, keyVersion)) {
+        return false;
+    }
+
+    indexKnown = true;
+    logKeyVersion = keyVersion;
+    lastTrailer = state.lastTrailer;
+    deltaCount = state.deltaCount;
+    macroCount = state.macroCount;
+    nextId = state.nextId;
+    nextVersion = state.nextVersion;
+    dbSize = state.size;
+    return true;
+}
+
+MacroChangeResult MacroStore::put(uint32_t id, const MacroRecord& macro, uint32_t ifVersion,
+                                  MacroTable& table, KeyboardLayoutId& layout,
+                                  uint32_t& idOut, uint32_t& versionOut) {
+    return change(id, &macro, ifVersion, table, layout, idOut, versionOut);
+}
+
+MacroChangeResult MacroStore::remove(uint32_t id, uint32_t ifVersion,
+                                     MacroTable& table, KeyboardLayoutId& layout) {
+    uint32_t idOut, versionOut;
+    return change(id, nullptr, ifVersion, table, layout, idOut, versionOut);
+}
+
+// The table after a change: the one entry is patched in place, and only
+// a table without room (or attached in flash) is rebuilt around it
+bool MacroStore::updateTable(MacroTable& table, int slot, const MacroRecord* macro,
+                             const MacroIndexEntry& entry) {
+    MacroStoredRef ref = {entry.recordOffset, entry.recordLen, entry.id, entry.version, entry.crc};
+    KeyboardLayoutId entryLayout = entry.layout < LAYOUT_COUNT ? (KeyboardLayoutId)entry.layout : LAYOUT_DEFAULT;
+    bool patched;
+    if (!macro) {
+        patched = table.removeAt(slot);
+    } else if (slot >= 0) {
+        patched = table.replaceStored(slot, macro->name, entry.nameLen, macro->content, entry.previewLen,
+                                      entry.contentLen, entry.flags, entryLayout, ref);
+    } else {
+        patched = table.appendStored(macro->name, entry.nameLen, macro->content, entry.previewLen,
+                                     entry.contentLen, entry.flags, entryLayout, ref);
+    }
+    if (patched) {
+        return true;
+    }
+
+    bool ok = true;
+    table.beginBuild();
+    for (size_t i = 0; ok && i < table.count(); i++) {
+        if ((int)i == slot) {
+            if (macro) {
+                ok = addToTable(table, entry, macro->name, macro->content);
+            }
+        } else if (table.isStored(i)) {
+            MacroIndexEntry kept;
+            makeEntry(kept, table, i);
+            ok = addToTable(table, kept, table.name(i), table.content(i));
+        }
+    }
+    if (ok && macro && slot < 0) {
+        ok = addToTable(table, entry, macro->name, macro->content);
+    }
+    if (!ok || !table.commit()) {
+        table.discardBuild();
+        return false;
+    }
+    return true;
+}
+
+// Append the new record and a delta naming it. Nothing is decrypted: the
+// table already has every id, version and record location, and only the
+// one entry changes in it.
+MacroChangeResult MacroStore::change(uint32_t id, const MacroRecord* macro, uint32_t ifVersion,
+                                     MacroTable& table, KeyboardLayoutId& layout,
+                                     uint32_t& idOut, uint32_t& versionOut) {
+    MacroStoreLock guard;
+    if (!indexKnown || !sdPresent) {
+        return MACRO_CHANGE_FAILED;
+    }
+
+    int slot = -1;
+    if (id != 0) {
+        slot = table.find(id);
+        if (slot < 0) {
+            return MACRO_CHANGE_NOT_FOUND;
+        }
+        if (ifVersion != 0 && table.version(slot) != ifVersion) {
+            return MACRO_CHANGE_CONFLICT;
+        }
+    }
+
+    fs::File file = SD_MMC.open(MACRO_DB_PATH, FILE_APPEND);
+    if (!file) {
+        return MACRO_CHANGE_FAILED;
+    }
+
+    uint32_t offset = file.size();
+    MacroIndexHeader header = {};
+    header.nextId = (id == 0) ? nextId + 1 : nextId;
+    header.nextVersion = nextVersion + 1;
+    header.layout = layout;
+
+    MacroIndexEntry entry = {};
+    entry.id = (id == 0) ? nextId : id;
+    entry.version = nextVersion;
+    entry.flags = MACRO_INDEX_REMOVED;
+    bool ok = true;
+    if (macro) {
+        uint32_t recordLen = 0;
+        ok = writeRecord(file, macro->content, macro->contentLen, scratch, mac, logKeyVersion, offset, recordLen);
+        makeEntry(entry, *macro, entry.id, entry.version, offset, recordLen,
+                  crc32(macro->content, macro->contentLen));
+        offset += recordLen;
+    }
+
+    // A delta with just this entry, or now and then a full index
+    bool full = deltaCount + 1 >= MACRO_DB_MAX_DELTAS;
+    std::vector<uint8_t> index(sizeof(header));
+    if (!full) {
+        appendEntry(index, entry, macro ? macro->name : nullptr, macro ? macro->content : nullptr);
+        header.count = 1;
+    } else {
+        for (size_t i = 0; i < table.count(); i++) {
+            if ((int)i == slot) {
+                if (macro) {
+                    appendEntry(index, entry, macro->name, macro->content);
+                    header.count++;
+                }
+            } else if (table.isStored(i)) {
+                MacroIndexEntry kept;
+                makeEntry(kept, table, i);
+                appendEntry(index, kept, table.name(i), table.content(i));
+                header.count++;
+            }
+        }
+        if (macro && slot < 0) {
+            appendEntry(index, entry, macro->name, macro->content);
+            header.count++;
+        }
+    }
+    memcpy(index.data(), &header, sizeof(header));
+
+    uint32_t trailerPos = 0;
+    ok = ok && writeIndex(file, offset, index, full ? 0 : lastTrailer, logKeyVersion, trailerPos);
+    file.close();
+    wipe(index);
+    appends++;
+
+    if (!ok || !updateTable(table, slot, macro, entry)) {
+        // What made it to SD is not known; the caller reloads
+        indexKnown = false;
+        Serial.println("Failed to update " MACRO_DB_PATH);
+        return MACRO_CHANGE_FAILED;
+    }
+
+    lastTrailer = trailerPos;
+    deltaCount = full ? 0 : deltaCount + 1;
+    macroCount += (!macro) ? -1 : (slot < 0 ? 1 : 0);
+    nextId = header.nextId;
+    nextVersion = header.nextVersion;
+    dbSize = trailerPos + sizeof(MacroDbTrailer);
+    syncMirror();
+    idOut = entry.id;
+    versionOut = entry.version;
+    return MACRO_CHANGE_OK;
+}
+
+static bool readRecord(fs::FS& fs, uint32_t recordOffset, uint32_t recordLen, CryptoMac& mac,
+                       uint16_t keyVersion, MacroRecordHeader& header, std::vector<uint8_t>& cipher) {
+    fs::File file = fs.open(MACRO_DB_PATH, FILE_READ);
+    if (!file) {
+        return false;
+    }
+
+    bool ok = recordLen >= sizeof(header) &&
+              (size_t)recordOffset + recordLen <= file.size() &&
+              file.seek(recordOffset) &&
+              file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              header.magic == MACRO_RECORD_MAGIC &&
+              sizeof(header) + header.cipherLen == recordLen;
+    if (ok) {
+        cipher.resize(header.cipherLen);
+        ok = file.read(cipher.data(), cipher.size()) == cipher.size() &&
+             startRecordTag(mac, keyVersion, recordOffset, header, cipher.data()) &&
+             mac.verify(header.tag, MACRO_DB_TAG_SIZE);
+    }
+    file.close();
+    return ok;
+}
+
+// The ciphertext is read into out and decrypted in place, so a caller
+// that keeps out between calls does not allocate
+bool MacroStore::readContent(uint32_t recordOffset, uint32_t recordLen, std::vector<uint8_t>& out) {
+    MacroStoreLock guard;
+    CryptoManager& crypto = CryptoManager::getInstance();
+    if (!crypto.initialize()) {
+        return false;
+    }
+
+    MacroRecordHeader header;
+    bool ok = readsFromFlash() && readRecord(FFat, recordOffset, recordLen, mac, logKeyVersion, header, out);
+    if (!ok && sdPresent) {
+        if (mirrorCurrent) {
+            dropMirror();
+        }
+        ok = readRecord(SD_MMC, recordOffset, recordLen, mac, logKeyVersion, header, out);
+    }
+
+    size_t plainLen;
+    if (!ok || !crypto.decryptData(out.data(), out.size(), header.iv, out.data(), out.size(), plainLen,
+                                   logKeyVersion)) {
+        Serial.println("Failed to read macro record at " + String(recordOffset));
+        out.clear();
+        return false;
+    }
+    out.resize(plainLen);
+    return true;
+}
+
+void MacroStore::addReader() {
+    MacroStoreLock guard;
+    readers++;
+}
+
+void MacroStore::removeReader() {
+    MacroStoreLock guard;
+    readers--;
+}
+
+// Live data is the records the table points at plus one full index; the
+// rest of the file is superseded records, deltas and old indexes
+bool MacroStore::needsCompaction(const MacroTable& table) {
+    if (!indexKnown) {
+        return false;
+    }
+
+    size_t live = sizeof(MacroDbHeader) + sizeof(MacroIndexHeader) + 16 + sizeof(MacroDbTrailer);
+    for (size_t i = 0; i < table.count(); i++) {
+        if (table.isStored(i)) {
+            live += table.recordLength(i) + sizeof(MacroIndexEntry) +
+                    min(table.nameLength(i), (size_t)255) + strnlen(table.content(i), MACRO_PREVIEW_LEN);
+        }
+    }
+    size_t garbage = dbSize > live ? dbSize - live : 0;
+    return garbage >= MACRO_COMPACT_MIN_GARBAGE && garbage * MACRO_COMPACT_RATIO >= dbSize;
+}
+
+bool MacroStore::needsRekey() {
+    return indexKnown && logKeyVersion != CryptoManager::getInstance().keyVersion();
+}
+
+void MacroStore::abortCompaction() {
+    if (!compacting) {
+        return;
+    }
+    compactFile.close();
+    SD_MMC.remove(MACRO_DB_TMP_PATH);
+    clearCheckpoint();
+    wipe(compactIndex);
+    compactIndex.clear();
+    compactIndex.shrink_to_fit();
+    compacting = false;
+}
+
+// A new log under the current key
+bool MacroStore::startCompaction() {
+    compactKeyVersion = CryptoManager::getInstance().keyVersion();
+    compactFile = SD_MMC.open(MACRO_DB_TMP_PATH, FILE_WRITE);
+    if (!compactFile || !writeHeader(compactFile, compactKeyVersion)) {
+        compactFile.close();
+        SD_MMC.remove(MACRO_DB_TMP_PATH);
+        return false;
+    }
+    if (logKeyVersion != compactKeyVersion) {
+        Serial.println("Re-encrypting " MACRO_DB_PATH " under key version " + String(compactKeyVersion));
+    }
+    Serial.println("Compacting " MACRO_DB_PATH " (" + String((unsigned long)dbSize) + " bytes)");
+    compactNext = 0;
+    compactOffset = sizeof(MacroDbHeader);
+    compactIndex.assign(sizeof(MacroIndexHeader), 0);
+    return true;
+}
+
+// Pick up a pass over this same log from its checkpoint. The entries before
+// it are where the table says, one after the other; anything the new log
+// has past them was cut short and is written over with the same bytes'
+// worth of records.
+bool MacroStore::resumeCompaction(const MacroTable& table) {
+    MacroCompactCheckpoint checkpoint;
+    if (!loadCheckpoint(checkpoint)) {
+        return false;
+    }
+
+    MacroDbHeader header;
+    uint16_t keyVersion;
+    uint32_t offset = sizeof(header);
+    bool ok = checkpoint.logSize == dbSize && checkpoint.lastTrailer == lastTrailer &&
+              checkpoint.keyVersion == CryptoManager::getInstance().keyVersion() &&
+              checkpoint.next <= table.count();
+    for (size_t i = 0; ok && i < checkpoint.next; i++) {
+        offset += table.isStored(i) ? table.recordLength(i) : 0;
+    }
+    ok = ok && offset == checkpoint.offset;
+    if (ok) {
+        compactFile = SD_MMC.open(MACRO_DB_TMP_PATH, "r+");
+        ok = compactFile && compactFile.size() >= offset &&
+             compactFile.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+             checkHeader(header, keyVersion) && keyVersion == checkpoint.keyVersion &&
+             compactFile.seek(offset);
+    }
+    if (!ok) {
+        compactFile.close();
+        SD_MMC.remove(MACRO_DB_TMP_PATH);
+        clearCheckpoint();
+        return false;
+    }
+
+    compactKeyVersion = checkpoint.keyVersion;
+    compactNext = checkpoint.next;
+    compactOffset = offset;
+    compactIndex.assign(sizeof(MacroIndexHeader), 0);
+    offset = sizeof(header);
+    for (size_t i = 0; i < compactNext; i++) {
+        if (table.isStored(i)) {
+            MacroIndexEntry entry;
+            makeEntry(entry, table, i);
+            entry.recordOffset = offset;
+            appendEntry(compactIndex, entry, table.name(i), table.content(i));
+            offset += table.recordLength(i);
+        }
+    }
+    Serial.println("Resuming compaction of " MACRO_DB_PATH " at " + String(compactOffset));
+    return true;
+}
+
+// One record into the new log once its tag checks out: the same ciphertext
+// tagged for its new offset, or under a new IV and key if the key changed.
+// Either way it keeps its length, and the index entry its content CRC.
+bool MacroStore::copyRecord(fs::File& db, const MacroTable& table, size_t i, std::vector<uint8_t>& record) {
+    record.resize(table.recordLength(i));
+    if (!db.seek(table.recordOffset(i)) || db.read(record.data(), record.size()) != record.size()) {
+        return false;
+    }
+
+    MacroRecordHeader header;
+    memcpy(&header, record.data(), min(record.size(), sizeof(header)));
+    uint8_t* cipher = record.data() + sizeof(header);
+    if (record.size() < sizeof(header) || header.magic != MACRO_RECORD_MAGIC ||
+        sizeof(header) + header.cipherLen != record.size() ||
+        !startRecordTag(mac, logKeyVersion, table.recordOffset(i), header, cipher) ||
+        !mac.verify(header.tag, MACRO_DB_TAG_SIZE)) {
+        return false;
+    }
+    if (compactKeyVersion == logKeyVersion) {
+        return startRecordTag(mac, compactKeyVersion, compactOffset, header, cipher) &&
+               mac.finish(header.tag, MACRO_DB_TAG_SIZE) &&
+               compactFile.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+               compactFile.write(cipher, header.cipherLen) == header.cipherLen;
+    }
+
+    size_t plainLen;
+    uint32_t recordLen;
+    return CryptoManager::getInstance().decryptData(cipher, header.cipherLen, header.iv, cipher,
+                                                    header.cipherLen, plainLen, logKeyVersion) &&
+           writeRecord(compactFile, (const char*)cipher, plainLen, scratch, mac, compactKeyVersion,
+                       compactOffset, recordLen) &&
+           recordLen == record.size();
+}
+
+bool MacroStore::compactStep(MacroTable& table, KeyboardLayoutId& layout) {
+    MacroStoreLock guard;
+
+    if (!compacting) {
+        size_t stored = 0;
+        for (size_t i = 0; i < table.count(); i++) {
+            stored += table.isStored(i) ? 1 : 0;
+        }
+        // The new log is written from the table, so it must match the index
+        if (readers > 0 || stored != macroCount || (!needsCompaction(table) && !needsRekey())) {
+            return false;
+        }
+        if (!resumeCompaction(table) && !startCompaction()) {
+            return false;
+        }
+        compacting = true;
+        compactAppends = appends;
+        return true;
+    }
+
+    // Anything appended meanwhile would be lost, and a key rotated meanwhile
+    // would leave the new log behind; start over when idle again
+    if (appends != compactAppends || compactKeyVersion != CryptoManager::getInstance().keyVersion()) {
+        abortCompaction();
+        return false;
+    }
+
+    fs::File db = source().open(MACRO_DB_PATH, FILE_READ);
+    if (!db) {
+        abortCompaction();
+        return false;
+    }
+    std::vector<uint8_t> record;
+    size_t copied = 0;
+    bool ok = true;
+    while (ok && compactNext < table.count() && copied < MACRO_COMPACT_STEP_BYTES) {
+        size_t i = compactNext++;
+        if (!table.isStored(i)) {
+            continue;
+        }
+        ok = copyRecord(db, table, i, record);
+
+        MacroIndexEntry entry;
+        makeEntry(entry, table, i);
+        entry.recordOffset = compactOffset;
+        appendEntry(compactIndex, entry, table.name(i), table.content(i));
+        compactOffset += record.size();
+        copied += record.size();
+    }
+    db.close();
+    wipe(record);
+
+    if (!ok) {
+        Serial.println("Compaction failed");
+        abortCompaction();
+        return false;
+    }
+
+    // Only once what it covers is on the card
+    compactFile.flush();
+    MacroCompactCheckpoint checkpoint = {(uint32_t)dbSize, lastTrailer, (uint32_t)compactNext,
+                                         compactOffset, compactKeyVersion, 0};
+    saveCheckpoint(checkpoint);
+
+    if (compactNext < table.count() || readers > 0) {
+        return true;
+    }
+    return finishCompaction(table, layout);
+}
+
+// The index at the end of the compacted log is where it should be and
+// passes its tag
+static bool compactedLogReadable(uint32_t trailerPos, CryptoMac& mac, uint16_t keyVersion) {
+    fs::File file = SD_MMC.open(MACRO_DB_TMP_PATH, FILE_READ);
+    if (!file) {
+        return false;
+    }
+    MacroDbTrailer trailer;
+    std::vector<uint8_t> cipher;
+    bool ok = file.size() == trailerPos + sizeof(trailer) && readTrailerAt(file, trailerPos, trailer);
+    if (ok) {
+        cipher.resize(trailer.indexLen);
+        ok = file.seek(trailer.indexOffset) &&
+             file.read(cipher.data(), cipher.size()) == cipher.size() &&
+             startIndexTag(mac, keyVersion, trailer, cipher.data()) &&
+             mac.verify(trailer.tag, MACRO_DB_TAG_SIZE);
+    }
+    file.close();
+    return ok;
+}
+
+bool MacroStore::finishCompaction(MacroTable& table, KeyboardLayoutId& layout) {
+    MacroIndexHeader header = {};
+    header.count = macroCount;
+    header.nextId = nextId;
+    header.nextVersion = nextVersion;
+    header.layout = layout;
+    memcpy(compactIndex.data(), &header, sizeof(header));
+
+    uint32_t trailerPos = 0;
+    bool ok = writeIndex(compactFile, compactOffset, compactIndex, 0, compactKeyVersion, trailerPos);
+    compactFile.close();
+    if (!ok) {
+        Serial.println("Compaction failed");
+        abortCompaction();
+        return false;
+    }
+    // The old log only goes once the new one reads back
+    if (!compactedLogReadable(trailerPos, mac, compactKeyVersion)) {
+        Serial.println("Compacted log did not read back");
+        abortCompaction();
+        return false;
+    }
+    clearCheckpoint();
+
+    // A power cut between the two is finished by recover()
+    size_t before = dbSize;
+    mirrorCurrent = false;
+    if (!SD_MMC.remove(MACRO_DB_PATH)) {
+        Serial.println("Failed to replace " MACRO_DB_PATH);
+        abortCompaction();
+        indexKnown = false;
+        return false;
+    }
+    appends++;
+
+    // From here the temp file is the only copy: it is never removed
+    if (!SD_MMC.rename(MACRO_DB_TMP_PATH, MACRO_DB_PATH) &&
+        !SD_MMC.rename(MACRO_DB_TMP_PATH, MACRO_DB_PATH)) {
+        Serial.println("Failed to rename " MACRO_DB_TMP_PATH "; the next load recovers it");
+        table.clear();
+        indexKnown = false;
+        wipe(compactIndex);
+        compactIndex.clear();
+        compactIndex.shrink_to_fit();
+        compacting = false;
+        return false;
+    }
+
+    // The old table points into the old file: never type from it
+    table.beginBuild();
+    if (!buildTable(compactIndex, table, layout) || !table.commit()) {
+        table.clear();
+        indexKnown = false;
+    } else {
+        lastTrailer = trailerPos;
+        deltaCount = 0;
+        dbSize = trailerPos + sizeof(MacroDbTrailer);
+        syncMirror();
+    }
+    logKeyVersion = compactKeyVersion;
+    wipe(compactIndex);
+    compactIndex.clear();
+    compactIndex.shrink_to_fit();
+    compacting = false;
+
+    Serial.println("Compacted " MACRO_DB_PATH ": " + String((unsigned long)before) + " -> " +
+                   String((unsigned long)dbSize) + " bytes");
+    return false;
+}
+
+bool MacroStore::validName(const char* name, size_t nameLen) {
+    if (nameLen == 0 || nameLen > 255 || name[0] == '#' || isspace((uint8_t)name[0]) ||
+        isspace((uint8_t)name[nameLen - 1])) {
+        return false;
+    }
+    // Would read back as the sensitive prefix
+    if (nameLen == 9 && memcmp(name, "SENSITIVE", 9) == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < nameLen; i++) {
+        if (name[i] == ':' || name[i] == '\n' || name[i] == '\r') {
+            return false;
+        }
+    }
+    return true;
+}
+
+void MacroStore::formatLine(String& out, const char* name, size_t nameLen,
+                            const char* content, size_t contentLen, bool sensitive) {
+    out.reserve(out.length() + nameLen + contentLen + 16);
+    if (sensitive) {
+        out += "SENSITIVE:";
+    }
+    out.concat(name, nameLen);
+    out += ':';
+    for (size_t i = 0; i < contentLen; i++) {
+        char c = content[i];
+        if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\t') {
+            out += "\\t";
+        } else if (c == '\\') {
+            out += "\\\\";
+        } else {
+            out += c;
+        }
+    }
+    out += '\n';
+}
+
+MacroExporter::~MacroExporter() {
+    if (reading) {
+        MacroStore::getInstance().removeReader();
+    }
+    wipe(index);
+    wipe(content);
+}
+
+bool MacroExporter::begin() {
+    if (!MacroStore::getInstance().readIndex(index)) {
+        return false;
+    }
+    // Record offsets in the index stay valid until the reader is removed
+    MacroStore::getInstance().addReader();
+    reading = true;
+
+    MacroIndexHeader header;
+    memcpy(&header, index.data(), sizeof(header));
+    indexPos = sizeof(header);
+    remaining = header.count;
+
+    pending = "# USBone Macro File\n# Format: NAME:CONTENT or SENSITIVE:NAME:CONTENT\n";
+    pendingPos = 0;
+    return true;
+}
+
+bool MacroExporter::nextLine() {
+    if (failed || remaining == 0) {
+        return false;
+    }
+
+    MacroIndexEntry entry;
+    const char* name = MacroStore::nextEntry(index, indexPos, entry);
+    if (!name) {
+        failed = true;
+        return false;
+    }
+    remaining--;
+
+    // Reused from line to line
+    if (!MacroStore::getInstance().readContent(entry.recordOffset, entry.recordLen, content)) {
+        failed = true;
+        return false;
+    }
+
+    pending = "";
+    pendingPos = 0;
+    if (entry.layout != lastLayout && entry.layout < LAYOUT_COUNT) {
+        pending += "#!LAYOUT:";
+        pending += keyboardLayoutName((KeyboardLayoutId)entry.layout);
+        pending += '\n';
+        lastLayout = entry.layout;
+    }
+    MacroStore::formatLine(pending, name, entry.nameLen, (const char*)content.data(),
+                           content.size(), entry.flags & MACRO_FLAG_SENSITIVE);
+    wipe(content);
+    return true;
+}
+
+size_t MacroExporter::read(uint8_t* buffer, size_t maxLen) {
+    size_t written = 0;
+
+    while (written < maxLen) {
+        if (pendingPos >= pending.length() && !nextLine()) {
+            break;
+        }
+        size_t chunk = pending.length() - pendingPos;
+        if (chunk > maxLen - written) {
+            chunk = maxLen - written;
+        }
+        memcpy(buffer + written, pending.c_str() + pendingPos, chunk);
+        pendingPos += chunk;
+        written += chunk;
+    }
+    return written;
+}
+
+MacroFileReader::~MacroFileReader() {
+    if (file) {
+        file.close();
+    }
+    wipe(plain);
+}
+
+bool MacroFileReader::begin(bool allowLegacy) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    encrypted = SD_MMC.exists(MACRO_OLD_ENC_PATH);
+    const char* path = encrypted ? MACRO_OLD_ENC_PATH : MACRO_OLD_TXT_PATH;
+    if (!encrypted && !SD_MMC.exists(path)) {
+        return false;
+    }
+    if (encrypted && !crypto.initialize()) {
+        Serial.println("Failed to initialize crypto system");
+        return false;
+    }
+
+    file = SD_MMC.open(path, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open " + String(path));
+        return false;
+    }
+    Serial.println("Reading " + String(path) + " (" + String((unsigned long)file.size()) + " bytes)");
+
+    if (encrypted) {
+        // A header is checked before anything is decrypted; without one the
+        // file is raw CBC under the stored IV and the first key, which only
+        // migration reads
+        uint16_t keyVersion = 1;
+        authenticated = file.size() >= sizeof(header) &&
+                        file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+                        header.magic == CRYPTO_FILE_MAGIC;
+        if (authenticated) {
+            if (!crypto.checkFileHeader(header, file.size(), keyVersion) || !mac.begin(header)) {
+                return false;
+            }
+            cipherLeft = CryptoManager::paddedSize(header.plainLen);
+        } else if (!allowLegacy) {
+            Serial.println(String(path) + " has no header");
+            return false;
+        } else if (!file.seek(0)) {
+            return false;
+        }
+        if (!cbc.begin(authenticated ? header.iv : nullptr, keyVersion)) {
+            return false;
+        }
+    }
+
+    // Decryption writes up to a block more than it reads
+    cipher.resize(encrypted ? MACRO_STREAM_BLOCK : 0);
+    plain.resize(MACRO_STREAM_BLOCK + CbcDecryptStream::BLOCK_SIZE);
+    return true;
+}
+
+bool MacroFileReader::length(size_t& len) const {
+    len = header.plainLen;
+    return authenticated;
+}
+
+bool MacroFileReader::fill() {
+    plainPos = 0;
+    plainLen = 0;
+    if (!encrypted) {
+        plainLen = file.read(plain.data(), MACRO_STREAM_BLOCK);
+        done = plainLen == 0;
+        return !done;
+    }
+
+    size_t want = cipher.size();
+    if (authenticated && want > cipherLeft) {
+        want = cipherLeft;
+    }
+    size_t got = want > 0 ? file.read(cipher.data(), want) : 0;
+    if (got > 0) {
+        cipherLeft -= authenticated ? got : 0;
+        if (authenticated && !mac.update(cipher.data(), got)) {
+            error = true;
+            return false;
+        }
+        plainLen = cbc.update(cipher.data(), got, plain.data());
+        return true;
+    }
+
+    // The tag is checked before the last block is let out
+    done = true;
+    uint8_t tag[CRYPTO_FILE_TAG_SIZE];
+    if (authenticated && (cipherLeft != 0 || file.read(tag, sizeof(tag)) != sizeof(tag) || !mac.verify(tag))) {
+        Serial.println(MACRO_OLD_ENC_PATH " failed authentication");
+        error = true;
+        return false;
+    }
+    if (!cbc.finish(plain.data(), plainLen)) {
+        Serial.println("Failed to decrypt " MACRO_OLD_ENC_PATH);
+        error = true;
+        return false;
+    }
+    return true;
+}
+
+size_t MacroFileReader::read(uint8_t* buffer, size_t maxLen) {
+    size_t written = 0;
+
+    while (written < maxLen && !error) {
+        if (plainPos >= plainLen) {
+            if (done || !fill()) {
+                break;
+            }
+            continue;
+        }
+        size_t chunk = plainLen - plainPos;
+        if (chunk > maxLen - written) {
+            chunk = maxLen - written;
+        }
+        memcpy(buffer + written, plain.data() + plainPos, chunk);
+        plainPos += chunk;
+        written += chunk;
+    }
+    return error ? 0 : written;
+}
+
+bool MacroFileReader::readText(char* buffer, size_t maxLen, size_t& len, void* ctx) {
+    MacroFileReader* reader = (MacroFileReader*)ctx;
+    len = reader->read((uint8_t*)buffer, maxLen);
+    return !reader->failed();
+}
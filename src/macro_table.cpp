@@ -0,0 +1,304 @@
+#include "../include/macro_table.h"
+#include <esp_heap_caps.h>
+
+MacroTable& MacroTable::getInstance() {
+    static MacroTable instance;
+    return instance;
+}
+
+MacroTable::MacroTable() {
+    lock = xSemaphoreCreateRecursiveMutex();
+}
+
+void* MacroTable::allocate(size_t bytes) {
+    if (psramFound()) {
+        void* ptr = heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (ptr) {
+            return ptr;
+        }
+    }
+    return malloc(bytes);
+}
+
+void* MacroTable::reallocate(void* ptr, size_t bytes) {
+    if (!ptr) {
+        return allocate(bytes);
+    }
+    // heap_caps_realloc keeps the block in whichever heap it came from
+    return heap_caps_realloc(ptr, bytes, MALLOC_CAP_8BIT);
+}
+
+void MacroTable::beginBuild() {
+    discardBuild();
+}
+
+void MacroTable::discardBuild() {
+    free(buildEntries);
+    free(buildData);
+    buildEntries = nullptr;
+    buildData = nullptr;
+    buildCount = 0;
+    buildEntryCap = 0;
+    buildDataSize = 0;
+    buildDataCap = 0;
+}
+
+bool MacroTable::reserveData(size_t extra) {
+    if (buildDataSize + extra <= buildDataCap) {
+        return true;
+    }
+
+    size_t capacity = buildDataCap ? buildDataCap : 4096;
+    while (capacity < buildDataSize + extra) {
+        capacity *= 2;
+    }
+    uint8_t* grown = (uint8_t*)reallocate(buildData, capacity);
+    if (!grown) {
+        return false;
+    }
+    buildData = grown;
+    buildDataCap = capacity;
+    return true;
+}
+
+MacroEntry* MacroTable::appendEntry(const char* name, size_t nameLen, const char* text,
+                                    size_t textLen, size_t extra) {
+    if (buildCount == buildEntryCap) {
+        size_t capacity = buildEntryCap ? buildEntryCap * 2 : 32;
+        MacroEntry* grown = (MacroEntry*)reallocate(buildEntries, capacity * sizeof(MacroEntry));
+        if (!grown) {
+            return nullptr;
+        }
+        buildEntries = grown;
+        buildEntryCap = capacity;
+    }
+
+    if (!reserveData(nameLen + 1 + textLen + 1 + extra)) {
+        return nullptr;
+    }
+
+    MacroEntry* entry = &buildEntries[buildCount++];
+    memset(entry, 0, sizeof(*entry));
+
+    entry->nameOffset = buildDataSize;
+    entry->nameLen = nameLen;
+    memcpy(buildData + buildDataSize, name, nameLen);
+    buildData[buildDataSize + nameLen] = '\0';
+    buildDataSize += nameLen + 1;
+
+    entry->contentOffset = buildDataSize;
+    entry->contentLen = textLen;
+    memcpy(buildData + buildDataSize, text, textLen);
+    buildData[buildDataSize + textLen] = '\0';
+    buildDataSize += textLen + 1;
+
+    entry->strokesOffset = buildDataSize;
+    return entry;
+}
+
+bool MacroTable::add(const char* name, size_t nameLen, const char* content, size_t contentLen,
+                     bool sensitive, KeyboardLayoutId layout, size_t* untypeable) {
+    if (nameLen > 0xFFFF) {
+        nameLen = 0xFFFF;
+    }
+
+    // Worst case every character needs a dead key plus the key
+    MacroEntry* entry = appendEntry(name, nameLen, content, contentLen,
+                                    contentLen * 2 * sizeof(KeyStroke));
+    if (!entry) {
+        return false;
+    }
+
+    KeyStroke* strokes = (KeyStroke*)(buildData + buildDataSize);
+    size_t strokeCount = 0;
+    size_t skipped = 0;
+    for (size_t i = 0; i < contentLen; i++) {
+        uint8_t n = HidInjector::charToKeyStrokes(content[i], layout, strokes + strokeCount);
+        if (n == 0) {
+            skipped++;
+        }
+        strokeCount += n;
+    }
+    entry->strokeCount = strokeCount;
+    buildDataSize += strokeCount * sizeof(KeyStroke);
+
+    entry->flags = (sensitive ? MACRO_FLAG_SENSITIVE : 0) | (skipped ? MACRO_FLAG_UNTYPEABLE : 0);
+    entry->layout = layout;
+
+    if (untypeable) {
+        *untypeable = skipped;
+    }
+    return true;
+}
+
+bool MacroTable::addStored(const char* name, size_t nameLen, const char* preview, size_t previewLen,
+                           size_t contentLen, uint8_t flags, KeyboardLayoutId layout,
+                           const MacroStoredRef& ref) {
+    if (nameLen > 0xFFFF) {
+        nameLen = 0xFFFF;
+    }
+
+    MacroEntry* entry = appendEntry(name, nameLen, preview, previewLen, 0);
+    if (!entry) {
+        return false;
+    }
+    entry->contentLen = contentLen;
+    entry->stored = ref;
+    entry->flags = MACRO_FLAG_STORED | (flags & (MACRO_FLAG_SENSITIVE | MACRO_FLAG_UNTYPEABLE));
+    entry->layout = layout;
+    return true;
+}
+
+int MacroTable::find(uint32_t id) const {
+    for (size_t i = 0; i < entryCount; i++) {
+        if (entries()[i].stored.id == id && (entries()[i].flags & MACRO_FLAG_STORED)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool MacroTable::commit() {
+    size_t indexBytes = buildCount * sizeof(MacroEntry);
+    size_t total = indexBytes + buildDataSize;
+    size_t slack = total / 16 > MACRO_TABLE_SLACK_MIN ? total / 16 : MACRO_TABLE_SLACK_MIN;
+
+    uint8_t* packed = nullptr;
+    if (total > 0) {
+        packed = (uint8_t*)allocate(total + slack);
+        if (!packed) {
+            Serial.println("Out of memory for macro table");
+            discardBuild();
+            return false;
+        }
+        memcpy(packed, buildEntries, indexBytes);
+        memcpy(packed + indexBytes, buildData, buildDataSize);
+    }
+
+    const uint8_t* old = arena;
+    bool oldAttached = attached;
+    {
+        MacroTableLock guard;
+        arena = packed;
+        arenaBytes = total;
+        arenaCapacity = packed ? total + slack : 0;
+        attached = false;
+        entryCount = buildCount;
+    }
+    if (!oldAttached) {
+        free((void*)old);
+    }
+
+    discardBuild();
+    return true;
+}
+
+// Name and preview go at the end of the data area; the caller checked room
+bool MacroTable::setStored(MacroEntry& entry, const char* name, size_t nameLen, const char* preview,
+                           size_t previewLen, size_t contentLen, uint8_t flags,
+                           KeyboardLayoutId layout, const MacroStoredRef& ref) {
+    uint8_t* data = (uint8_t*)arena + dataStart();
+    size_t dataSize = arenaBytes - dataStart();
+
+    entry.nameOffset = dataSize;
+    entry.nameLen = nameLen;
+    memcpy(data + dataSize, name, nameLen);
+    data[dataSize + nameLen] = '\0';
+    dataSize += nameLen + 1;
+
+    entry.contentOffset = dataSize;
+    memcpy(data + dataSize, preview, previewLen);
+    data[dataSize + previewLen] = '\0';
+    dataSize += previewLen + 1;
+
+    entry.strokesOffset = dataSize;
+    entry.strokeCount = 0;
+    entry.contentLen = contentLen;
+    entry.stored = ref;
+    entry.flags = MACRO_FLAG_STORED | (flags & (MACRO_FLAG_SENSITIVE | MACRO_FLAG_UNTYPEABLE));
+    entry.layout = layout;
+
+    arenaBytes = dataStart() + dataSize;
+    return true;
+}
+
+bool MacroTable::replaceStored(size_t i, const char* name, size_t nameLen, const char* preview,
+                               size_t previewLen, size_t contentLen, uint8_t flags,
+                               KeyboardLayoutId layout, const MacroStoredRef& ref) {
+    MacroTableLock guard;
+    if (nameLen > 0xFFFF) {
+        nameLen = 0xFFFF;
+    }
+    if (attached || !arena || i >= entryCount ||
+        arenaBytes + nameLen + 1 + previewLen + 1 > arenaCapacity) {
+        return false;
+    }
+    MacroEntry* entry = (MacroEntry*)arena + i;
+    return setStored(*entry, name, nameLen, preview, previewLen, contentLen, flags, layout, ref);
+}
+
+bool MacroTable::appendStored(const char* name, size_t nameLen, const char* preview, size_t previewLen,
+                              size_t contentLen, uint8_t flags, KeyboardLayoutId layout,
+                              const MacroStoredRef& ref) {
+    MacroTableLock guard;
+    if (nameLen > 0xFFFF) {
+        nameLen = 0xFFFF;
+    }
+    if (attached || !arena ||
+        arenaBytes + sizeof(MacroEntry) + nameLen + 1 + previewLen + 1 > arenaCapacity) {
+        return false;
+    }
+
+    // Offsets are relative to the data area, so it moves as a whole
+    uint8_t* base = (uint8_t*)arena;
+    size_t indexBytes = dataStart();
+    memmove(base + indexBytes + sizeof(MacroEntry), base + indexBytes, arenaBytes - indexBytes);
+    arenaBytes += sizeof(MacroEntry);
+    MacroEntry* entry = (MacroEntry*)base + entryCount;
+    memset(entry, 0, sizeof(*entry));
+    entryCount++;
+    return setStored(*entry, name, nameLen, preview, previewLen, contentLen, flags, layout, ref);
+}
+
+bool MacroTable::removeAt(size_t i) {
+    MacroTableLock guard;
+    if (attached || !arena || i >= entryCount) {
+        return false;
+    }
+
+    uint8_t* base = (uint8_t*)arena;
+    size_t indexBytes = dataStart();
+    MacroEntry* entries = (MacroEntry*)base;
+    memmove(entries + i, entries + i + 1, (entryCount - i - 1) * sizeof(MacroEntry));
+    memmove(base + indexBytes - sizeof(MacroEntry), base + indexBytes, arenaBytes - indexBytes);
+    arenaBytes -= sizeof(MacroEntry);
+    entryCount--;
+    return true;
+}
+
+void MacroTable::attach(const uint8_t* table, size_t count, size_t bytes) {
+    MacroTableLock guard;
+    clear();
+    arena = table;
+    arenaBytes = bytes;
+    arenaCapacity = 0;
+    attached = true;
+    entryCount = count;
+}
+
+void MacroTable::clear() {
+    discardBuild();
+    const uint8_t* old = arena;
+    bool oldAttached = attached;
+    {
+        MacroTableLock guard;
+        entryCount = 0;
+        arena = nullptr;
+        arenaBytes = 0;
+        arenaCapacity = 0;
+        attached = false;
+    }
+    if (!oldAttached) {
+        free((void*)old);
+    }
+}
@@ -13,9 +13,17 @@
 #include <ESPmDNS.h>
 #include <FS.h>
 #include <SD_MMC.h>
+#include <FFat.h>
 #include "crypto_manager.h"
+#include "hid_injector.h"
+#include "injection_task.h"
+#include "hid_calibration.h"
+#include "macro_table.h"
+#include "macro_store.h"
+#include "macro_image.h"
 #include <vector>
 #include <algorithm>
+#include <memory>
 
 // USB configuration
 #if ARDUINO_USB_MODE
@@ -86,33 +94,27 @@ bool usbHidEnabled = false;
 
 // Forward declarations
 void updateDisplay();
-void loadMacrosFromSD();
+void loadMacros();
 bool initializeSD();
 void createExampleMacros();
 bool saveMacrosToSD(const String& content);
+void removeOldMacroFiles();
+void addMacro(const char* name, size_t nameLen, const char* content, size_t contentLen,
+              bool isSensitive, KeyboardLayoutId layout);
 void handleSingleButton();
 void injectMacro();
-
-void sendSpecialChar(char c) {
-  if (c == '@') {
-    // Special handling for @ symbol (Polish keyboard: AltGr+2)
-    keyboard.press(KEY_RIGHT_ALT);
-    keyboard.press('2');
-    delay(50);
-    keyboard.releaseAll();
-  } else {
-    keyboard.write(c);
-  }
-}
-
-bool needsSpecialHandling(char c) {
-  return (c == '@');
-}
+void serviceInjection();
+void serviceCompaction();
+void serviceBenchmark();
+void serviceKeyRotation();
+void serviceMacroReload();
+void servicePatternEntry();
+void unlockDevice();
+bool tryUnlock(const uint8_t* secret, size_t len);
+unsigned long unlockWaitMs();
 
 // Global variables
-std::vector<String> macros;
-std::vector<String> macroNames;
-std::vector<bool> macroSensitive;
+KeyboardLayoutId macroLayout = LAYOUT_DEFAULT;     // Host layout of the macro set
 int currentMacro = 0;
 
 // Security variables
@@ -124,8 +126,39 @@ int patternPos = 0;
 unsigned long lastPatternPress = 0;
 const unsigned long patternTimeout = 5000;
 
+// With the keys under a secret, presses are the secret: '1' short, '2'
+// long, tried as a whole after a pause
+char patternEntry[CRYPTO_SECRET_MAX];
+size_t patternLen = 0;
+const unsigned long patternSubmitDelay = 1500;
+
+// A secret from /api/unlock, tried by the main loop: the KDF would hold up
+// the web server task for the whole unlock budget
+char webSecret[CRYPTO_SECRET_MAX];
+size_t webSecretLen = 0;
+volatile bool webUnlockRequested = false;
+
+// Wrong secrets, from the button or over HTTP, make the next try wait:
+// not for the first few, then doubling up to unlockBackoffMax
+const int unlockFreeAttempts = 3;
+const unsigned long unlockBackoffBase = 1000;
+const unsigned long unlockBackoffMax = 300000;
+int unlockFailures = 0;
+volatile unsigned long unlockRetryAt = 0;   // millis(); 0 when there is no wait
+
 // SD Card state
 bool sdCardAvailable = false;
+const unsigned long compactIdleTime = 10000;  // Idle time before the macro log is compacted
+
+// Crypto benchmark, requested over HTTP and run from the main loop
+volatile bool benchmarkRequested = false;
+String benchmarkReport;
+
+// Key rotation, requested over HTTP and done from the main loop
+volatile bool keyRotationRequested = false;
+
+// Table reload after a web save or a failed edit, done from the main loop
+volatile bool macroReloadRequested = false;
 
 // Button variables
 bool lastButtonState = HIGH;
@@ -143,6 +176,9 @@ unsigned long lastClickTime = 0;
 const unsigned long doubleClickWindow = 400; // Time window for double-click (400ms)
 bool waitingForDoubleClick = false;
 
+// Injection progress already reported to the user
+uint32_t lastFinishedInjection = 0;
+
 // Colors
 #define COLOR_BG     0x0000
 #define COLOR_TEXT   0xFFFF
@@ -555,6 +591,18 @@ const char index_html[] PROGMEM = R"rawliteral(
             opacity: 0.5;
         }
         
+        .macro-row {
+            padding: 10px 15px;
+            border-bottom: 1px solid var(--border-color);
+            cursor: pointer;
+            transition: all 0.3s;
+        }
+        
+        .macro-row:hover {
+            color: var(--accent-primary);
+            background: rgba(0, 212, 255, 0.05);
+        }
+        
         .button-group {
             display: flex;
             gap: 15px;
@@ -759,10 +807,78 @@ const char index_html[] PROGMEM = R"rawliteral(
                     Hold BOOT button for 3+ seconds to toggle WiFi mode. Device auto-locks after 30 seconds of inactivity.
                 </p>
             </div>
+            <div class="card">
+                <h2 class="card-title">Typing Speed</h2>
+                <p style="color: var(--text-secondary); margin-bottom: 20px;">
+                    Calibration toggles Caps/Num/Scroll Lock on the host and times the LED echo to find the fastest safe typing rate. Focus a harmless window on the host first.
+                </p>
+                <div class="info-grid">
+                    <div class="info-item">
+                        <div class="info-label">Host Profile</div>
+                        <div class="info-value" id="pacingHost">-</div>
+                    </div>
+                    <div class="info-item">
+                        <div class="info-label">Report Interval</div>
+                        <div class="info-value" id="pacingInterval">-</div>
+                    </div>
+                    <div class="info-item">
+                        <div class="info-label">Keys / Report</div>
+                        <div class="info-value" id="pacingKeys">-</div>
+                    </div>
+                </div>
+                <p style="color: var(--text-secondary);">
+                    Host name:
+                    <input id="pacingName" maxlength="12" list="pacingHosts" style="background: rgba(0,0,0,0.4); color: var(--text-primary); border: 1px solid var(--border-color); border-radius: 5px; padding: 3px 10px;">
+                    <datalist id="pacingHosts"></datalist>
+                </p>
+                <div class="button-group">
+                    <button class="btn-primary" onclick="calibrate()">
+                        <span>⏱️ Calibrate</span>
+                    </button>
+                    <button class="btn-info" onclick="selectPacing()">
+                        <span>✔️ Use Profile</span>
+                    </button>
+                </div>
+                <div id="pacingStatus" class="status"></div>
+            </div>
         </div>
         
         <!-- Macro Editor Tab -->
         <div id="editor" class="tab-content">
+            <div class="card">
+                <h2 class="card-title">Macros</h2>
+                <p style="color: var(--text-secondary); margin-bottom: 20px;">
+                    Pick a macro to edit it on its own; only that macro is sent and stored
+                </p>
+                <div id="macroList" style="max-height: 300px; overflow-y: auto; margin-bottom: 20px;"></div>
+                <p style="color: var(--text-secondary); margin-bottom: 10px;">
+                    Name:
+                    <input id="macroName" maxlength="255" style="background: rgba(0,0,0,0.4); color: var(--text-primary); border: 1px solid var(--border-color); border-radius: 5px; padding: 3px 10px;">
+                    Layout:
+                    <select id="macroLayout" style="background: rgba(0,0,0,0.4); color: var(--text-primary); border: 1px solid var(--border-color); border-radius: 5px; padding: 3px 10px;">
+                        <option value="">Macro file default</option>
+                        <option value="US">US</option>
+                        <option value="PL">PL</option>
+                        <option value="DE">DE</option>
+                        <option value="FR">FR</option>
+                        <option value="UK">UK</option>
+                    </select>
+                    <label><input type="checkbox" id="macroSensitive"> Sensitive</label>
+                </p>
+                <textarea id="macroContent" style="min-height: 100px;" placeholder="Macro content (Enter and Tab are typed as they are)"></textarea>
+                <div class="button-group">
+                    <button class="btn-success" onclick="saveMacro()">
+                        <span>💾 Save Macro</span>
+                    </button>
+                    <button class="btn-info" onclick="newMacro()">
+                        <span>➕ New</span>
+                    </button>
+                    <button class="btn-warning" onclick="deleteMacro()">
+                        <span>🗑️ Delete</span>
+                    </button>
+                </div>
+                <div id="macroStatus" class="status"></div>
+            </div>
             <div class="card">
                 <h2 class="card-title">Macro Editor</h2>
                 <p style="color: var(--text-secondary); margin-bottom: 20px;">
@@ -797,11 +913,25 @@ Supports:
 • Multiple paragraphs
 • Special characters  
 • Tab and Enter keys
-• Long texts (up to 10KB)"></textarea>
+• Long texts (streamed while typing)"></textarea>
+                <p style="color: var(--text-secondary); margin-top: 20px;">
+                    Host keyboard layout:
+                    <select id="liveLayout" style="background: rgba(0,0,0,0.4); color: var(--text-primary); border: 1px solid var(--border-color); border-radius: 5px; padding: 3px 10px;">
+                        <option value="">Macro file default</option>
+                        <option value="US">US</option>
+                        <option value="PL">PL</option>
+                        <option value="DE">DE</option>
+                        <option value="FR">FR</option>
+                        <option value="UK">UK</option>
+                    </select>
+                </p>
                 <div class="button-group">
                     <button class="btn-primary" onclick="sendText()">
                         <span>🚀 Send to Host</span>
                     </button>
+                    <button class="btn-info" onclick="cancelInjection()">
+                        <span>⏹️ Stop</span>
+                    </button>
                     <button class="btn-warning" onclick="clearLive()">
                         <span>🗑️ Clear</span>
                     </button>
@@ -855,9 +985,65 @@ Supports:
         window.onload = function() {
             console.log('Page loaded, attempting to load macros...');
             loadMacros();
+            loadMacroList();
             checkSDStatus();
+            loadPacing();
         };
 
+        async function loadPacing() {
+            try {
+                const response = await fetch('/api/pacing');
+                const pacing = await response.json();
+                document.getElementById('pacingHost').textContent = pacing.active || 'default';
+                document.getElementById('pacingInterval').textContent = (pacing.interval / 1000).toFixed(2) + ' ms';
+                document.getElementById('pacingKeys').textContent = pacing.maxKeys;
+                document.getElementById('pacingHosts').innerHTML =
+                    pacing.hosts.split(',').filter(h => h).map(h => '<option value="' + h + '">').join('');
+                return pacing;
+            } catch (error) {
+                return null;
+            }
+        }
+
+        async function calibrate() {
+            const host = document.getElementById('pacingName').value;
+            if (!host) {
+                showStatus('pacingStatus', '⚠️ Enter a host name first', 'info');
+                return;
+            }
+            const response = await fetch('/api/pacing/calibrate?host=' + encodeURIComponent(host), { method: 'POST' });
+            if (!response.ok) {
+                showStatus('pacingStatus', '❌ ' + await response.text(), 'error');
+                return;
+            }
+            showStatus('pacingStatus', '⏱️ Calibrating...', 'info');
+            const poll = async () => {
+                const status = await (await fetch('/api/inject/status')).json();
+                if (status.busy || status.queued > 0) {
+                    setTimeout(poll, 500);
+                    return;
+                }
+                const pacing = await loadPacing();
+                if (pacing && pacing.lastValid) {
+                    showStatus('pacingStatus', '✅ Calibrated (LED echo ' + (pacing.latency / 1000).toFixed(1) + ' ms)', 'success');
+                } else {
+                    showStatus('pacingStatus', '❌ ' + (pacing ? pacing.lastError : 'Calibration failed'), 'error');
+                }
+            };
+            setTimeout(poll, 1000);
+        }
+
+        async function selectPacing() {
+            const host = document.getElementById('pacingName').value;
+            const response = await fetch('/api/pacing/select?host=' + encodeURIComponent(host), { method: 'POST' });
+            if (response.ok) {
+                loadPacing();
+                showStatus('pacingStatus', '✅ Using profile ' + host, 'success');
+            } else {
+                showStatus('pacingStatus', '❌ No profile for ' + host, 'error');
+            }
+        }
+
         function showStatus(elementId, message, type) {
             const status = document.getElementById(elementId);
             status.textContent = message;
@@ -896,6 +1082,8 @@ Supports:
                 });
                 if (response.ok) {
                     showStatus('editorStatus', '✅ Macros saved successfully!', 'success');
+                    newMacro();
+                    loadMacroList();
                 } else if (response.status === 401) {
                     showStatus('editorStatus', '⚠️ Authentication required - please reload the page', 'error');
                 } else {
@@ -906,6 +1094,104 @@ Supports:
             }
         }
 
+        // Macro being edited on its own: id and the ETag it was loaded with
+        let editing = null;
+
+        async function loadMacroList() {
+            try {
+                const response = await fetch('/api/macros/list');
+                if (!response.ok) {
+                    return;
+                }
+                const macros = await response.json();
+                const list = document.getElementById('macroList');
+                list.innerHTML = '';
+                macros.forEach(macro => {
+                    const row = document.createElement('div');
+                    row.className = 'macro-row';
+                    row.textContent = (macro.sensitive ? '🔒 ' : '') + macro.name +
+                        ' (' + macro.layout + ', ' + macro.length + ' chars)';
+                    row.onclick = () => editMacro(macro.id);
+                    list.appendChild(row);
+                });
+            } catch (error) {
+                showStatus('macroStatus', '❌ Error: ' + error.message, 'error');
+            }
+        }
+
+        async function editMacro(id) {
+            const response = await fetch('/api/macros/' + id);
+            if (!response.ok) {
+                showStatus('macroStatus', '❌ Failed to load macro', 'error');
+                loadMacroList();
+                return;
+            }
+            const macro = await response.json();
+            editing = { id: macro.id, etag: response.headers.get('ETag') };
+            document.getElementById('macroName').value = macro.name;
+            document.getElementById('macroContent').value = macro.content;
+            document.getElementById('macroSensitive').checked = macro.sensitive;
+            document.getElementById('macroLayout').value = macro.layout;
+        }
+
+        function newMacro() {
+            editing = null;
+            document.getElementById('macroName').value = '';
+            document.getElementById('macroContent').value = '';
+            document.getElementById('macroSensitive').checked = false;
+            document.getElementById('macroLayout').value = '';
+        }
+
+        async function saveMacro() {
+            const body = new URLSearchParams();
+            body.append('name', document.getElementById('macroName').value);
+            body.append('content', document.getElementById('macroContent').value);
+            body.append('layout', document.getElementById('macroLayout').value);
+            if (document.getElementById('macroSensitive').checked) {
+                body.append('sensitive', '1');
+            }
+            try {
+                const response = await fetch(editing ? '/api/macros/' + editing.id : '/api/macros/new', {
+                    method: editing ? 'PUT' : 'POST',
+                    headers: editing && editing.etag ? { 'If-Match': editing.etag } : {},
+                    body: body
+                });
+                if (response.status === 412) {
+                    showStatus('macroStatus', '⚠️ Macro was changed elsewhere - pick it again', 'error');
+                    return;
+                }
+                if (!response.ok) {
+                    showStatus('macroStatus', '❌ ' + await response.text(), 'error');
+                    return;
+                }
+                const saved = await response.json();
+                editing = { id: saved.id, etag: response.headers.get('ETag') };
+                showStatus('macroStatus', '✅ Macro saved', 'success');
+                loadMacroList();
+            } catch (error) {
+                showStatus('macroStatus', '❌ Error: ' + error.message, 'error');
+            }
+        }
+
+        async function deleteMacro() {
+            if (!editing || !confirm('Delete ' + document.getElementById('macroName').value + '?')) {
+                return;
+            }
+            const response = await fetch('/api/macros/' + editing.id, {
+                method: 'DELETE',
+                headers: editing.etag ? { 'If-Match': editing.etag } : {}
+            });
+            if (response.status === 412) {
+                showStatus('macroStatus', '⚠️ Macro was changed elsewhere - pick it again', 'error');
+            } else if (response.ok || response.status === 404) {
+                showStatus('macroStatus', '✅ Macro deleted', 'success');
+                newMacro();
+            } else {
+                showStatus('macroStatus', '❌ Failed to delete macro', 'error');
+            }
+            loadMacroList();
+        }
+
         async function sendText() {
             const text = document.getElementById('liveText').value;
             if (!text) {
@@ -915,14 +1201,17 @@ Supports:
             
             showStatus('liveStatus', '📤 Sending text to host...', 'info');
             
+            const layout = document.getElementById('liveLayout').value;
+            const url = layout ? '/api/inject?layout=' + layout : '/api/inject';
+            
             try {
-                const response = await fetch('/api/inject', {
+                const response = await fetch(url, {
                     method: 'POST',
                     headers: { 'Content-Type': 'text/plain' },
                     body: text
                 });
                 if (response.ok) {
-                    showStatus('liveStatus', '✅ Text sent successfully!', 'success');
+                    pollInjection();
                 } else {
                     showStatus('liveStatus', '❌ Failed to send text', 'error');
                 }
@@ -931,6 +1220,28 @@ Supports:
             }
         }
 
+        async function pollInjection() {
+            try {
+                const response = await fetch('/api/inject/status');
+                const status = await response.json();
+                if (status.busy || status.queued > 0) {
+                    const percent = status.total ? Math.floor(100 * status.done / status.total) : 0;
+                    showStatus('liveStatus', '⌨️ Typing... ' + percent + '%', 'info');
+                    setTimeout(pollInjection, 500);
+                } else if (status.cancelled) {
+                    showStatus('liveStatus', '⚠️ Injection cancelled', 'error');
+                } else {
+                    showStatus('liveStatus', '✅ Text sent successfully!', 'success');
+                }
+            } catch (error) {
+                showStatus('liveStatus', '❌ Error: ' + error.message, 'error');
+            }
+        }
+
+        async function cancelInjection() {
+            await fetch('/api/inject/cancel', { method: 'POST' });
+        }
+
         function clearEditor() {
             if (confirm('Clear the macro editor? This will not delete the file.')) {
                 document.getElementById('macroEditor').value = '';
@@ -957,6 +1268,14 @@ void checkUnlock(bool isLongPress) {
   
   int press = isLongPress ? 2 : 1;
   
+  if (CryptoManager::getInstance().hasSecret()) {
+    if (patternLen < sizeof(patternEntry)) {
+      patternEntry[patternLen++] = '0' + press;
+    }
+    blinkLED(0, 0, 255, 1);
+    return;
+  }
+  
   if (press == unlockPattern[patternPos]) {
     patternPos++;
     Serial.print("Pattern progress: ");
@@ -966,16 +1285,8 @@ void checkUnlock(bool isLongPress) {
     blinkLED(0, 0, 255, 1);
     
     if (patternPos >= sizeof(unlockPattern) / sizeof(unlockPattern[0])) {
-      deviceLocked = false;
       patternPos = 0;
-      lastActivity = now;
-      
-      showUnlockedAnimation();
-      
-      blinkLED(0, 255, 0, 3);
-      setLED(0, 255, 0);  // Green when unlocked
-      Serial.println("Device UNLOCKED!");
-      updateDisplay();
+      unlockDevice();
     }
   } else {
     patternPos = 0;
@@ -985,6 +1296,303 @@ void checkUnlock(bool isLongPress) {
   }
 }
 
+void unlockDevice() {
+  deviceLocked = false;
+  lastActivity = millis();
+  
+  showUnlockedAnimation();
+  
+  blinkLED(0, 255, 0, 3);
+  setLED(0, 255, 0);  // Green when unlocked
+  Serial.println("Device UNLOCKED!");
+  
+  // Macros could not be read while the keys were locked
+  if (MacroTable::getInstance().count() == 0 && (sdCardAvailable || MacroStore::getInstance().exists())) {
+    loadMacros();
+  }
+  updateDisplay();
+}
+
+unsigned long unlockWaitMs() {
+  unsigned long retryAt = unlockRetryAt;
+  long left = (long)(retryAt - millis());
+  return retryAt != 0 && left > 0 ? left : 0;
+}
+
+// Counts wrong secrets and sets the wait before the next try
+bool tryUnlock(const uint8_t* secret, size_t len) {
+  unsigned long wait = unlockWaitMs();
+  if (wait > 0) {
+    Serial.println("Too many wrong secrets, next try in " + String((wait + 999) / 1000) + " s");
+    return false;
+  }
+  if (CryptoManager::getInstance().unlock(secret, len)) {
+    unlockFailures = 0;
+    unlockRetryAt = 0;
+    return true;
+  }
+  
+  unlockFailures++;
+  if (unlockFailures >= unlockFreeAttempts) {
+    int doublings = unlockFailures - unlockFreeAttempts;
+    wait = doublings < 16 ? unlockBackoffBase << doublings : unlockBackoffMax;
+    if (wait > unlockBackoffMax) {
+      wait = unlockBackoffMax;
+    }
+    unlockRetryAt = millis() + wait;
+    Serial.println("Next try in " + String(wait / 1000) + " s");
+  }
+  return false;
+}
+
+// Secrets are tried here, from /api/unlock or once the presses stop; the
+// KDF takes about CRYPTO_UNLOCK_BUDGET_MS
+void servicePatternEntry() {
+  if (webUnlockRequested) {
+    bool ok = tryUnlock((const uint8_t*)webSecret, webSecretLen);
+    memset(webSecret, 0, sizeof(webSecret));
+    webSecretLen = 0;
+    webUnlockRequested = false;
+    if (ok) {
+      memset(patternEntry, 0, sizeof(patternEntry));
+      patternLen = 0;
+      if (deviceLocked) {
+        unlockDevice();
+      }
+    }
+  }
+  if (patternLen == 0 || millis() - lastPatternPress < patternSubmitDelay) {
+    return;
+  }
+  
+  bool ok = tryUnlock((const uint8_t*)patternEntry, patternLen);
+  memset(patternEntry, 0, sizeof(patternEntry));
+  patternLen = 0;
+  if (ok) {
+    unlockDevice();
+  } else {
+    blinkLED(255, 0, 0, 2);
+    setLED(255, 0, 0);  // Red when locked
+  }
+}
+
+// Per-request state of a streamed /api/inject body (malloc'd, the request
+// frees it with free() if the connection drops)
+struct InjectStreamState {
+  uint32_t jobId;
+  size_t received;
+  bool failed;
+};
+
+// Typed bytes of a streamed body, acked on the injection task so the
+// sender can send as many more (see INJECTION_RING_SIZE)
+void ackInjected(size_t bytes, void* ctx) {
+  ((AsyncClient*)ctx)->ack(bytes);
+}
+
+// Per-request state of a chunked /api/macros/list response
+struct MacroListStream {
+  size_t next = 0;
+  bool started = false;
+  bool done = false;
+  String pending;
+  size_t pendingPos = 0;
+};
+
+// Quoted JSON string; bytes are passed through apart from escapes
+String jsonString(const char* text, size_t len) {
+  String out;
+  out.reserve(len + 2);
+  out += '"';
+  for (size_t i = 0; i < len; i++) {
+    char c = text[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else if (c == '\t') {
+      out += "\\t";
+    } else if ((uint8_t)c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (uint8_t)c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+  return out;
+}
+
+// One stored macro as a JSON object, without its content
+String macroJson(size_t i) {
+  MacroTable& table = MacroTable::getInstance();
+  return "{\"id\":" + String(table.id(i)) +
+         ",\"version\":" + String(table.version(i)) +
+         ",\"name\":" + jsonString(table.name(i), table.nameLength(i)) +
+         ",\"sensitive\":" + String(table.isSensitive(i) ? "true" : "false") +
+         ",\"layout\":\"" + keyboardLayoutName(table.layout(i)) + "\"" +
+         ",\"length\":" + String((unsigned long)table.contentLength(i)) + "}";
+}
+
+size_t readMacroList(MacroListStream& list, uint8_t* buffer, size_t maxLen) {
+  MacroTableLock guard;
+  MacroTable& table = MacroTable::getInstance();
+  size_t written = 0;
+  
+  while (written < maxLen) {
+    if (list.pendingPos >= list.pending.length()) {
+      if (list.done) {
+        break;
+      }
+      list.pendingPos = 0;
+      list.pending = list.started ? "" : "[";
+      while (list.next < table.count() && !table.isStored(list.next)) {
+        list.next++;
+      }
+      if (list.next < table.count()) {
+        if (list.started) {
+          list.pending += ",";
+        }
+        list.pending += macroJson(list.next++);
+        list.started = true;
+      } else {
+        list.pending += "]";
+        list.done = true;
+      }
+    }
+    size_t chunk = min(list.pending.length() - list.pendingPos, maxLen - written);
+    memcpy(buffer + written, list.pending.c_str() + list.pendingPos, chunk);
+    list.pendingPos += chunk;
+    written += chunk;
+  }
+  return written;
+}
+
+// Macro id from /api/macros/{id}, 0 if there is none
+uint32_t macroIdFromUrl(AsyncWebServerRequest *request) {
+  const String& url = request->url();
+  const size_t prefix = strlen("/api/macros/");
+  if (url.length() <= prefix || url.length() > prefix + 9) {
+    return 0;
+  }
+  for (size_t i = prefix; i < url.length(); i++) {
+    if (!isdigit((uint8_t)url[i])) {
+      return 0;
+    }
+  }
+  return url.substring(prefix).toInt();
+}
+
+// ETags are the macro's version, which is never reused
+String macroETag(uint32_t version) {
+  return "\"" + String(version) + "\"";
+}
+
+// Version an If-Match header asks for; 0 (no check) when absent or "*"
+uint32_t ifMatchVersion(AsyncWebServerRequest *request) {
+  if (!request->hasHeader("If-Match")) {
+    return 0;
+  }
+  String value = request->getHeader("If-Match")->value();
+  value.replace("W/", "");
+  value.replace("\"", "");
+  value.trim();
+  if (value == "*") {
+    return 0;
+  }
+  // An unparsable tag matches nothing
+  uint32_t version = value.toInt();
+  return version ? version : UINT32_MAX;
+}
+
+// Keep the display on the same macro after the table was rebuilt
+void keepCurrentMacro(uint32_t id) {
+  MacroTable& table = MacroTable::getInstance();
+  int found = table.find(id);
+  if (found >= 0) {
+    currentMacro = found;
+  } else if (currentMacro >= (int)table.count()) {
+    currentMacro = 0;
+  }
+}
+
+// PUT /api/macros/{id} and POST /api/macros/new (id 0): form fields name,
+// content, optional sensitive and layout
+// The store lock keeps the table still while the record is written; the
+// table itself is only locked for the moment the entry is patched
+void handleMacroPut(AsyncWebServerRequest *request, uint32_t id) {
+  MacroStoreLock guard;
+  MacroTable& table = MacroTable::getInstance();
+  MacroStore& store = MacroStore::getInstance();
+  
+  if (!sdCardAvailable) {
+    request->send(503, "text/plain", "SD card not available");
+    return;
+  }
+  if (!request->hasParam("name", true) || !request->hasParam("content", true)) {
+    request->send(400, "text/plain", "Missing name or content");
+    return;
+  }
+  String name = request->getParam("name", true)->value();
+  String content = request->getParam("content", true)->value();
+  name.trim();
+  if (!MacroStore::validName(name.c_str(), name.length())) {
+    request->send(400, "text/plain", "Invalid macro name");
+    return;
+  }
+  
+  int existing = id ? table.find(id) : -1;
+  KeyboardLayoutId layout = existing >= 0 ? table.layout(existing) : macroLayout;
+  if (request->hasParam("layout", true)) {
+    String layoutName = request->getParam("layout", true)->value();
+    if (layoutName.length() > 0 && !keyboardLayoutFromName(layoutName.c_str(), layout)) {
+      request->send(400, "text/plain", "Unknown layout");
+      return;
+    }
+  }
+  
+  MacroRecord macro;
+  macro.name = name.c_str();
+  macro.nameLen = name.length();
+  macro.content = content.c_str();
+  macro.contentLen = content.length();
+  macro.sensitive = request->hasParam("sensitive", true) &&
+                    request->getParam("sensitive", true)->value() != "0";
+  macro.layout = layout;
+  
+  // A fresh card gets an empty container to append to
+  if (!store.exists()) {
+    if (!saveMacrosToSD("")) {
+      request->send(500, "text/plain", "Failed to create macro store");
+      return;
+    }
+    loadMacros();
+  }
+  
+  uint32_t currentId = currentMacro < (int)table.count() ? table.id(currentMacro) : 0;
+  uint32_t newId = 0, version = 0;
+  MacroChangeResult result = store.put(id, macro, ifMatchVersion(request), table, macroLayout,
+                                       newId, version);
+  
+  if (result == MACRO_CHANGE_NOT_FOUND) {
+    request->send(404, "text/plain", "No such macro");
+  } else if (result == MACRO_CHANGE_CONFLICT) {
+    request->send(412, "text/plain", "Macro was changed");
+  } else if (result != MACRO_CHANGE_OK) {
+    macroReloadRequested = true;
+    request->send(500, "text/plain", "Failed to save macro");
+  } else {
+    keepCurrentMacro(currentId);
+    Serial.println("Macro " + String(newId) + " saved (version " + String(version) + ")");
+    AsyncWebServerResponse *response = request->beginResponse(id ? 200 : 201, "application/json",
+      "{\"id\":" + String(newId) + ",\"version\":" + String(version) + "}");
+    response->addHeader("ETag", macroETag(version));
+    request->send(response);
+  }
+}
+
 void initWiFi() {
   Serial.println("Starting WiFi AP...");
   
@@ -1009,9 +1617,12 @@ void initWiFi() {
     Serial.println("GET /test request received");
     String response = "Server is running!\n";
     response += "SD Card Available: " + String(sdCardAvailable ? "Yes" : "No") + "\n";
-    response += "Number of macros loaded: " + String(macros.size()) + "\n";
-    if (macros.size() > 0) {
-      response += "First macro: " + macroNames[0] + "\n";
+    response += "Macros read from: " + String(MacroStore::getInstance().readsFromFlash() ? "flash" : "SD") + "\n";
+    MacroTableLock guard;
+    MacroTable& table = MacroTable::getInstance();
+    response += "Number of macros loaded: " + String(table.count()) + "\n";
+    if (table.count() > 0) {
+      response += "First macro: " + String(table.name(0)) + "\n";
     }
     request->send(200, "text/plain", response);
   });
@@ -1029,6 +1640,86 @@ void initWiFi() {
     request->send(200, "text/html", index_html);
   });
   
+  // Per-macro endpoints, registered before /api/macros (which matches subpaths).
+  // Each macro carries a version, sent as its ETag; PUT and DELETE take it
+  // back in If-Match so a stale edit is refused.
+  server->on("/api/macros/list", HTTP_GET, [](AsyncWebServerRequest *request) {
+    std::shared_ptr<MacroListStream> list = std::make_shared<MacroListStream>();
+    request->send(request->beginChunkedResponse("application/json",
+      [list](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return readMacroList(*list, buffer, maxLen);
+      }));
+  });
+  
+  server->on("/api/macros/new", HTTP_POST, [](AsyncWebServerRequest *request) {
+    handleMacroPut(request, 0);
+  });
+  
+  server->on("/api/macros/*", HTTP_GET, [](AsyncWebServerRequest *request) {
+    MacroStoreLock guard;   // Not the table lock: the record is read from SD
+    MacroTable& table = MacroTable::getInstance();
+    int i = table.find(macroIdFromUrl(request));
+    if (i < 0) {
+      request->send(404, "text/plain", "No such macro");
+      return;
+    }
+    
+    String etag = macroETag(table.version(i));
+    if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == etag) {
+      request->send(304);
+      return;
+    }
+    
+    std::vector<uint8_t> content;
+    if (!MacroStore::getInstance().readContent(table.recordOffset(i), table.recordLength(i), content)) {
+      request->send(500, "text/plain", "Failed to decrypt macro");
+      return;
+    }
+    String json = macroJson(i);
+    json.remove(json.length() - 1);
+    json += ",\"content\":" + jsonString((const char*)content.data(), content.size()) + "}";
+    memset(content.data(), 0, content.size());
+    
+    AsyncWebServerResponse *response = request->beginResponse(200, "application/json", json);
+    response->addHeader("ETag", etag);
+    request->send(response);
+  });
+  
+  server->on("/api/macros/*", HTTP_PUT, [](AsyncWebServerRequest *request) {
+    uint32_t id = macroIdFromUrl(request);
+    if (id == 0) {
+      request->send(404, "text/plain", "No such macro");
+      return;
+    }
+    handleMacroPut(request, id);
+  });
+  
+  server->on("/api/macros/*", HTTP_DELETE, [](AsyncWebServerRequest *request) {
+    MacroStoreLock guard;
+    MacroTable& table = MacroTable::getInstance();
+    uint32_t id = macroIdFromUrl(request);
+    if (!sdCardAvailable || id == 0) {
+      request->send(404, "text/plain", "No such macro");
+      return;
+    }
+    
+    uint32_t currentId = currentMacro < (int)table.count() ? table.id(currentMacro) : 0;
+    MacroChangeResult result = MacroStore::getInstance().remove(id, ifMatchVersion(request),
+                                                                table, macroLayout);
+    if (result == MACRO_CHANGE_NOT_FOUND) {
+      request->send(404, "text/plain", "No such macro");
+    } else if (result == MACRO_CHANGE_CONFLICT) {
+      request->send(412, "text/plain", "Macro was changed");
+    } else if (result != MACRO_CHANGE_OK) {
+      macroReloadRequested = true;
+      request->send(500, "text/plain", "Failed to delete macro");
+    } else {
+      keepCurrentMacro(currentId);
+      Serial.println("Macro " + String(id) + " deleted");
+      request->send(204);
+    }
+  });
+  
   // API endpoint to get macros (decrypted)
   server->on("/api/macros", HTTP_GET, [](AsyncWebServerRequest *request) {
     Serial.println("GET /api/macros request received");
@@ -1040,56 +1731,41 @@ void initWiFi() {
     Serial.println("Processing macro request...");
     
     // Check if SD card was initialized successfully
-    if (!sdCardAvailable) {
+    if (!sdCardAvailable && !MacroStore::getInstance().exists()) {
       Serial.println("SD card not available (initialization failed)");
       // Instead of error, return empty template to allow web UI to work
       request->send(200, "text/plain", "# SD Card Error\n# Please check SD card and restart device\n");
       return;
     }
     
-    // Check if encrypted file exists
-    if (SD_MMC.exists("/macros.enc")) {
-      Serial.println("Found encrypted macros file");
-      CryptoManager& crypto = CryptoManager::getInstance();
-      if (!crypto.initialize()) {
-        request->send(500, "text/plain", "Failed to initialize crypto");
-        return;
-      }
-      
-      // Read and decrypt
-      File encFile = SD_MMC.open("/macros.enc", FILE_READ);
-      if (!encFile) {
-        request->send(404, "text/plain", "macros.enc not found");
-        return;
-      }
-      
-      size_t fileSize = encFile.size();
-      std::vector<uint8_t> encData(fileSize);
-      encFile.read(encData.data(), fileSize);
-      encFile.close();
-      
-      std::vector<uint8_t> decrypted;
-      if (!crypto.decryptData(encData.data(), fileSize, decrypted)) {
+    // Stream the container one record at a time
+    if (MacroStore::getInstance().exists()) {
+      std::shared_ptr<MacroExporter> exporter = std::make_shared<MacroExporter>();
+      if (!exporter->begin()) {
         request->send(500, "text/plain", "Failed to decrypt macros");
         return;
       }
-      
-      String content((char*)decrypted.data(), decrypted.size());
-      Serial.println("Sending decrypted content, length: " + String(content.length()));
-      request->send(200, "text/plain", content);
-    } else if (SD_MMC.exists("/macros.txt")) {
-      Serial.println("Found plain text macros file");
-      // Fallback to plain text (migrate on next save)
-      File file = SD_MMC.open("/macros.txt", FILE_READ);
-      if (!file) {
-        Serial.println("Failed to open plain text file");
-        request->send(404, "text/plain", "macros.txt not found");
+      request->send(request->beginChunkedResponse("text/plain",
+        [exporter](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+          return exporter->read(buffer, maxLen);
+        }));
+    } else if (SD_MMC.exists(MACRO_OLD_ENC_PATH) || SD_MMC.exists(MACRO_OLD_TXT_PATH)) {
+      // Not migrated yet; decrypted a block at a time as it is sent
+      std::shared_ptr<MacroFileReader> reader = std::make_shared<MacroFileReader>();
+      if (!reader->begin()) {
+        request->send(500, "text/plain", "Failed to read macros");
         return;
       }
-      String content = file.readString();
-      file.close();
-      Serial.println("Sending plain text content, length: " + String(content.length()));
-      request->send(200, "text/plain", content);
+      auto fill = [reader](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return reader->read(buffer, maxLen);
+      };
+      // An encrypted file with a header says how long it is
+      size_t length;
+      if (reader->length(length)) {
+        request->send(request->beginResponse("text/plain", length, fill));
+      } else {
+        request->send(request->beginChunkedResponse("text/plain", fill));
+      }
     } else {
       Serial.println("No macros file found on SD card");
       // Return empty content instead of 404 to allow creating new macros
@@ -1122,13 +1798,7 @@ void initWiFi() {
         Serial.println("Saving macros, content length: " + String(macroBuffer.length()));
         
         if (macroBuffer.length() > 0 && saveMacrosToSD(macroBuffer)) {
-          // Remove old plain text file if it exists
-          if (SD_MMC.exists("/macros.txt")) {
-            SD_MMC.remove("/macros.txt");
-            Serial.println("Removed old plain text macros file");
-          }
-          
-          loadMacrosFromSD();
+          macroReloadRequested = true;
           request->send(200, "text/plain", "Saved and encrypted successfully");
           Serial.println("Macros saved and encrypted from web UI");
         } else {
@@ -1141,113 +1811,245 @@ void initWiFi() {
     }
   );
   
-  // API endpoint to inject text - simplified approach
+  // Typing speed calibration (runs as a job on the injection task)
+  server->on("/api/pacing/calibrate", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (!usbHidEnabled) {
+      request->send(400, "text/plain", "USB HID not enabled");
+      return;
+    }
+    if (!request->hasParam("host")) {
+      request->send(400, "text/plain", "Missing host");
+      return;
+    }
+    String host = request->getParam("host")->value();
+    if (InjectionTask::getInstance().enqueueCalibration(host) == 0) {
+      request->send(503, "text/plain", "Injection queue full");
+      return;
+    }
+    request->send(202, "text/plain", "Calibration queued");
+  });
+  
+  // Applied by the injection task, so pacing never changes mid-job
+  server->on("/api/pacing/select", HTTP_POST, [](AsyncWebServerRequest *request) {
+    PacingProfile profile;
+    if (!request->hasParam("host") ||
+        !HidCalibrator::getInstance().loadProfile(request->getParam("host")->value(), profile)) {
+      request->send(404, "text/plain", "No such profile");
+      return;
+    }
+    if (InjectionTask::getInstance().enqueueHostSelect(request->getParam("host")->value()) == 0) {
+      request->send(503, "text/plain", "Injection queue full");
+      return;
+    }
+    request->send(202, "text/plain", "Profile selection queued");
+  });
+  
+  server->on("/api/pacing", HTTP_GET, [](AsyncWebServerRequest *request) {
+    HidCalibrator& calibrator = HidCalibrator::getInstance();
+    HidInjector& injector = HidInjector::getInstance();
+    CalibrationResult last = calibrator.lastResult();
+    String json = "{\"active\":\"" + calibrator.activeHost() + "\"" +
+                  ",\"hosts\":\"" + calibrator.knownHosts() + "\"" +
+                  ",\"interval\":" + String(injector.getReportInterval()) +
+                  ",\"maxKeys\":" + String(injector.getMaxKeysPerReport()) +
+                  ",\"lastValid\":" + String(last.valid ? "true" : "false") +
+                  ",\"latency\":" + String(last.echoLatencyUs) +
+                  ",\"lastError\":\"" + last.error + "\"}";
+    request->send(200, "application/json", json);
+  });
+  
+  // Crypto throughput per buffer size; runs from the main loop for a few seconds
+  server->on("/api/crypto/benchmark", HTTP_POST, [](AsyncWebServerRequest *request) {
+    benchmarkRequested = true;
+    request->send(202, "text/plain", "Benchmark queued");
+  });
+  
+  server->on("/api/crypto/benchmark", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (benchmarkReport.length() == 0) {
+      request->send(404, "text/plain", benchmarkRequested ? "Benchmark running" : "No benchmark run yet");
+      return;
+    }
+    request->send(200, "text/plain", benchmarkReport);
+  });
+  
+  // Keys under a secret: unlock with it, set or change it (empty to
+  // remove it; only while unlocked), and the current state. The secret is
+  // tried from the main loop; /api/crypto/status shows the outcome.
+  server->on("/api/unlock", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("secret", true)) {
+      request->send(400, "text/plain", "Missing secret");
+      return;
+    }
+    const String& secret = request->getParam("secret", true)->value();
+    if (secret.length() > CRYPTO_SECRET_MAX) {
+      request->send(400, "text/plain", "Secret too long");
+      return;
+    }
+    if (webUnlockRequested) {
+      request->send(409, "text/plain", "An unlock is already being tried");
+      return;
+    }
+    unsigned long wait = unlockWaitMs();
+    if (wait > 0) {
+      AsyncWebServerResponse *response = request->beginResponse(429, "text/plain", "Too many wrong secrets");
+      response->addHeader("Retry-After", String((wait + 999) / 1000));
+      request->send(response);
+      return;
+    }
+    memcpy(webSecret, secret.c_str(), secret.length());
+    webSecretLen = secret.length();
+    webUnlockRequested = true;
+    request->send(202, "text/plain", "Unlock queued");
+  });
+  
+  server->on("/api/crypto/secret", HTTP_POST, [](AsyncWebServerRequest *request) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    if (!request->hasParam("secret", true)) {
+      request->send(400, "text/plain", "Missing secret");
+      return;
+    }
+    String secret = request->getParam("secret", true)->value();
+    if (secret.length() > CRYPTO_SECRET_MAX) {
+      request->send(400, "text/plain", "Secret too long");
+      return;
+    }
+    if (crypto.isLocked()) {
+      request->send(409, "text/plain", "Unlock first");
+      return;
+    }
+    bool ok = crypto.setSecret((const uint8_t*)secret.c_str(), secret.length());
+    if (ok && secret.length() > 0) {
+      // The reload moves the table off the flash image and erases it
+      macroReloadRequested = true;
+    }
+    request->send(ok ? 200 : 500, "text/plain", ok ? "Secret set" : "Failed to set secret");
+  });
+  
+  server->on("/api/crypto/status", HTTP_GET, [](AsyncWebServerRequest *request) {
+    CryptoManager& crypto = CryptoManager::getInstance();
+    String json = "{\"protected\":" + String(crypto.hasSecret() ? "true" : "false") +
+                  ",\"locked\":" + String(crypto.isLocked() ? "true" : "false") +
+                  ",\"keyVersion\":" + String(crypto.keyVersion()) +
+                  ",\"kdfIterations\":" + String((unsigned long)crypto.kdfIterationCount()) +
+                  ",\"unlockBudgetMs\":" + String(CRYPTO_UNLOCK_BUDGET_MS) +
+                  ",\"unlockPending\":" + String(webUnlockRequested ? "true" : "false") +
+                  ",\"failedUnlocks\":" + String(unlockFailures) +
+                  ",\"unlockWaitMs\":" + String(unlockWaitMs()) + "}";
+    request->send(200, "application/json", json);
+  });
+  
+  // New data key; the macro log is re-encrypted under it while idle. One
+  // rotation at a time, so no data is ever more than one key behind.
+  server->on("/api/crypto/rotate", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (keyRotationRequested || MacroStore::getInstance().needsRekey()) {
+      request->send(409, "text/plain", "Macros are still being re-encrypted under the last key");
+      return;
+    }
+    keyRotationRequested = true;
+    request->send(202, "text/plain", "Key rotation queued");
+  });
+  
+  // Injection progress (registered before /api/inject, which matches subpaths)
+  server->on("/api/inject/status", HTTP_GET, [](AsyncWebServerRequest *request) {
+    InjectionStatus status = InjectionTask::getInstance().getStatus();
+    String json = "{\"busy\":" + String(status.busy ? "true" : "false") +
+                  ",\"job\":" + String(status.jobId) +
+                  ",\"done\":" + String((unsigned long)status.done) +
+                  ",\"total\":" + String((unsigned long)status.total) +
+                  ",\"queued\":" + String(status.queued) +
+                  ",\"cancelled\":" + String(status.lastCancelled ? "true" : "false") + "}";
+    request->send(200, "application/json", json);
+  });
+  
+  server->on("/api/inject/cancel", HTTP_POST, [](AsyncWebServerRequest *request) {
+    InjectionTask::getInstance().cancelAll();
+    request->send(200, "text/plain", "Injection cancelled");
+  });
+  
+  // API endpoint to inject text - streamed: typing starts with the first
+  // chunk, and the rest is held back by TCP flow control while the ring is
+  // full, so this callback never waits on typing
   server->on("/api/inject", HTTP_POST, 
     [](AsyncWebServerRequest *request) {
-      // Response handled in body handler
+      // Whole body has been handed to the injection task (or rejected)
+      InjectStreamState* state = (InjectStreamState*)request->_tempObject;
+      
+      if (!usbHidEnabled) {
+        request->send(400, "text/plain", "USB HID not enabled");
+      } else if (!state) {
+        request->send(400, "text/plain", "No text to inject");
+      } else if (state->jobId == 0) {
+        request->send(503, "text/plain", "Injection busy");
+      } else if (state->failed) {
+        request->send(409, "text/plain", "Injection cancelled after " + String((unsigned long)state->received) + " bytes");
+      } else {
+        Serial.println("=== STREAM COMPLETE (job " + String(state->jobId) + ", " +
+                       String((unsigned long)state->received) + " bytes) ===");
+        request->send(202, "text/plain", "Streamed as job " + String(state->jobId));
+      }
+      
+      if (state) {
+        free(state);
+        request->_tempObject = nullptr;
+      }
     },
     NULL,
     [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
-      // Use request object to store state
-      struct InjectState {
-        String* buffer;
-        bool processed;
-      };
-      
-      InjectState* state = (InjectState*)request->_tempObject;
+      // Use request object to store state (freed by the request if it dies)
+      InjectStreamState* state = (InjectStreamState*)request->_tempObject;
+      InjectionTask& injection = InjectionTask::getInstance();
       
-      // First chunk - initialize state
+      // First chunk - open the stream
       if (index == 0) {
         Serial.println("\n=== NEW INJECTION REQUEST ===");
         Serial.println("Total size: " + String(total) + " bytes");
         
-        // Check USB HID
-        if (!usbHidEnabled) {
-          Serial.println("USB HID not enabled");
-          request->send(400, "text/plain", "USB HID not enabled");
+        if (!usbHidEnabled || state) {
           return;
         }
         
-        // Check size
-        if (total > 10240) {
-          Serial.println("Text too large");
-          request->send(413, "text/plain", "Text too large (max 10KB)");
-          return;
+        KeyboardLayoutId layout = macroLayout;
+        if (request->hasParam("layout") &&
+            !keyboardLayoutFromName(request->getParam("layout")->value().c_str(), layout)) {
+          Serial.println("Unknown layout, using " + String(keyboardLayoutName(macroLayout)));
         }
         
-        // Create new state for this request
-        state = new InjectState();
-        state->buffer = new String();
-        state->buffer->reserve(total);
-        state->processed = false;
+        state = (InjectStreamState*)malloc(sizeof(InjectStreamState));
+        if (!state) {
+          return;
+        }
+        state->jobId = injection.openStream(layout, total, ackInjected, request->client());
+        state->received = 0;
+        state->failed = false;
         request->_tempObject = state;
+        
+        // A dropped connection ends the stream with whatever has arrived
+        uint32_t jobId = state->jobId;
+        request->onDisconnect([jobId]() {
+          InjectionTask::getInstance().closeStream(jobId);
+        });
       }
       
-      // Check if we have state
-      if (!state) {
-        Serial.println("ERROR: No state object");
+      if (!state || state->jobId == 0 || state->failed) {
         return;
       }
       
-      // If already processed, ignore
-      if (state->processed) {
-        Serial.println("Already processed, ignoring");
+      if (!injection.writeStream(state->jobId, data, len)) {
+        // The rest of the body is read and dropped
+        state->failed = true;
+        injection.closeStream(state->jobId);
+        request->client()->ack(SIZE_MAX);
         return;
       }
+      state->received += len;
       
-      // Accumulate data
-      state->buffer->concat((const char*)data, len);
-      Serial.println("Accumulated: " + String(state->buffer->length()) + "/" + String(total));
-      
-      // Check if complete
       if (index + len >= total) {
-        // Mark as processed FIRST
-        state->processed = true;
-        
-        Serial.println("=== ALL DATA RECEIVED ===");
-        
-        // Check for empty
-        if (state->buffer->length() == 0) {
-          Serial.println("Empty text");
-          request->send(400, "text/plain", "No text to inject");
-        } else {
-          // Inject the text ONCE
-          Serial.println("Injecting " + String(state->buffer->length()) + " characters...");
-          
-          for (int i = 0; i < state->buffer->length(); i++) {
-            char c = state->buffer->charAt(i);
-            
-            if (c == '\n') {
-              keyboard.press(KEY_RETURN);
-              delay(50);
-              keyboard.releaseAll();
-            } else if (c == '\t') {
-              keyboard.press(KEY_TAB);
-              delay(50);
-              keyboard.releaseAll();
-            } else if (needsSpecialHandling(c)) {
-              sendSpecialChar(c);
-            } else {
-              keyboard.write(c);
-            }
-            
-            delay(20);
-            
-            // Progress indicator
-            if (i % 100 == 99) {
-              Serial.print(".");
-              yield();
-            }
-          }
-          
-          Serial.println("\n=== INJECTION COMPLETE ===");
-          request->send(200, "text/plain", "Injected successfully");
-        }
-        
-        // Clean up
-        delete state->buffer;
-        delete state;
-        request->_tempObject = nullptr;
+        // Nothing follows, so nothing left to hold back
+        injection.closeStream(state->jobId);
+        request->client()->ack(SIZE_MAX);
+      } else {
+        // Acked by the injection task once typed
+        request->client()->ackLater();
       }
     }
   );
@@ -1265,6 +2067,11 @@ void initWiFi() {
   Serial.println("  / - Main page (auth required)");
   Serial.println("  /api/macros - GET/POST macros");
   Serial.println("  /api/inject - POST text injection");
+  Serial.println("  /api/inject/status - GET injection progress");
+  Serial.println("  /api/inject/cancel - POST abort injection");
+  Serial.println("  /api/pacing - GET typing speed profile");
+  Serial.println("  /api/pacing/calibrate?host= - POST calibrate typing speed");
+  Serial.println("  /api/pacing/select?host= - POST use stored profile");
   
   wifiMode = true;
 }
@@ -1328,30 +2135,41 @@ void setup() {
     blinkLED(0, 255, 0, 1);
   }
 
-  if (sdOK) {
+  // Internal flash keeps a copy of the macro log: loads come from it, and
+  // it stands in for a missing card
+  bool flashOK = FFat.begin(true);
+  if (!flashOK) {
+    Serial.println("FFat mount failed, no flash copy of macros");
+  }
+  MacroStore::getInstance().begin(sdOK, flashOK);
+  MacroImage::getInstance().begin();
+
+  if (sdOK || flashOK) {
     // Initialize crypto system early
     CryptoManager& crypto = CryptoManager::getInstance();
-    if (!crypto.initialize()) {
+    if (crypto.initialize()) {
+      Serial.println("Crypto system initialized");
+    } else if (crypto.isLocked()) {
+      Serial.println("Keys are under a secret: macros are read once unlocked");
+    } else {
       Serial.println("Warning: Crypto system initialization failed");
       Serial.println("Macros will not be encrypted");
-    } else {
-      Serial.println("Crypto system initialized");
     }
     
-    loadMacrosFromSD();
-    if (macros.size() == 0) {
+    loadMacros();
+    if (MacroTable::getInstance().count() == 0 && sdOK && !crypto.isLocked()) {
       createExampleMacros();
-      loadMacrosFromSD();
+      loadMacros();
     }
-  } else {
-    macroNames.push_back("Test1");
-    macros.push_back("Hello world");
-    macroSensitive.push_back(false);
-    macroNames.push_back("Test2");
-    macros.push_back("admin\tpassword123\n");
-    macroSensitive.push_back(true);
   }
-  Serial.println("Macros: " + String(macros.size()));
+  if (!sdOK && MacroTable::getInstance().count() == 0) {
+    MacroStoreLock guard;
+    MacroTable::getInstance().beginBuild();
+    addMacro("Test1", 5, "Hello world", 11, false, macroLayout);
+    addMacro("Test2", 5, "admin\tpassword123\n", 18, true, macroLayout);
+    MacroTable::getInstance().commit();
+  }
+  Serial.println("Macros: " + String(MacroTable::getInstance().count()));
 
   pinMode(0, INPUT_PULLUP);
   delay(100);
@@ -1367,6 +2185,9 @@ void setup() {
     Serial.println("USB HID MODE");
     USB.begin();
     keyboard.begin();
+    HidInjector::getInstance().begin(&keyboard);
+    InjectionTask::getInstance().begin();
+    HidCalibrator::getInstance().begin(&keyboard);
     delay(2000);
     usbHidEnabled = true;
     setLED(255, 0, 0);  // Red when locked
@@ -1381,14 +2202,22 @@ void setup() {
 }
 
 void loop() {
-  if (!deviceLocked && !wifiMode && usbHidEnabled && millis() - lastActivity > autoLockTime) {
+  if (!deviceLocked && !wifiMode && usbHidEnabled && millis() - lastActivity > autoLockTime &&
+      !InjectionTask::getInstance().isBusy()) {
     deviceLocked = true;
+    CryptoManager::getInstance().lock();
     setLED(255, 0, 0);  // Red when locked
     Serial.println("*** AUTO-LOCKED ***");
     updateDisplay();
   }
   
   handleSingleButton();
+  serviceInjection();
+  serviceCompaction();
+  serviceBenchmark();
+  serviceKeyRotation();
+  serviceMacroReload();
+  servicePatternEntry();
   delay(50);
 }
 
@@ -1488,193 +2317,117 @@ bool initializeSD() {
   return true;
 }
 
-// Helper function to save macros content (encrypted)
-bool saveMacrosToSD(const String& content) {
-  CryptoManager& crypto = CryptoManager::getInstance();
-  if (!crypto.initialize()) {
-    Serial.println("Failed to initialize crypto system");
-    return false;
+// Files from older firmware are superseded by the container
+void removeOldMacroFiles() {
+  if (SD_MMC.exists(MACRO_OLD_ENC_PATH)) {
+    SD_MMC.remove(MACRO_OLD_ENC_PATH);
   }
-  
-  // Encrypt the content
-  std::vector<uint8_t> encrypted;
-  if (!crypto.encryptData((const uint8_t*)content.c_str(), content.length(), encrypted)) {
-    Serial.println("Failed to encrypt macros");
-    return false;
+  if (SD_MMC.exists(MACRO_OLD_TXT_PATH)) {
+    SD_MMC.remove(MACRO_OLD_TXT_PATH);
+    Serial.println("Removed old plain text macros file");
   }
-  
-  // Write encrypted data to file
-  fs::File file = SD_MMC.open("/macros.enc", FILE_WRITE);
-  if (!file) {
-    Serial.println("Failed to create encrypted macros file");
+}
+
+// Helper function to save macros content (encrypted)
+bool saveMacrosToSD(const String& content) {
+  if (!MacroStore::getInstance().save(content.c_str(), content.length())) {
     return false;
   }
-  
-  size_t written = file.write(encrypted.data(), encrypted.size());
-  file.close();
-  
-  return (written == encrypted.size());
+  removeOldMacroFiles();
+  return true;
 }
 
-void loadMacrosFromSD() {
-  macros.clear();
-  macroNames.clear();
-  macroSensitive.clear();
-  
-  Serial.println("Loading macros from SD...");
-  
-  if (!sdCardAvailable) {
-    Serial.println("SD card not available, cannot load macros");
+// Store a macro and compile its keystrokes once, so injection only streams them
+void addMacro(const char* name, size_t nameLen, const char* content, size_t contentLen,
+              bool isSensitive, KeyboardLayoutId layout) {
+  size_t untypeable = 0;
+  if (!MacroTable::getInstance().add(name, nameLen, content, contentLen, isSensitive,
+                                     layout, &untypeable)) {
+    Serial.println("  Out of memory, macro skipped");
     return;
   }
-  
-  // Check what files exist
-  bool hasEncrypted = SD_MMC.exists("/macros.enc");
-  bool hasPlainText = SD_MMC.exists("/macros.txt");
-  
-  Serial.println("Has encrypted file: " + String(hasEncrypted));
-  Serial.println("Has plain text file: " + String(hasPlainText));
-  
-  if (!hasEncrypted && !hasPlainText) {
-    Serial.println("No macros file found");
-    return;
+  if (untypeable > 0) {
+    Serial.println("  WARNING: " + String(name, nameLen) + " has " + String((unsigned long)untypeable) +
+                   " characters that cannot be typed on " + keyboardLayoutName(layout));
   }
-  
-  String fileContent;
-  
-  if (hasEncrypted) {
-    Serial.println("Loading encrypted macros...");
-    // Decrypt the file to memory
-    CryptoManager& crypto = CryptoManager::getInstance();
-    if (!crypto.initialize()) {
-      Serial.println("Failed to initialize crypto system");
-      return;
-    }
-    
-    // Read encrypted file
-    fs::File encFile = SD_MMC.open("/macros.enc", FILE_READ);
-    if (!encFile) {
-      Serial.println("Failed to open encrypted file");
-      return;
-    }
-    
-    size_t fileSize = encFile.size();
-    Serial.println("Encrypted file size: " + String(fileSize));
-    
-    std::vector<uint8_t> encData(fileSize);
-    size_t bytesRead = encFile.read(encData.data(), fileSize);
-    encFile.close();
-    
-    if (bytesRead != fileSize) {
-      Serial.println("Failed to read entire encrypted file");
-      return;
-    }
-    
-    // Decrypt data
-    std::vector<uint8_t> decrypted;
-    if (!crypto.decryptData(encData.data(), fileSize, decrypted)) {
-      Serial.println("Failed to decrypt macros file");
-      return;
-    }
-    
-    Serial.println("Decrypted size: " + String(decrypted.size()));
-    
-    // Convert to String
-    fileContent = String((char*)decrypted.data(), decrypted.size());
-  } else if (hasPlainText) {
-    Serial.println("Loading plain text macros for migration...");
-    // Read plain text file (for backward compatibility)
-    fs::File file = SD_MMC.open("/macros.txt", FILE_READ);
-    if (!file) {
-      Serial.println("Failed to open plain text file");
+}
+
+// Convert /macros.enc or /macros.txt from older firmware into the container.
+// The file is decrypted and parsed a block at a time, never held whole.
+void migrateMacroFile() {
+  bool migrated;
+  {
+    // The one place a headerless /macros.enc from older firmware is read
+    MacroFileReader reader;
+    if (!reader.begin(true)) {
       return;
     }
-    
-    fileContent = file.readString();
-    file.close();
-    
-    Serial.println("Plain text content length: " + String(fileContent.length()));
-    
-    // Migrate to encrypted format
-    Serial.println("Migrating to encrypted format...");
-    if (saveMacrosToSD(fileContent)) {
-      Serial.println("Migration successful, removing plain text file...");
-      // Delete the plain text file after successful migration
-      if (SD_MMC.remove("/macros.txt")) {
-        Serial.println("Plain text file removed successfully");
-      } else {
-        Serial.println("Failed to remove plain text file");
-      }
-    } else {
-      Serial.println("Migration failed, keeping plain text file");
-    }
+    Serial.println("Migrating macros to " MACRO_DB_PATH "...");
+    migrated = MacroStore::getInstance().save(MacroFileReader::readText, &reader);
   }
   
-  // Parse the content line by line
-  Serial.println("Parsing file content, total length: " + String(fileContent.length()));
-  
-  int startIdx = 0;
-  int endIdx = fileContent.indexOf('\n');
-  int lineCount = 0;
+  if (migrated) {
+    removeOldMacroFiles();
+  } else {
+    Serial.println("Migration failed, keeping old macros file");
+  }
+}
+
+// Also called from the web task for a fresh card; the lock keeps the
+// build from interleaving with another one, or with the store's own
+void loadMacros() {
+  MacroStoreLock guard;
+  MacroTable& table = MacroTable::getInstance();
+  macroLayout = LAYOUT_DEFAULT;
+  
+  Serial.println("Loading macros...");
+  
+  MacroStore& store = MacroStore::getInstance();
+  if (sdCardAvailable && !store.exists()) {
+    migrateMacroFile();
+  }
   
-  while (endIdx != -1 || startIdx < fileContent.length()) {
-    String line;
-    if (endIdx != -1) {
-      line = fileContent.substring(startIdx, endIdx);
-      startIdx = endIdx + 1;
-      endIdx = fileContent.indexOf('\n', startIdx);
-    } else {
-      line = fileContent.substring(startIdx);
-      startIdx = fileContent.length();
+  // No image while the keys are under a secret (see macro_image.h)
+  bool secret = CryptoManager::getInstance().hasSecret();
+  if (store.exists() && !secret && MacroImage::getInstance().load(table, macroLayout)) {
+    // Nothing to read: the table is used where it is in flash
+    Serial.println("Macros mapped from flash image");
+  } else {
+    // The current table stays usable until the new one is committed
+    table.beginBuild();
+    // Only the index is decrypted; contents are read when typed
+    if (store.exists() && store.load(table, macroLayout)) {
+      Serial.println("Keyboard layout: " + String(keyboardLayoutName(macroLayout)));
     }
-    
-    line.trim();
-    lineCount++;
-    
-    if (line.length() > 0 && !line.startsWith("#")) {
-      bool isSensitive = false;
-      if (line.startsWith("SENSITIVE:")) {
-        isSensitive = true;
-        line = line.substring(10);
-        Serial.println("Found SENSITIVE macro in line");
-      }
-      
-      int colonPos = line.indexOf(':');
-      if (colonPos > 0) {
-        String name = line.substring(0, colonPos);
-        String content = line.substring(colonPos + 1);
-        
-        content.replace("\\n", "\n");
-        content.replace("\\t", "\t");
-        content.replace("\\\\", "\\");
-        
-        macroNames.push_back(name);
-        macros.push_back(content);
-        macroSensitive.push_back(isSensitive);
-        
-        if (isSensitive) {
-          Serial.println("  → Name: " + name + " (SENSITIVE)");
-        } else {
-          Serial.println("  → Name: " + name);
-        }
-      }
+    table.commit();
+    // The table is in RAM now, so the image can go
+    if (secret) {
+      MacroImage::getInstance().erase();
     }
   }
-  
-  int sensitiveCount = 0;
-  for (bool s : macroSensitive) {
-    if (s) sensitiveCount++;
+  if (!sdCardAvailable && table.count() > 0) {
+    Serial.println("SD card not available, using the flash copy (read-only)");
+  }
+  if (currentMacro >= (int)table.count()) {
+    currentMacro = 0;
   }
   
-  Serial.println("Processed " + String(lineCount) + " lines");
-  Serial.println("Loaded " + String(macros.size()) + " macros (" + 
-                 String(sensitiveCount) + " sensitive)");
+  size_t sensitiveCount = 0;
+  for (size_t i = 0; i < table.count(); i++) {
+    if (table.isSensitive(i)) sensitiveCount++;
+  }
+  Serial.println("Loaded " + String(table.count()) + " macros (" + 
+                 String((unsigned long)sensitiveCount) + " sensitive, " +
+                 String(table.arenaSize()) + (table.isAttached() ? " bytes in flash)" : " bytes)"));
   
   // Debug: print first macro if available
-  if (macros.size() > 0) {
-    Serial.println("First macro name: " + macroNames[0]);
-    int previewLen = macros[0].length() > 20 ? 20 : macros[0].length();
-    Serial.println("First macro preview: " + macros[0].substring(0, previewLen) + "...");
+  if (table.count() > 0) {
+    Serial.println("First macro name: " + String(table.name(0)));
+    if (!table.isSensitive(0)) {
+      // Stored macros only keep a short preview
+      size_t previewLen = strnlen(table.content(0), 20);
+      Serial.println("First macro preview: " + String(table.content(0), previewLen) + "...");
+    }
   }
 }
 
@@ -1688,6 +2441,9 @@ void createExampleMacros() {
   content += "#   \\n = Enter key\n";
   content += "#   \\t = Tab key\n";
   content += "#\n";
+  content += "# Host keyboard layout (US, PL, DE, FR, UK):\n";
+  content += "#!LAYOUT:PL\n";
+  content += "#\n";
   content += "\n";
   content += "# Regular macros\n";
   content += "Email:user@example.com\n";
@@ -1715,10 +2471,11 @@ void handleSingleButton() {
     // Single click timeout - execute single click action
     waitingForDoubleClick = false;
     
-    if (!wifiMode && !deviceLocked && macros.size() > 0) {
+    size_t macroCount = MacroTable::getInstance().count();
+    if (!wifiMode && !deviceLocked && macroCount > 0) {
       // Execute single click: next macro
       lastActivity = currentTime;
-      currentMacro = (currentMacro + 1) % macros.size();
+      currentMacro = (currentMacro + 1) % macroCount;
       blinkLED(0, 0, 255, 1);
       setLED(0, 255, 0);  // Green when unlocked
       updateDisplay();
@@ -1728,7 +2485,13 @@ void handleSingleButton() {
   if (currentState != lastButtonState) {
     if (currentTime - lastDebounceTime > debounceDelay) {
       
-      if (currentState == LOW) {
+      if (currentState == LOW && InjectionTask::getInstance().isBusy()) {
+        // Any press while typing aborts the injection and is otherwise ignored
+        InjectionTask::getInstance().cancelAll();
+        buttonPressed = false;
+        waitingForDoubleClick = false;
+        lastActivity = currentTime;
+      } else if (currentState == LOW) {
         buttonPressed = true;
         buttonPressTime = currentTime;
         longPressDetected = false;
@@ -1751,7 +2514,7 @@ void handleSingleButton() {
             } else if (deviceLocked) {
               checkUnlock(true);
             } else {
-              if (macros.size() > 0) {
+              if (MacroTable::getInstance().count() > 0) {
                 lastActivity = currentTime;
                 injectMacro();
               }
@@ -1767,9 +2530,10 @@ void handleSingleButton() {
               if (waitingForDoubleClick && (currentTime - lastClickTime <= doubleClickWindow)) {
                 // DOUBLE CLICK DETECTED - Previous macro
                 waitingForDoubleClick = false;
-                if (macros.size() > 0) {
+                size_t macroCount = MacroTable::getInstance().count();
+                if (macroCount > 0) {
                   lastActivity = currentTime;
-                  currentMacro = (currentMacro - 1 + macros.size()) % macros.size();
+                  currentMacro = (currentMacro - 1 + macroCount) % macroCount;
                   blinkLED(0, 255, 255, 2);  // Cyan blink for backward
                   setLED(0, 255, 0);  // Green when unlocked
                   updateDisplay();
@@ -1807,7 +2571,13 @@ void handleSingleButton() {
 }
 
 void injectMacro() {
-  String macro = macros[currentMacro];
+  // Held while the keystrokes or the record are copied out for the task;
+  // the store lock, as a stored macro is read from SD
+  MacroStoreLock guard;
+  MacroTable& table = MacroTable::getInstance();
+  if (currentMacro >= (int)table.count()) {
+    return;
+  }
   setLED(255, 0, 255);  // Magenta during injection
 
   if (!usbHidEnabled) {
@@ -1817,30 +2587,75 @@ void injectMacro() {
     return;
   }
 
-  Serial.println("Injecting: " + macroNames[currentMacro]);
+  Serial.println("Injecting: " + String(table.name(currentMacro)));
 
-  for (int i = 0; i < macro.length(); i++) {
-    char c = macro.charAt(i);
-    
-    if (c == '\n') {
-      keyboard.press(KEY_RETURN);
-      delay(50);
-      keyboard.releaseAll();
-    } else if (c == '\t') {
-      keyboard.press(KEY_TAB);
-      delay(50);
-      keyboard.releaseAll();
-    } else if (needsSpecialHandling(c)) {
-      sendSpecialChar(c);
-    } else {
-      keyboard.write(c);
+  // Typing happens on the injection task; serviceInjection() reports the end
+  uint32_t jobId = 0;
+  if (table.strokeCount(currentMacro) > 0) {
+    // Compiled in RAM, or in the flash image
+    jobId = InjectionTask::getInstance().enqueueKeyStrokes(table.strokes(currentMacro),
+                                                           table.strokeCount(currentMacro));
+  } else if (table.isStored(currentMacro)) {
+    // Decrypt just this record; the task compiles it as it types
+    std::vector<uint8_t> content;
+    if (MacroStore::getInstance().readContent(table.recordOffset(currentMacro),
+                                              table.recordLength(currentMacro), content) &&
+        !content.empty()) {
+      jobId = InjectionTask::getInstance().enqueueText((const char*)content.data(), content.size(),
+                                                       table.layout(currentMacro));
+      memset(content.data(), 0, content.size());
     }
-    delay(50);
   }
+  if (jobId == 0) {
+    Serial.println("Nothing queued (empty macro or queue full)");
+    blinkLED(255, 255, 0, 3);
+    setLED(0, 255, 0);  // Green when unlocked
+  }
+}
 
-  blinkLED(0, 255, 0, 2);
-  setLED(0, 255, 0);  // Green when unlocked
-  Serial.println("Injection completed");
+// LED feedback when the injection task finishes a job
+void serviceInjection() {
+  InjectionTask& injection = InjectionTask::getInstance();
+  InjectionStatus status = injection.getStatus();
+  
+  if (status.busy || status.queued > 0) {
+    lastActivity = millis();  // Don't auto-lock in the middle of typing
+  }
+  
+  if (status.finished == lastFinishedInjection || injection.isBusy()) {
+    return;
+  }
+  lastFinishedInjection = status.finished;
+  
+  if (status.lastCancelled) {
+    Serial.println("Injection cancelled at " + String((unsigned long)status.done) + "/" +
+                   String((unsigned long)status.total));
+    blinkLED(255, 255, 0, 2);
+  } else {
+    Serial.println("Injection completed");
+    blinkLED(0, 255, 0, 2);
+  }
+  
+  if (wifiMode) {
+    setLED(128, 0, 128); // Purple for WiFi mode
+  } else if (deviceLocked) {
+    setLED(255, 0, 0);  // Red when locked
+  } else {
+    setLED(0, 255, 0);  // Green when unlocked
+  }
+}
+
+// One bounded step of macro log compaction, or of rewriting the flash image
+// once the log is compact, while nothing else is going on
+void serviceCompaction() {
+  if (!sdCardAvailable || InjectionTask::getInstance().isBusy() || CryptoManager::getInstance().isLocked() ||
+      millis() - lastActivity < compactIdleTime) {
+    return;
+  }
+  MacroTable& table = MacroTable::getInstance();
+  if (!MacroStore::getInstance().compactStep(table, macroLayout)) {
+    MacroImage::getInstance().updateStep(table, macroLayout);
+  }
 }
 
 void updateDisplay() {
@@ -1904,28 +2719,34 @@ void updateDisplay() {
   // Separator
   display.fillRect(10, 55, LCD_WIDTH - 20, 2, COLOR_SELECT);
   
-  if (macros.size() > 0) {
+  MacroTableLock guard;
+  MacroTable& table = MacroTable::getInstance();
+  if (currentMacro >= (int)table.count()) {
+    currentMacro = 0;  // The table was replaced from the web
+  }
+  if (table.count() > 0) {
     display.setTextSize(2);
     display.setCursor(10, 75);
     display.setTextColor(COLOR_SELECT);
     display.print("Macro ");
     display.print(currentMacro + 1);
     display.print("/");
-    display.println(macros.size());
+    display.println(table.count());
     
     display.setTextSize(3);
     display.setCursor(10, 110);
     
-    if (macroSensitive[currentMacro]) {
+    if (table.isSensitive(currentMacro)) {
       display.setTextColor(COLOR_WARN);
       display.print("[S] ");
     } else {
       display.setTextColor(COLOR_TEXT);
     }
     
-    String displayName = macroNames[currentMacro];
-    if (displayName.length() > 9) {
-      displayName = displayName.substring(0, 9) + "...";
+    String displayName = String(table.name(currentMacro),
+                                min(table.nameLength(currentMacro), (size_t)9));
+    if (table.nameLength(currentMacro) > 9) {
+      displayName += "...";
     }
     display.println(displayName);
     
@@ -1934,19 +2755,21 @@ void updateDisplay() {
     display.setTextColor(0x7BEF);
     
     String preview;
-    if (macroSensitive[currentMacro]) {
-      int contentLength = macros[currentMacro].length();
+    if (table.isSensitive(currentMacro)) {
+      int contentLength = table.contentLength(currentMacro);
       if (contentLength > 20) contentLength = 20;
       preview = "";
       for (int i = 0; i < contentLength; i++) {
         preview += "*";
       }
     } else {
-      preview = macros[currentMacro];
+      // Copy only what fits on screen
+      size_t previewLen = min(table.contentLength(currentMacro), (size_t)15);
+      preview = String(table.content(currentMacro), previewLen);
       preview.replace("\n", " ");
       preview.replace("\t", " ");
-      if (preview.length() > 15) {
-        preview = preview.substring(0, 15) + "...";
+      if (table.contentLength(currentMacro) > 15) {
+        preview += "...";
       }
     }
     display.println(preview);
@@ -1967,3 +2790,37 @@ void updateDisplay() {
     display.println("PROG Mode");
   }
 }
+
+// Not while typing: it would hold up the AES and SHA peripherals
+void serviceBenchmark() {
+  if (!benchmarkRequested || InjectionTask::getInstance().isBusy()) {
+    return;
+  }
+  
+  Serial.println("Running crypto benchmark...");
+  String report = CryptoManager::getInstance().benchmark();
+  Serial.print(report);
+  benchmarkReport = report;
+  benchmarkRequested = false;
+}
+
+void serviceMacroReload() {
+  if (!macroReloadRequested) {
+    return;
+  }
+  macroReloadRequested = false;
+  loadMacros();
+  updateDisplay();
+}
+
+// Not while typing: the injection task may be decrypting a macro
+void serviceKeyRotation() {
+  if (!keyRotationRequested || InjectionTask::getInstance().isBusy()) {
+    return;
+  }
+  
+  if (!MacroStore::getInstance().needsRekey() && !CryptoManager::getInstance().rotateKey()) {
+    Serial.println("Key rotation failed");
+  }
+  keyRotationRequested = false;
+}
@@ -0,0 +1,146 @@
+#include "../include/text_codec.h"
+
+// All tables are built by constexpr builders, so they land in flash and
+// each byte or character costs one lookup
+
+namespace {
+
+const uint8_t INVALID = 0xFF;
+
+struct HexPairs {
+    char pairs[256][2];
+};
+
+struct DecodeTable {
+    uint8_t values[256];
+};
+
+const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+constexpr HexPairs makeHexPairs() {
+    HexPairs table{};
+    const char digits[] = "0123456789ABCDEF";
+    for (int i = 0; i < 256; i++) {
+        table.pairs[i][0] = digits[i >> 4];
+        table.pairs[i][1] = digits[i & 0x0F];
+    }
+    return table;
+}
+
+constexpr DecodeTable makeHexValues() {
+    DecodeTable table{};
+    for (int i = 0; i < 256; i++) {
+        table.values[i] = INVALID;
+    }
+    for (int i = 0; i < 10; i++) {
+        table.values['0' + i] = i;
+    }
+    for (int i = 0; i < 6; i++) {
+        table.values['A' + i] = 10 + i;
+        table.values['a' + i] = 10 + i;
+    }
+    return table;
+}
+
+constexpr DecodeTable makeBase64Values() {
+    DecodeTable table{};
+    for (int i = 0; i < 256; i++) {
+        table.values[i] = INVALID;
+    }
+    for (int i = 0; i < 64; i++) {
+        table.values[(uint8_t)BASE64_ALPHABET[i]] = i;
+    }
+    return table;
+}
+
+constexpr HexPairs hexPairs = makeHexPairs();
+constexpr DecodeTable hexValues = makeHexValues();
+constexpr DecodeTable base64Values = makeBase64Values();
+
+} // namespace
+
+size_t hexEncode(const uint8_t* in, size_t len, char* out) {
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = hexPairs.pairs[in[i]][0];
+        out[2 * i + 1] = hexPairs.pairs[in[i]][1];
+    }
+    return len * 2;
+}
+
+bool hexDecode(const char* in, size_t len, uint8_t* out, size_t& outLen) {
+    outLen = 0;
+    if (len % 2 != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i += 2) {
+        uint8_t high = hexValues.values[(uint8_t)in[i]];
+        uint8_t low = hexValues.values[(uint8_t)in[i + 1]];
+        if ((high | low) == INVALID) {
+            return false;
+        }
+        out[i / 2] = (high << 4) | low;
+    }
+    outLen = len / 2;
+    return true;
+}
+
+size_t base64Encode(const uint8_t* in, size_t len, char* out) {
+    char* p = out;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        uint32_t bits = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | in[i + 2];
+        p[0] = BASE64_ALPHABET[bits >> 18];
+        p[1] = BASE64_ALPHABET[(bits >> 12) & 0x3F];
+        p[2] = BASE64_ALPHABET[(bits >> 6) & 0x3F];
+        p[3] = BASE64_ALPHABET[bits & 0x3F];
+        p += 4;
+    }
+    if (i < len) {
+        uint32_t bits = (uint32_t)in[i] << 16;
+        if (i + 1 < len) {
+            bits |= (uint32_t)in[i + 1] << 8;
+        }
+        p[0] = BASE64_ALPHABET[bits >> 18];
+        p[1] = BASE64_ALPHABET[(bits >> 12) & 0x3F];
+        p[2] = i + 1 < len ? BASE64_ALPHABET[(bits >> 6) & 0x3F] : '=';
+        p[3] = '=';
+        p += 4;
+    }
+    return p - out;
+}
+
+bool base64Decode(const char* in, size_t len, uint8_t* out, size_t& outLen) {
+    outLen = 0;
+    if (len % 4 != 0) {
+        return false;
+    }
+
+    // Up to two = at the very end
+    size_t padding = 0;
+    if (len > 0 && in[len - 1] == '=') {
+        padding = (in[len - 2] == '=') ? 2 : 1;
+    }
+
+    uint8_t* p = out;
+    for (size_t i = 0; i < len; i += 4) {
+        bool last = i + 4 == len;
+        uint8_t a = base64Values.values[(uint8_t)in[i]];
+        uint8_t b = base64Values.values[(uint8_t)in[i + 1]];
+        uint8_t c = (last && padding == 2) ? 0 : base64Values.values[(uint8_t)in[i + 2]];
+        uint8_t d = (last && padding >= 1) ? 0 : base64Values.values[(uint8_t)in[i + 3]];
+        if ((a | b | c | d) == INVALID) {
+            return false;
+        }
+        uint32_t bits = ((uint32_t)a << 18) | ((uint32_t)b << 12) | ((uint32_t)c << 6) | d;
+        p[0] = bits >> 16;
+        if (!last || padding < 2) {
+            p[1] = (bits >> 8) & 0xFF;
+        }
+        if (!last || padding < 1) {
+            p[2] = bits & 0xFF;
+        }
+        p += last ? 3 - padding : 3;
+    }
+    outLen = p - out;
+    return true;
+}
@@ -0,0 +1,18 @@
+// Host-side stand-in for the Arduino core, just enough for the injection
+// code. Time is virtual: it only moves when code delays or the mock
+// keyboard waits for a USB poll.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+namespace mock {
+inline uint64_t nowUs = 0;
+}
+
+inline unsigned long micros() { return (unsigned long)mock::nowUs; }
+inline unsigned long millis() { return (unsigned long)(mock::nowUs / 1000); }
+inline void delayMicroseconds(unsigned int us) { mock::nowUs += us; }
+inline void delay(unsigned long ms) { mock::nowUs += (uint64_t)ms * 1000; }
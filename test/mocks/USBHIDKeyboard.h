@@ -0,0 +1,33 @@
+// Mock of the ESP32 USBHIDKeyboard: records every report with the virtual
+// time at which the host polled it.
+#pragma once
+
+#include "Arduino.h"
+#include <vector>
+
+typedef struct {
+    uint8_t modifiers;
+    uint8_t reserved;
+    uint8_t keys[6];
+} KeyReport;
+
+struct RecordedReport {
+    uint64_t timeUs;
+    KeyReport report;
+};
+
+class USBHIDKeyboard {
+public:
+    // Full-speed interrupt endpoint polled once per millisecond
+    uint32_t pollIntervalUs = 1000;
+    std::vector<RecordedReport> reports;
+
+    void begin() {}
+
+    // Like the real driver, returns once the host has polled the report,
+    // which happens at the next poll frame
+    void sendReport(KeyReport* keys) {
+        mock::nowUs = (mock::nowUs / pollIntervalUs + 1) * pollIntervalUs;
+        reports.push_back({mock::nowUs, *keys});
+    }
+};
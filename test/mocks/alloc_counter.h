@@ -0,0 +1,23 @@
+// Counts heap allocations through a replacement global operator new, for
+// the tests that check how often code allocates. Defines the operators, so
+// include it from one file per test.
+#pragma once
+
+#include <stdlib.h>
+#include <new>
+
+namespace mock {
+inline size_t allocations = 0;
+}
+
+void* operator new(size_t size) {
+    mock::allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
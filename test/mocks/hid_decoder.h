@@ -0,0 +1,75 @@
+// Turns recorded keyboard reports back into text the way a host with the
+// given layout would: a key types when it appears in a report it was not in
+// before, using that report's modifiers. Dead keys combine with the space
+// that follows them.
+#pragma once
+
+#include "USBHIDKeyboard.h"
+#include "keyboard_layouts.h"
+#include <map>
+#include <string>
+
+class HidDecoder {
+public:
+    explicit HidDecoder(KeyboardLayoutId layout) {
+        for (int c = 0; c < 128; c++) {
+            const LayoutKey& key = keyboardLayouts[layout].keys[c];
+            if (key.keycode == 0) {
+                continue;
+            }
+            if (key.deadKeycode != 0) {
+                deadKeys[code(key.deadModifiers, key.deadKeycode)] = (char)c;
+            } else {
+                plainKeys[code(key.modifiers, key.keycode)] = (char)c;
+            }
+        }
+    }
+
+    std::string decode(const std::vector<RecordedReport>& reports) {
+        std::string text;
+        KeyReport previous = {};
+        char pendingDead = 0;
+
+        for (const RecordedReport& recorded : reports) {
+            const KeyReport& report = recorded.report;
+            for (int i = 0; i < 6; i++) {
+                uint8_t keycode = report.keys[i];
+                if (keycode == 0 || held(previous, keycode)) {
+                    continue;
+                }
+                int pressed = code(report.modifiers, keycode);
+
+                if (pendingDead) {
+                    text += (pressed == code(0, SPACE)) ? pendingDead : '?';
+                    pendingDead = 0;
+                } else if (deadKeys.count(pressed)) {
+                    pendingDead = deadKeys[pressed];
+                } else if (plainKeys.count(pressed)) {
+                    text += plainKeys[pressed];
+                } else {
+                    text += '?';
+                }
+            }
+            previous = report;
+        }
+        return text;
+    }
+
+private:
+    static const uint8_t SPACE = 0x2C;
+    std::map<int, char> plainKeys;
+    std::map<int, char> deadKeys;
+
+    static int code(uint8_t modifiers, uint8_t keycode) {
+        return (modifiers << 8) | keycode;
+    }
+
+    static bool held(const KeyReport& report, uint8_t keycode) {
+        for (int i = 0; i < 6; i++) {
+            if (report.keys[i] == keycode) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
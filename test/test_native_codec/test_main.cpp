@@ -0,0 +1,206 @@
+// Host-side tests and benchmark for the hex/base64 codec. The benchmark
+// compares it with the sprintf/strtol hex conversion encryptString and
+// decryptString used before, counting heap allocations through a global
+// operator new.
+//
+//   pio test -e native -f test_native_codec -v
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "alloc_counter.h"
+#include "text_codec.h"
+
+static std::string hex(const std::string& data) {
+    std::string out(hexEncodedLength(data.size()), '\0');
+    hexEncode((const uint8_t*)data.data(), data.size(), &out[0]);
+    return out;
+}
+
+static std::string base64(const std::string& data) {
+    std::string out(base64EncodedLength(data.size()), '\0');
+    TEST_ASSERT_EQUAL(out.size(), base64Encode((const uint8_t*)data.data(), data.size(), &out[0]));
+    return out;
+}
+
+static bool unbase64(const std::string& text, std::string& out) {
+    std::vector<uint8_t> buf(base64DecodedMaxLength(text.size()) + 1);
+    size_t len;
+    bool ok = base64Decode(text.data(), text.size(), buf.data(), len);
+    out.assign((const char*)buf.data(), ok ? len : 0);
+    return ok;
+}
+
+static std::string randomBytes(size_t len, unsigned seed) {
+    std::string data(len, '\0');
+    srand(seed);
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (char)(rand() & 0xFF);
+    }
+    return data;
+}
+
+// The conversions encryptString/decryptString did before, with std::string
+// standing in for Arduino's String
+static std::string legacyHexEncode(const std::vector<uint8_t>& data) {
+    std::string result;
+    result.reserve(data.size() * 2);
+    for (uint8_t byte : data) {
+        char hex[3];
+        sprintf(hex, "%02X", byte);
+        result += hex;
+    }
+    return result;
+}
+
+static std::vector<uint8_t> legacyHexDecode(const std::string& text) {
+    std::vector<uint8_t> out;
+    out.reserve(text.length() / 2);
+    for (size_t i = 0; i < text.length(); i += 2) {
+        std::string byteStr = text.substr(i, 2);
+        out.push_back(strtol(byteStr.c_str(), nullptr, 16));
+    }
+    return out;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_hex_encodes_uppercase() {
+    TEST_ASSERT_EQUAL_STRING("", hex("").c_str());
+    TEST_ASSERT_EQUAL_STRING("00FF7F80", hex(std::string("\x00\xff\x7f\x80", 4)).c_str());
+    TEST_ASSERT_EQUAL_STRING("DEADBEEF", hex("\xde\xad\xbe\xef").c_str());
+}
+
+void test_hex_decodes_either_case_in_place() {
+    char text[] = "deADbeEF01";
+    size_t len;
+    TEST_ASSERT_TRUE(hexDecode(text, 10, (uint8_t*)text, len));
+    TEST_ASSERT_EQUAL(5, len);
+    TEST_ASSERT_EQUAL_MEMORY("\xde\xad\xbe\xef\x01", text, 5);
+}
+
+void test_hex_rejects_bad_input() {
+    uint8_t out[8];
+    size_t len;
+    TEST_ASSERT_FALSE(hexDecode("ABC", 3, out, len));
+    TEST_ASSERT_FALSE(hexDecode("0G", 2, out, len));
+    TEST_ASSERT_FALSE(hexDecode(" 1", 2, out, len));
+    TEST_ASSERT_FALSE(hexDecode("12\xff" "0", 4, out, len));
+}
+
+// RFC 4648 section 10
+void test_base64_rfc_vectors() {
+    const char* plain[] = {"", "f", "fo", "foo", "foob", "fooba", "foobar"};
+    const char* encoded[] = {"", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy"};
+    for (int i = 0; i < 7; i++) {
+        TEST_ASSERT_EQUAL_STRING(encoded[i], base64(plain[i]).c_str());
+        std::string back;
+        TEST_ASSERT_TRUE(unbase64(encoded[i], back));
+        TEST_ASSERT_EQUAL_STRING(plain[i], back.c_str());
+    }
+}
+
+void test_base64_rejects_bad_input() {
+    std::string out;
+    TEST_ASSERT_FALSE(unbase64("Zm9", out));        // Not a multiple of 4
+    TEST_ASSERT_FALSE(unbase64("Zm=v", out));       // Padding in the middle
+    TEST_ASSERT_FALSE(unbase64("Z===", out));
+    TEST_ASSERT_FALSE(unbase64("Zg==Zm9v", out));   // Padding before the end
+    TEST_ASSERT_FALSE(unbase64("Zm9v\nYmFy", out));
+    TEST_ASSERT_FALSE(unbase64("Zm-v", out));       // URL-safe alphabet
+}
+
+void test_round_trips_every_length() {
+    for (size_t len = 0; len < 300; len++) {
+        std::string data = randomBytes(len, len);
+
+        std::string text = hex(data);
+        std::vector<uint8_t> back(len + 1);
+        size_t backLen;
+        TEST_ASSERT_TRUE(hexDecode(text.data(), text.size(), back.data(), backLen));
+        TEST_ASSERT_EQUAL(len, backLen);
+        TEST_ASSERT_EQUAL_MEMORY(data.data(), back.data(), len);
+
+        std::string decoded;
+        TEST_ASSERT_TRUE(unbase64(base64(data), decoded));
+        TEST_ASSERT_TRUE(decoded == data);
+    }
+}
+
+void test_matches_legacy_hex() {
+    std::string data = randomBytes(4096, 1);
+    std::vector<uint8_t> bytes(data.begin(), data.end());
+    std::string legacy = legacyHexEncode(bytes);
+    TEST_ASSERT_TRUE(hex(data) == legacy);
+    TEST_ASSERT_TRUE(legacyHexDecode(legacy) == bytes);
+}
+
+void test_benchmark_64k() {
+    const size_t size = 64 * 1024;
+    const int rounds = 5;
+    std::string data = randomBytes(size, 2);
+    std::vector<uint8_t> bytes(data.begin(), data.end());
+    std::vector<char> text(base64EncodedLength(size) > hexEncodedLength(size) ?
+                           base64EncodedLength(size) : hexEncodedLength(size));
+    std::vector<uint8_t> back(size);
+    double hexEncUs = 0, hexDecUs = 0, b64EncUs = 0, b64DecUs = 0, oldEncUs = 0, oldDecUs = 0;
+    size_t codecAllocs = 0, oldAllocs = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        size_t len;
+        size_t before = mock::allocations;
+        auto t0 = std::chrono::steady_clock::now();
+        size_t textLen = hexEncode(bytes.data(), size, text.data());
+        auto t1 = std::chrono::steady_clock::now();
+        TEST_ASSERT_TRUE(hexDecode(text.data(), textLen, back.data(), len));
+        auto t2 = std::chrono::steady_clock::now();
+        textLen = base64Encode(bytes.data(), size, text.data());
+        auto t3 = std::chrono::steady_clock::now();
+        TEST_ASSERT_TRUE(base64Decode(text.data(), textLen, back.data(), len));
+        auto t4 = std::chrono::steady_clock::now();
+        codecAllocs += mock::allocations - before;
+        TEST_ASSERT_TRUE(back == bytes);
+        hexEncUs += std::chrono::duration<double, std::micro>(t1 - t0).count();
+        hexDecUs += std::chrono::duration<double, std::micro>(t2 - t1).count();
+        b64EncUs += std::chrono::duration<double, std::micro>(t3 - t2).count();
+        b64DecUs += std::chrono::duration<double, std::micro>(t4 - t3).count();
+
+        before = mock::allocations;
+        t0 = std::chrono::steady_clock::now();
+        std::string legacy = legacyHexEncode(bytes);
+        t1 = std::chrono::steady_clock::now();
+        std::vector<uint8_t> legacyBack = legacyHexDecode(legacy);
+        t2 = std::chrono::steady_clock::now();
+        oldAllocs += mock::allocations - before;
+        TEST_ASSERT_TRUE(legacyBack == bytes);
+        oldEncUs += std::chrono::duration<double, std::micro>(t1 - t0).count();
+        oldDecUs += std::chrono::duration<double, std::micro>(t2 - t1).count();
+    }
+
+    printf("%zu bytes:               encode      decode   allocations\n", size);
+    printf("  hex, tables        %9.1f us %9.1f us %8zu\n", hexEncUs / rounds, hexDecUs / rounds, codecAllocs / rounds);
+    printf("  base64, tables     %9.1f us %9.1f us\n", b64EncUs / rounds, b64DecUs / rounds);
+    printf("  hex, sprintf/strtol%9.1f us %9.1f us %8zu\n", oldEncUs / rounds, oldDecUs / rounds, oldAllocs / rounds);
+
+    TEST_ASSERT_EQUAL(0, codecAllocs);
+    TEST_ASSERT_TRUE(hexEncUs < oldEncUs);
+    TEST_ASSERT_TRUE(hexDecUs < oldDecUs);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_hex_encodes_uppercase);
+    RUN_TEST(test_hex_decodes_either_case_in_place);
+    RUN_TEST(test_hex_rejects_bad_input);
+    RUN_TEST(test_base64_rfc_vectors);
+    RUN_TEST(test_base64_rejects_bad_input);
+    RUN_TEST(test_round_trips_every_length);
+    RUN_TEST(test_matches_legacy_hex);
+    RUN_TEST(test_benchmark_64k);
+    return UNITY_END();
+}
@@ -0,0 +1,167 @@
+// Host-side tests and benchmark for the crypto core, on software mbedtls.
+// The benchmark is the sweep POST /api/crypto/benchmark runs on the board,
+// so its figures are the software baseline for the AES peripheral's.
+// Heap allocations are counted through a global operator new, to check
+// that the span and scratch calls do not allocate.
+//
+//   pio test -e native -f test_native_crypto -v
+
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "alloc_counter.h"
+#include "crypto_core.h"
+
+// NIST SP 800-38A F.2.5, CBC-AES256, first block
+static const uint8_t NIST_KEY[32] = {
+    0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+    0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4};
+static const uint8_t NIST_IV[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+static const uint8_t NIST_PLAIN[16] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
+static const uint8_t NIST_CIPHER[16] = {
+    0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba, 0x77, 0x9e, 0xab, 0xfb, 0x5f, 0x7b, 0xfb, 0xd6};
+
+static CryptoAesContext enc;
+static CryptoAesContext dec;
+
+void setUp() {
+    cryptoAesInit(&enc);
+    cryptoAesInit(&dec);
+    TEST_ASSERT_TRUE(cryptoAesSetKey(&enc, NIST_KEY, true));
+    TEST_ASSERT_TRUE(cryptoAesSetKey(&dec, NIST_KEY, false));
+}
+
+void tearDown() {
+    cryptoAesFree(&enc);
+    cryptoAesFree(&dec);
+}
+
+void test_matches_nist_vector() {
+    uint8_t out[32];
+    size_t outLen;
+    TEST_ASSERT_TRUE(cryptoCbcEncrypt(&enc, NIST_IV, NIST_PLAIN, 16, out, sizeof(out), outLen));
+    TEST_ASSERT_EQUAL(32, outLen);
+    TEST_ASSERT_EQUAL_MEMORY(NIST_CIPHER, out, 16);
+
+    uint8_t back[32];
+    TEST_ASSERT_TRUE(cryptoCbcDecrypt(&dec, NIST_IV, out, outLen, back, sizeof(back), outLen));
+    TEST_ASSERT_EQUAL(16, outLen);
+    TEST_ASSERT_EQUAL_MEMORY(NIST_PLAIN, back, 16);
+}
+
+void test_round_trips_every_length_in_place() {
+    std::vector<uint8_t> plain(100);
+    for (size_t i = 0; i < plain.size(); i++) {
+        plain[i] = (uint8_t)(i * 7 + 1);
+    }
+    std::vector<uint8_t> buffer(cryptoPaddedSize(plain.size()));
+
+    for (size_t len = 0; len <= plain.size(); len++) {
+        size_t outLen;
+        memcpy(buffer.data(), plain.data(), len);
+        TEST_ASSERT_TRUE(cryptoCbcEncrypt(&enc, NIST_IV, buffer.data(), len, buffer.data(), buffer.size(), outLen));
+        TEST_ASSERT_EQUAL(cryptoPaddedSize(len), outLen);
+        TEST_ASSERT_TRUE(cryptoCbcDecrypt(&dec, NIST_IV, buffer.data(), outLen, buffer.data(), buffer.size(), outLen));
+        TEST_ASSERT_EQUAL(len, outLen);
+        TEST_ASSERT_EQUAL_MEMORY(plain.data(), buffer.data(), len);
+    }
+}
+
+void test_rejects_short_output_and_bad_input() {
+    uint8_t out[32];
+    size_t outLen;
+    TEST_ASSERT_FALSE(cryptoCbcEncrypt(&enc, NIST_IV, NIST_PLAIN, 16, out, 31, outLen));
+    TEST_ASSERT_FALSE(cryptoCbcDecrypt(&dec, NIST_IV, out, 0, out, sizeof(out), outLen));
+    TEST_ASSERT_FALSE(cryptoCbcDecrypt(&dec, NIST_IV, out, 17, out, sizeof(out), outLen));
+
+    // A wrong key shows as bad padding
+    TEST_ASSERT_TRUE(cryptoCbcEncrypt(&enc, NIST_IV, NIST_PLAIN, 16, out, sizeof(out), outLen));
+    static const uint8_t otherKey[32] = {1};
+    CryptoAesContext other;
+    cryptoAesInit(&other);
+    TEST_ASSERT_TRUE(cryptoAesSetKey(&other, otherKey, false));
+    TEST_ASSERT_FALSE(cryptoCbcDecrypt(&other, NIST_IV, out, outLen, out, sizeof(out), outLen));
+    cryptoAesFree(&other);
+}
+
+void test_span_calls_do_not_allocate() {
+    uint8_t plain[200];
+    uint8_t cipher[208];   // cryptoPaddedSize(200)
+    uint8_t back[sizeof(cipher)];
+    memset(plain, 0x5A, sizeof(plain));
+
+    size_t before = mock::allocations;
+    for (int round = 0; round < 1000; round++) {
+        size_t len = round % sizeof(plain);
+        size_t cipherLen, backLen;
+        TEST_ASSERT_TRUE(cryptoCbcEncrypt(&enc, NIST_IV, plain, len, cipher, sizeof(cipher), cipherLen));
+        TEST_ASSERT_TRUE(cryptoCbcDecrypt(&dec, NIST_IV, cipher, cipherLen, back, sizeof(back), backLen));
+        TEST_ASSERT_EQUAL(len, backLen);
+    }
+    TEST_ASSERT_EQUAL(0, mock::allocations - before);
+}
+
+void test_scratch_allocates_only_to_grow() {
+    uint8_t plain[200];
+    memset(plain, 0xC3, sizeof(plain));
+    CryptoScratch encScratch;
+    CryptoScratch decScratch;
+
+    // The first call at the largest size sizes both buffers
+    size_t before = mock::allocations;
+    uint8_t* cipher = encScratch.get(cryptoPaddedSize(sizeof(plain)));
+    decScratch.get(cryptoPaddedSize(sizeof(plain)));
+    TEST_ASSERT_EQUAL(2, mock::allocations - before);
+
+    before = mock::allocations;
+    for (int round = 0; round < 1000; round++) {
+        size_t len = round % sizeof(plain);
+        size_t cipherLen, backLen;
+        cipher = encScratch.get(cryptoPaddedSize(len));
+        TEST_ASSERT_TRUE(cryptoCbcEncrypt(&enc, NIST_IV, plain, len, cipher, cryptoPaddedSize(len), cipherLen));
+        uint8_t* back = decScratch.get(cipherLen);
+        TEST_ASSERT_TRUE(cryptoCbcDecrypt(&dec, NIST_IV, cipher, cipherLen, back, cipherLen, backLen));
+        TEST_ASSERT_EQUAL_MEMORY(plain, back, len);
+    }
+    TEST_ASSERT_EQUAL(0, mock::allocations - before);
+
+    // Trimming below its size frees it; the next call allocates again
+    encScratch.trim(16);
+    before = mock::allocations;
+    encScratch.get(16);
+    TEST_ASSERT_EQUAL(1, mock::allocations - before);
+}
+
+static unsigned long hostMicros() {
+    using namespace std::chrono;
+    return (unsigned long)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void printLine(const char* line, void* arg) {
+    (*(int*)arg)++;
+    printf("%s\n", line);
+}
+
+void test_benchmark() {
+    std::vector<uint8_t> buffer(CRYPTO_BENCH_MAX_BYTES);
+    int lines = 0;
+    printf("AES: " CRYPTO_BACKEND_NAME ", SHA: " CRYPTO_SHA_NAME "\n");
+    TEST_ASSERT_TRUE(cryptoBenchmark(&enc, &dec, buffer.data(), buffer.size(), hostMicros, printLine, &lines));
+    // Heading, then 16 B to 1 MB
+    TEST_ASSERT_EQUAL(10, lines);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_matches_nist_vector);
+    RUN_TEST(test_round_trips_every_length_in_place);
+    RUN_TEST(test_rejects_short_output_and_bad_input);
+    RUN_TEST(test_span_calls_do_not_allocate);
+    RUN_TEST(test_scratch_allocates_only_to_grow);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
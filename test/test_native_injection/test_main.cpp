@@ -0,0 +1,184 @@
+// Host-side harness for the injection path: types a macro corpus through
+// HidInjector into a mock keyboard, decodes the reports back to text for
+// each layout and reports throughput in virtual time.
+//
+//   pio test -e native -v
+
+#include <unity.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "USBHIDKeyboard.h"
+#include "hid_decoder.h"
+#include "hid_injector.h"
+
+static USBHIDKeyboard keyboard;
+
+static std::vector<std::string> buildCorpus() {
+    std::vector<std::string> corpus = {
+        "Hello world",
+        "admin\tpassword123\n",
+        "user@example.com",
+        "aaaa bbbb 1111 ----",
+        "The quick brown fox jumps over the lazy dog.\n",
+        "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG!\n",
+        "ssh -i ~/.ssh/id_rsa root@10.0.0.1 'echo ${HOME} | tr a-z A-Z'\n",
+        "if (a[i] != b[i] && c <= 0x7f) { return \"%s\"; }\n",
+        "^`~'\"",
+    };
+
+    // Every printable character, plus the same text doubled up
+    std::string printable;
+    for (char c = 0x20; c < 0x7f; c++) {
+        printable += c;
+    }
+    corpus.push_back(printable);
+    corpus.push_back(printable + printable);
+
+    // A long config-style paste
+    std::string config;
+    for (int i = 0; i < 64; i++) {
+        config += "key_" + std::to_string(i) + " = \"value-" + std::to_string(i * 37) + "\"\n";
+    }
+    corpus.push_back(config);
+
+    return corpus;
+}
+
+struct RunStats {
+    size_t chars = 0;
+    size_t reports = 0;
+    uint64_t timeUs = 0;
+    size_t mismatches = 0;
+};
+
+static RunStats runCorpus(KeyboardLayoutId layout, uint8_t maxKeys, uint32_t intervalUs) {
+    std::vector<std::string> corpus = buildCorpus();
+    HidInjector& injector = HidInjector::getInstance();
+    HidDecoder decoder(layout);
+    RunStats stats;
+
+    for (const std::string& text : corpus) {
+        keyboard.reports.clear();
+        injector.begin(&keyboard);
+        injector.setMaxKeysPerReport(maxKeys);
+        injector.setReportInterval(intervalUs);
+
+        uint64_t start = mock::nowUs;
+        injector.typeText(text.data(), text.size(), layout);
+        stats.timeUs += mock::nowUs - start;
+
+        std::string typed = decoder.decode(keyboard.reports);
+        if (typed != text) {
+            stats.mismatches++;
+            printf("  mismatch [%s]: expected \"%s\", got \"%s\"\n",
+                   keyboardLayoutName(layout), text.c_str(), typed.c_str());
+        }
+        stats.chars += text.size();
+        stats.reports += keyboard.reports.size();
+    }
+    return stats;
+}
+
+static void printStats(const char* label, KeyboardLayoutId layout, const RunStats& stats) {
+    double seconds = stats.timeUs / 1e6;
+    printf("%-10s %-3s %6zu chars %6zu reports %8.1f ms %7.0f keys/s %zu mismatches\n",
+           label, keyboardLayoutName(layout), stats.chars, stats.reports,
+           stats.timeUs / 1000.0, stats.chars / seconds, stats.mismatches);
+}
+
+void setUp() {
+    mock::nowUs = 0;
+    keyboard.pollIntervalUs = HID_POLL_INTERVAL_US;
+}
+
+void tearDown() {}
+
+void test_corpus_round_trips_packed() {
+    for (int layout = 0; layout < LAYOUT_COUNT; layout++) {
+        RunStats stats = runCorpus((KeyboardLayoutId)layout, 6, HID_POLL_INTERVAL_US);
+        printStats("packed", (KeyboardLayoutId)layout, stats);
+        TEST_ASSERT_EQUAL(0, stats.mismatches);
+    }
+}
+
+void test_corpus_round_trips_one_key_per_report() {
+    for (int layout = 0; layout < LAYOUT_COUNT; layout++) {
+        RunStats stats = runCorpus((KeyboardLayoutId)layout, 1, HID_POLL_INTERVAL_US);
+        printStats("single", (KeyboardLayoutId)layout, stats);
+        TEST_ASSERT_EQUAL(0, stats.mismatches);
+    }
+}
+
+void test_corpus_round_trips_slow_host() {
+    RunStats stats = runCorpus(LAYOUT_DEFAULT, 6, 8000);
+    printStats("slow", LAYOUT_DEFAULT, stats);
+    TEST_ASSERT_EQUAL(0, stats.mismatches);
+}
+
+void test_packing_beats_one_key_per_report() {
+    RunStats packed = runCorpus(LAYOUT_US, 6, HID_POLL_INTERVAL_US);
+    RunStats single = runCorpus(LAYOUT_US, 1, HID_POLL_INTERVAL_US);
+    TEST_ASSERT_TRUE(packed.reports < single.reports);
+    TEST_ASSERT_TRUE(packed.timeUs < single.timeUs);
+}
+
+void test_one_report_per_poll_frame() {
+    // With the default interval no poll frame should go unused
+    HidInjector& injector = HidInjector::getInstance();
+    keyboard.reports.clear();
+    injector.begin(&keyboard);
+    injector.setMaxKeysPerReport(1);
+    injector.setReportInterval(HID_POLL_INTERVAL_US);
+
+    injector.typeText("abcdefgh", 8, LAYOUT_US);
+
+    TEST_ASSERT_EQUAL(9, keyboard.reports.size());
+    for (size_t i = 1; i < keyboard.reports.size(); i++) {
+        TEST_ASSERT_EQUAL(HID_POLL_INTERVAL_US,
+                          keyboard.reports[i].timeUs - keyboard.reports[i - 1].timeUs);
+    }
+}
+
+void test_repeated_key_is_released_between_presses() {
+    HidInjector& injector = HidInjector::getInstance();
+    keyboard.reports.clear();
+    injector.begin(&keyboard);
+    injector.setMaxKeysPerReport(6);
+
+    injector.typeText("aaa", 3, LAYOUT_US);
+
+    // a, release, a, release, a, release
+    TEST_ASSERT_EQUAL(6, keyboard.reports.size());
+    HidDecoder decoder(LAYOUT_US);
+    TEST_ASSERT_EQUAL_STRING("aaa", decoder.decode(keyboard.reports).c_str());
+}
+
+void test_cancel_from_progress_releases_keys() {
+    HidInjector& injector = HidInjector::getInstance();
+    keyboard.reports.clear();
+    injector.begin(&keyboard);
+
+    auto stopAfterThree = [](size_t done, size_t total, void* ctx) { return done < 3; };
+    injector.typeText("abcdef", 6, LAYOUT_US, stopAfterThree);
+
+    const KeyReport& last = keyboard.reports.back().report;
+    TEST_ASSERT_EQUAL(0, last.modifiers);
+    TEST_ASSERT_EQUAL(0, last.keys[0]);
+
+    HidDecoder decoder(LAYOUT_US);
+    TEST_ASSERT_EQUAL_STRING("abc", decoder.decode(keyboard.reports).c_str());
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_corpus_round_trips_packed);
+    RUN_TEST(test_corpus_round_trips_one_key_per_report);
+    RUN_TEST(test_corpus_round_trips_slow_host);
+    RUN_TEST(test_packing_beats_one_key_per_report);
+    RUN_TEST(test_one_report_per_poll_frame);
+    RUN_TEST(test_repeated_key_is_released_between_presses);
+    RUN_TEST(test_cancel_from_progress_releases_keys);
+    return UNITY_END();
+}
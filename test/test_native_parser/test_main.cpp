@@ -0,0 +1,300 @@
+// Host-side tests and benchmark for the macro file parser. The benchmark
+// compares the single-pass parser with the substring/replace approach it
+// replaced, counting heap allocations through a global operator new.
+//
+//   pio test -e native -f test_native_parser -v
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "alloc_counter.h"
+#include "macro_parser.h"
+
+struct ParsedMacro {
+    std::string name;
+    std::string content;
+    bool sensitive;
+    KeyboardLayoutId layout;
+};
+
+static void collect(const MacroRecord& record, void* ctx) {
+    std::vector<ParsedMacro>* out = (std::vector<ParsedMacro>*)ctx;
+    out->push_back({std::string(record.name, record.nameLen),
+                    std::string(record.content, record.contentLen),
+                    record.sensitive, record.layout});
+}
+
+static void count(const MacroRecord& record, void* ctx) {
+    (*(size_t*)ctx) += record.contentLen;
+}
+
+static std::vector<ParsedMacro> parse(const char* text, MacroParseStats* stats = nullptr) {
+    std::vector<char> buf(text, text + strlen(text));
+    std::vector<ParsedMacro> out;
+    MacroParseStats s = parseMacroBuffer(buf.data(), buf.size(), collect, &out);
+    if (stats) {
+        *stats = s;
+    }
+    return out;
+}
+
+// The per-line substring/trim/replace parsing this module replaced
+static void replaceAll(std::string& s, const char* from, const char* to) {
+    size_t fromLen = strlen(from);
+    size_t toLen = strlen(to);
+    for (size_t pos = s.find(from); pos != std::string::npos; pos = s.find(from, pos + toLen)) {
+        s.replace(pos, fromLen, to);
+    }
+}
+
+static void trim(std::string& s) {
+    size_t start = s.find_first_not_of(" \t\r\n\v\f");
+    size_t end = s.find_last_not_of(" \t\r\n\v\f");
+    s = (start == std::string::npos) ? std::string() : s.substr(start, end - start + 1);
+}
+
+static size_t legacyParse(const std::string& file, std::vector<ParsedMacro>& out) {
+    size_t start = 0;
+    while (start < file.size()) {
+        size_t end = file.find('\n', start);
+        std::string line = file.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        start = (end == std::string::npos) ? file.size() : end + 1;
+
+        trim(line);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        bool sensitive = line.compare(0, 10, "SENSITIVE:") == 0;
+        if (sensitive) {
+            line = line.substr(10);
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            continue;
+        }
+        std::string content = line.substr(colon + 1);
+        replaceAll(content, "\\n", "\n");
+        replaceAll(content, "\\t", "\t");
+        replaceAll(content, "\\\\", "\\");
+        out.push_back({line.substr(0, colon), content, sensitive, LAYOUT_DEFAULT});
+    }
+    return out.size();
+}
+
+static std::string buildFile(size_t macroCount) {
+    std::string file = "# Generated macro file\n#!LAYOUT:US\n\n";
+    for (size_t i = 0; i < macroCount; i++) {
+        if (i % 10 == 0) {
+            file += "# Section " + std::to_string(i / 10) + "\n";
+        }
+        if (i % 4 == 0) {
+            file += "SENSITIVE:";
+        }
+        file += "Macro" + std::to_string(i) + ":user" + std::to_string(i) +
+                "@example.com\\tSecretPass" + std::to_string(i * 7) + "!\\n\r\n";
+    }
+    return file;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_parses_names_content_and_flags() {
+    MacroParseStats stats;
+    std::vector<ParsedMacro> macros = parse(
+        "# comment\n"
+        "Email:user@example.com\n"
+        "  SENSITIVE:Login:admin\\tpass\\n  \n"
+        "\n"
+        "Url:http://host:8080/path\n",
+        &stats);
+
+    TEST_ASSERT_EQUAL(3, macros.size());
+    TEST_ASSERT_EQUAL_STRING("Email", macros[0].name.c_str());
+    TEST_ASSERT_EQUAL_STRING("user@example.com", macros[0].content.c_str());
+    TEST_ASSERT_FALSE(macros[0].sensitive);
+    TEST_ASSERT_EQUAL_STRING("Login", macros[1].name.c_str());
+    TEST_ASSERT_EQUAL_STRING("admin\tpass\n", macros[1].content.c_str());
+    TEST_ASSERT_TRUE(macros[1].sensitive);
+    TEST_ASSERT_EQUAL_STRING("http://host:8080/path", macros[2].content.c_str());
+
+    TEST_ASSERT_EQUAL(5, stats.lines);
+    TEST_ASSERT_EQUAL(3, stats.macros);
+    TEST_ASSERT_EQUAL(1, stats.sensitive);
+}
+
+void test_skips_lines_without_a_name() {
+    std::vector<ParsedMacro> macros = parse(":no name\nno colon\nSENSITIVE:\nSENSITIVE::x\nok:\n");
+    TEST_ASSERT_EQUAL(1, macros.size());
+    TEST_ASSERT_EQUAL_STRING("ok", macros[0].name.c_str());
+    TEST_ASSERT_EQUAL(0, macros[0].content.size());
+}
+
+void test_escapes_decode_in_one_pass() {
+    std::vector<ParsedMacro> macros = parse("A:a\\\\nb\nB:\\x\\\nC:C:\\\\\\t\r\nD:last line");
+    TEST_ASSERT_EQUAL(4, macros.size());
+    // An escaped backslash does not start another escape
+    TEST_ASSERT_EQUAL_STRING("a\\nb", macros[0].content.c_str());
+    // Unknown escapes and a trailing backslash are kept as they are
+    TEST_ASSERT_EQUAL_STRING("\\x\\", macros[1].content.c_str());
+    TEST_ASSERT_EQUAL_STRING("C:\\\t", macros[2].content.c_str());
+    TEST_ASSERT_EQUAL_STRING("last line", macros[3].content.c_str());
+}
+
+void test_layout_directive_applies_to_following_macros() {
+    MacroParseStats stats;
+    std::vector<ParsedMacro> macros = parse(
+        "A:1\n#!LAYOUT: de \nB:2\n#!LAYOUT:XX\nC:3\n#!LAYOUT:FR\n", &stats);
+    TEST_ASSERT_EQUAL(3, macros.size());
+    TEST_ASSERT_EQUAL(LAYOUT_DEFAULT, macros[0].layout);
+    TEST_ASSERT_EQUAL(LAYOUT_DE, macros[1].layout);
+    TEST_ASSERT_EQUAL(LAYOUT_DE, macros[2].layout);
+    TEST_ASSERT_EQUAL(1, stats.badLayouts);
+    TEST_ASSERT_EQUAL(LAYOUT_FR, stats.layout);
+}
+
+void test_matches_legacy_parser() {
+    std::string file = buildFile(200);
+    std::vector<ParsedMacro> legacy;
+    legacyParse(file, legacy);
+
+    std::vector<char> buf(file.begin(), file.end());
+    std::vector<ParsedMacro> macros;
+    parseMacroBuffer(buf.data(), buf.size(), collect, &macros);
+
+    TEST_ASSERT_EQUAL(legacy.size(), macros.size());
+    for (size_t i = 0; i < macros.size(); i++) {
+        TEST_ASSERT_EQUAL_STRING(legacy[i].name.c_str(), macros[i].name.c_str());
+        TEST_ASSERT_EQUAL_STRING(legacy[i].content.c_str(), macros[i].content.c_str());
+        TEST_ASSERT_EQUAL(legacy[i].sensitive, macros[i].sensitive);
+    }
+}
+
+// Feed the file in pieces of the given size, as read from SD
+static MacroParseStats parseInPieces(const std::string& file, size_t piece,
+                                     std::vector<ParsedMacro>& out) {
+    MacroStreamParser parser(collect, &out);
+    std::vector<char> buf(piece);
+    for (size_t pos = 0; pos < file.size(); pos += piece) {
+        size_t len = file.size() - pos < piece ? file.size() - pos : piece;
+        memcpy(buf.data(), file.data() + pos, len);
+        parser.feed(buf.data(), len);
+    }
+    return parser.finish();
+}
+
+void test_stream_matches_whole_buffer() {
+    std::string file = buildFile(300) + "#!LAYOUT:DE\nTail:no newline\\t";
+    std::vector<char> buf(file.begin(), file.end());
+    std::vector<ParsedMacro> whole;
+    MacroParseStats wholeStats = parseMacroBuffer(buf.data(), buf.size(), collect, &whole);
+
+    const size_t pieces[] = {1, 2, 7, 64, 1024, 100000};
+    for (size_t piece : pieces) {
+        std::vector<ParsedMacro> macros;
+        MacroParseStats stats = parseInPieces(file, piece, macros);
+        TEST_ASSERT_EQUAL(whole.size(), macros.size());
+        for (size_t i = 0; i < macros.size(); i++) {
+            TEST_ASSERT_EQUAL_STRING(whole[i].name.c_str(), macros[i].name.c_str());
+            TEST_ASSERT_EQUAL_STRING(whole[i].content.c_str(), macros[i].content.c_str());
+            TEST_ASSERT_EQUAL(whole[i].sensitive, macros[i].sensitive);
+            TEST_ASSERT_EQUAL(whole[i].layout, macros[i].layout);
+        }
+        TEST_ASSERT_EQUAL(wholeStats.lines, stats.lines);
+        TEST_ASSERT_EQUAL(wholeStats.sensitive, stats.sensitive);
+        TEST_ASSERT_EQUAL(LAYOUT_DE, stats.layout);
+    }
+}
+
+void test_stream_memory_does_not_grow_with_file() {
+    std::string file = buildFile(20000);
+    size_t total = 0;
+    MacroStreamParser parser(count, &total);
+    std::vector<char> buf(1024);
+    size_t before = mock::allocations;
+    for (size_t pos = 0; pos < file.size(); pos += buf.size()) {
+        size_t len = file.size() - pos < buf.size() ? file.size() - pos : buf.size();
+        memcpy(buf.data(), file.data() + pos, len);
+        parser.feed(buf.data(), len);
+    }
+    MacroParseStats stats = parser.finish();
+    size_t used = mock::allocations - before;
+    printf("%zu bytes in 1 KB pieces: %zu allocations\n", file.size(), used);
+
+    TEST_ASSERT_EQUAL(20000, stats.macros);
+    // Only the split-line buffer, grown to the longest line once
+    TEST_ASSERT_TRUE(used < 16);
+}
+
+static void benchmark(size_t macroCount) {
+    std::string file = buildFile(macroCount);
+    const int rounds = 5;
+    double parseUs = 0, collectUs = 0, legacyUs = 0;
+    size_t parseAllocs = 0, collectAllocs = 0, legacyAllocs = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        std::vector<char> buf(file.begin(), file.end());
+        size_t bytes = 0;
+        size_t before = mock::allocations;
+        auto t0 = std::chrono::steady_clock::now();
+        MacroParseStats stats = parseMacroBuffer(buf.data(), buf.size(), count, &bytes);
+        auto t1 = std::chrono::steady_clock::now();
+        parseAllocs += mock::allocations - before;
+        parseUs += std::chrono::duration<double, std::micro>(t1 - t0).count();
+        TEST_ASSERT_EQUAL(macroCount, stats.macros);
+
+        // Parser plus the records a caller keeps
+        std::vector<char> buf2(file.begin(), file.end());
+        std::vector<ParsedMacro> macros;
+        macros.reserve(macroCount);
+        before = mock::allocations;
+        t0 = std::chrono::steady_clock::now();
+        parseMacroBuffer(buf2.data(), buf2.size(), collect, &macros);
+        t1 = std::chrono::steady_clock::now();
+        collectAllocs += mock::allocations - before;
+        collectUs += std::chrono::duration<double, std::micro>(t1 - t0).count();
+
+        std::vector<ParsedMacro> legacy;
+        legacy.reserve(macroCount);
+        before = mock::allocations;
+        t0 = std::chrono::steady_clock::now();
+        legacyParse(file, legacy);
+        t1 = std::chrono::steady_clock::now();
+        legacyAllocs += mock::allocations - before;
+        legacyUs += std::chrono::duration<double, std::micro>(t1 - t0).count();
+    }
+
+    printf("%6zu macros, %7zu bytes:\n", macroCount, file.size());
+    printf("  single pass      %9.1f us %8zu allocations\n", parseUs / rounds, parseAllocs / rounds);
+    printf("  + keep records   %9.1f us %8zu allocations\n", collectUs / rounds, collectAllocs / rounds);
+    printf("  substring/replace%9.1f us %8zu allocations\n", legacyUs / rounds, legacyAllocs / rounds);
+
+    TEST_ASSERT_EQUAL(0, parseAllocs);
+    TEST_ASSERT_TRUE(collectAllocs < legacyAllocs);
+}
+
+void test_benchmark_1k() {
+    benchmark(1000);
+}
+
+void test_benchmark_10k() {
+    benchmark(10000);
+}
+
+int main(int argc, char** argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_parses_names_content_and_flags);
+    RUN_TEST(test_skips_lines_without_a_name);
+    RUN_TEST(test_escapes_decode_in_one_pass);
+    RUN_TEST(test_layout_directive_applies_to_following_macros);
+    RUN_TEST(test_matches_legacy_parser);
+    RUN_TEST(test_stream_matches_whole_buffer);
+    RUN_TEST(test_stream_memory_does_not_grow_with_file);
+    RUN_TEST(test_benchmark_1k);
+    RUN_TEST(test_benchmark_10k);
+    return UNITY_END();
+}